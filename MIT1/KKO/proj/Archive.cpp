@@ -0,0 +1,461 @@
+/**
+ * Implementation of the Archive class. An archive packs many encoded images
+ * into a single file behind a central directory, so that small images do
+ * not each pay for opening and reading a separate file.
+ * The layout is described in `encoded_format`. The archive is mapped
+ * into memory, so looking up and decoding a single entry is a constant time
+ * seek into the mapping, followed by decoding just that entry.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "Archive.hpp"
+#include "Checksum.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Store `value` as a big endian integer of `bytes` bytes.
+ */
+static void put_be(uint8_t *dst, uint64_t value, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--) {
+        dst[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+/**
+ * Load a big endian integer of `bytes` bytes.
+ */
+static uint64_t get_be(const uint8_t *src, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | src[i];
+    }
+    return value;
+}
+
+/**
+ * Write `size` bytes of `data` to `fd` at `offset`.
+ * @throws const char * if the data could not be written.
+ */
+static void write_all(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = pwrite(fd, data + written, size - written, offset + written);
+        if (n <= 0) {
+            throw "Archive could not be written.";
+        }
+        written += n;
+    }
+}
+
+/**
+ * Open the archive at `path`. If `writable` is set, the archive is created
+ * if it does not exist and its directory is loaded into memory, so that
+ * entries may be appended.
+ * @param path path to the archive file.
+ * @param writable true to allow appending.
+ */
+Archive::Archive(std::string path, bool writable)
+{
+    this->path = path;
+    this->writable = writable;
+
+    this->fd = writable ? open(path.c_str(), O_RDWR | O_CREAT, 0644)
+        : open(path.c_str(), O_RDONLY);
+    if (this->fd < 0) {
+        throw "Archive could not be opened.";
+    }
+
+    try
+    {
+        map_file();
+
+        if (writable && this->map_size == 0) {
+            // A new archive: the header with the commit of an empty directory.
+            uint8_t header[ARCHIVE_HEADER_SIZE] = {};
+            memcpy(header, ARCHIVE_MAGIC, 4);
+            put_be(header + 4, ARCHIVE_VERSION, 4);
+            write_all(this->fd, header, ARCHIVE_HEADER_SIZE, 0);
+            commit(ARCHIVE_HEADER_SIZE, 0, 0);
+            map_file();
+        }
+    }
+    catch(const char *e)
+    {
+        unmap_file();
+        close(this->fd);
+        throw;
+    }
+
+    if (writable) {
+        for (uint64_t i = 0; i < this->entry_count; i++) {
+            this->entries.push_back(parse_entry(i));
+        }
+    }
+}
+
+Archive::~Archive()
+{
+    if (this->dirty) {
+        try
+        {
+            flush();
+        }
+        catch(const char *e)
+        {
+            // Nothing more can be done in a destructor.
+        }
+    }
+
+    unmap_file();
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+/**
+ * Map the archive into memory and read its header. An empty file is
+ * a valid, empty archive. Of the two commit slots of the header, the valid
+ * one (by its checksum and bounds) with the higher sequence number
+ * describes the archive, so an interrupted write of a slot leaves
+ * the other one in effect. Bytes after the committed directory (left by
+ * an interrupted append) are overwritten by the next append.
+ */
+void Archive::map_file()
+{
+    struct stat results;
+    if (fstat(this->fd, &results) != 0) {
+        throw "Archive could not be opened.";
+    }
+
+    this->map_size = results.st_size;
+    this->dir_offset = ARCHIVE_HEADER_SIZE;
+    this->entry_count = 0;
+    this->names_size = 0;
+    this->sequence = 0;
+    if (this->map_size == 0) {
+        return;
+    }
+
+    if (this->map_size < ARCHIVE_HEADER_SIZE) {
+        throw "Not an archive.";
+    }
+
+    void *map = mmap(nullptr, this->map_size, PROT_READ, MAP_SHARED, this->fd, 0);
+    if (map == MAP_FAILED) {
+        throw "Archive could not be mapped.";
+    }
+    this->map = (uint8_t *) map;
+
+    if (memcmp(this->map, ARCHIVE_MAGIC, 4) != 0
+        || get_be(this->map + 4, 4) != ARCHIVE_VERSION) {
+        throw "Not an archive.";
+    }
+
+    for (int i = 0; i < 2; i++) {
+        const uint8_t *slot = this->map + 8 + i * ARCHIVE_SLOT_SIZE;
+        const uint64_t sequence = get_be(slot, 8);
+        const uint64_t dir_offset = get_be(slot + 8, 8);
+        const uint64_t entry_count = get_be(slot + 16, 8);
+        const uint64_t names_size = get_be(slot + 24, 4);
+        if (sequence <= this->sequence
+            || crc32c(slot, ARCHIVE_SLOT_SIZE - 4) != get_be(slot + 28, 4)
+            || dir_offset < ARCHIVE_HEADER_SIZE || dir_offset > this->map_size
+            || entry_count > (this->map_size - dir_offset) / ARCHIVE_ENTRY_SIZE
+            || names_size > this->map_size - dir_offset - entry_count * ARCHIVE_ENTRY_SIZE) {
+            continue;
+        }
+        this->sequence = sequence;
+        this->dir_offset = dir_offset;
+        this->entry_count = entry_count;
+        this->names_size = names_size;
+    }
+    if (this->sequence == 0) {
+        throw "Not an archive.";
+    }
+
+    this->data_end = this->dir_offset;
+    this->live_offset = this->dir_offset;
+    this->live_size = this->entry_count * ARCHIVE_ENTRY_SIZE + this->names_size;
+    this->committed = this->entry_count;
+}
+
+void Archive::unmap_file()
+{
+    if (this->map != nullptr) {
+        munmap(this->map, this->map_size);
+        this->map = nullptr;
+    }
+}
+
+/**
+ * Parse directory entry `index` from the mapped archive.
+ * Entry layout (big endian): offset (8 B), size (8 B), width (4 B),
+ * height (4 B), options (1 B), reserved (3 B), name offset (4 B, relative
+ * to the end of the entry table), name length (4 B).
+ */
+struct archive_entry Archive::parse_entry(uint64_t index)
+{
+    const uint8_t *e = this->map + this->dir_offset + index * ARCHIVE_ENTRY_SIZE;
+    struct archive_entry entry;
+
+    entry.offset = get_be(e, 8);
+    entry.size = get_be(e + 8, 8);
+    entry.width = get_be(e + 16, 4);
+    entry.height = get_be(e + 20, 4);
+    entry.options = e[24];
+
+    const uint64_t names = this->dir_offset + this->entry_count * ARCHIVE_ENTRY_SIZE;
+    const uint64_t name_offset = get_be(e + 28, 4);
+    const uint64_t name_len = get_be(e + 32, 4);
+
+    if (entry.offset < ARCHIVE_HEADER_SIZE || entry.offset > this->dir_offset
+        || entry.size > this->dir_offset - entry.offset
+        || name_offset > this->names_size || name_len > this->names_size - name_offset) {
+        throw "Corrupted archive directory.";
+    }
+    entry.name.assign((const char *) this->map + names + name_offset, name_len);
+
+    return entry;
+}
+
+/**
+ * @returns The number of entries in the archive.
+ */
+uint64_t Archive::count()
+{
+    return this->writable ? this->entries.size() : this->entry_count;
+}
+
+/**
+ * Returns the directory entry `index`. In read-only mode, this reads just
+ * the one entry from the mapping.
+ * @param index index of the entry, starting at 0.
+ * @returns The directory entry.
+ */
+struct archive_entry Archive::entry(uint64_t index)
+{
+    if (index >= count()) {
+        throw "Archive entry index out of range.";
+    }
+
+    return this->writable ? this->entries[index] : parse_entry(index);
+}
+
+/**
+ * Returns a pointer to the encoded stream of entry `index` inside
+ * the mapping. The pointer is valid until the archive is flushed or closed.
+ * @param index index of the entry.
+ * @param size pointer, via which the size of the stream is returned.
+ * @returns Pointer to the encoded stream (header included).
+ */
+const uint8_t *Archive::entry_data(uint64_t index, uint64_t *size)
+{
+    if (this->dirty) {
+        flush();
+    }
+
+    const struct archive_entry e = entry(index);
+    *size = e.size;
+    return this->map + e.offset;
+}
+
+/**
+ * Decode entry `index` into `out`, straight from the mapping. A delta frame
+ * (see Codec::encode_delta()) is restored by decoding its sequence from
+ * the closest preceding keyframe.
+ * @param index index of the entry.
+ * @param out pointer to vector, which will be overwritten with the pixels.
+ * @param width pointer, via which the image width is returned.
+ * @param height pointer, via which the image height is returned.
+ * @param buf optional intermediate buffers to be reused.
+ */
+void Archive::extract(
+    uint64_t index, std::vector<uint8_t> *out,
+    uint32_t *width, uint32_t *height, struct codec_buffers *buf)
+{
+    uint64_t size;
+    const uint8_t *data;
+
+    uint64_t key = index;
+    while (key > 0 && (entry(key).options & OPTION_DELTA)) {
+        key--;
+    }
+    const struct archive_entry key_entry = entry(key);
+    if (key_entry.options & OPTION_DELTA) {
+        throw "Archive entry is a delta frame without a keyframe.";
+    }
+
+    data = entry_data(key, &size);
+    if (key == index) {
+        Codec::decode(data, size, out, width, height, buf);
+        return;
+    }
+
+    std::vector<uint8_t> reference;
+    Codec::decode(data, size, &reference, width, height, buf);
+    for (uint64_t i = key + 1; i <= index; i++) {
+        const struct archive_entry e = entry(i);
+        if (e.width != key_entry.width || e.height != key_entry.height
+            || (e.options & OPTION_DEPTH16) != (key_entry.options & OPTION_DEPTH16)) {
+            throw "Archive entry is a delta frame of a different size.";
+        }
+        data = entry_data(i, &size);
+        Codec::decode_delta(data, size, &reference, out, width, height, buf);
+        if (i < index) {
+            reference.swap(*out);
+        }
+    }
+}
+
+/**
+ * Append an encoded stream (as produced by Codec::encode(), header included)
+ * to the archive. The stream is written right away after the data, over
+ * the old directory, the new directory is written by flush() (or when
+ * the archive is closed), so many appends only write the directory once.
+ * The committed directory must stay intact until then, so if the stream
+ * would overwrite it, it is moved further first, with room for the streams
+ * to come. An interrupted append thus loses only the entries appended since
+ * the last flush().
+ * @param name name of the entry.
+ * @param data pointer to the encoded stream.
+ * @param size size of the encoded stream.
+ */
+void Archive::append(const std::string &name, const uint8_t *data, size_t size)
+{
+    if (!this->writable) {
+        throw "Archive was not opened for writing.";
+    }
+    if (size < HEADER_SIZE) {
+        throw "Encoded image is missing its header.";
+    }
+
+    if (this->live_size > 0 && this->data_end + size > this->live_offset
+        && this->data_end < this->live_offset + this->live_size) {
+        move_directory(this->data_end + 2 * (size + this->appended + this->live_size));
+    }
+    write_all(this->fd, data, size, this->data_end);
+
+    struct archive_entry entry;
+    entry.offset = this->data_end;
+    entry.size = size;
+    entry.width = get_be(data, 4);
+    entry.height = get_be(data + 4, 4);
+    entry.options = data[8];
+    entry.name = name;
+    this->entries.push_back(entry);
+
+    this->data_end += size;
+    this->appended += size;
+    this->dirty = true;
+}
+
+/**
+ * Serialize the first `count` entries into a directory followed by
+ * the names area.
+ */
+std::vector<uint8_t> Archive::directory(uint64_t count)
+{
+    std::vector<uint8_t> dir(count * ARCHIVE_ENTRY_SIZE, 0);
+    std::string names;
+
+    for (uint64_t i = 0; i < count; i++) {
+        const struct archive_entry &entry = this->entries[i];
+        uint8_t *e = dir.data() + i * ARCHIVE_ENTRY_SIZE;
+
+        put_be(e, entry.offset, 8);
+        put_be(e + 8, entry.size, 8);
+        put_be(e + 16, entry.width, 4);
+        put_be(e + 20, entry.height, 4);
+        e[24] = entry.options;
+        put_be(e + 28, names.size(), 4);
+        put_be(e + 32, entry.name.size(), 4);
+        names += entry.name;
+    }
+    if (names.size() > UINT32_MAX) {
+        throw "Archive names are too long.";
+    }
+    dir.insert(dir.end(), names.begin(), names.end());
+    return dir;
+}
+
+/**
+ * Commit the directory of `count` entries and `names` bytes of names at
+ * `offset`, which must already be on disk: the slot of the header, which
+ * is not in effect, is overwritten with the next sequence number.
+ */
+void Archive::commit(uint64_t offset, uint64_t count, uint64_t names)
+{
+    const uint64_t sequence = this->sequence + 1;
+    uint8_t slot[ARCHIVE_SLOT_SIZE];
+    put_be(slot, sequence, 8);
+    put_be(slot + 8, offset, 8);
+    put_be(slot + 16, count, 8);
+    put_be(slot + 24, names, 4);
+    put_be(slot + 28, crc32c(slot, ARCHIVE_SLOT_SIZE - 4), 4);
+
+    write_all(this->fd, slot, ARCHIVE_SLOT_SIZE, 8 + (sequence % 2) * ARCHIVE_SLOT_SIZE);
+    if (fdatasync(this->fd) != 0) {
+        throw "Archive could not be written.";
+    }
+    this->sequence = sequence;
+}
+
+/**
+ * Move the committed directory to `offset` (or after its current place,
+ * if they would overlap): write a copy there and commit it.
+ */
+void Archive::move_directory(uint64_t offset)
+{
+    offset = std::max(offset, this->live_offset + this->live_size);
+    const std::vector<uint8_t> dir = directory(this->committed);
+    write_all(this->fd, dir.data(), dir.size(), offset);
+    if (fdatasync(this->fd) != 0) {
+        throw "Archive could not be written.";
+    }
+    commit(offset, this->committed, dir.size() - this->committed * ARCHIVE_ENTRY_SIZE);
+    this->live_offset = offset;
+}
+
+/**
+ * Write the directory and names right after the data appended last, commit
+ * them (once they are on disk), cut off anything after them and remap
+ * the archive. So the archive is only ever its data, one directory and
+ * the header, however many times it is appended to.
+ */
+void Archive::flush()
+{
+    if (!this->writable) {
+        return;
+    }
+
+    const std::vector<uint8_t> dir = directory(this->entries.size());
+    if (this->live_size > 0 && this->data_end + dir.size() > this->live_offset
+        && this->data_end < this->live_offset + this->live_size) {
+        move_directory(this->data_end + dir.size());
+    }
+
+    write_all(this->fd, dir.data(), dir.size(), this->data_end);
+    if (fdatasync(this->fd) != 0) {
+        throw "Archive could not be written.";
+    }
+    commit(this->data_end, this->entries.size(), dir.size() - this->entries.size() * ARCHIVE_ENTRY_SIZE);
+    if (ftruncate(this->fd, this->data_end + dir.size()) != 0) {
+        throw "Archive could not be written.";
+    }
+    this->appended = 0;
+    this->dirty = false;
+
+    unmap_file();
+    map_file();
+}
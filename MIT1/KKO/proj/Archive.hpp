@@ -0,0 +1,72 @@
+/**
+ * Header for the Archive class.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef ARCHIVE_HPP
+#define ARCHIVE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Codec.hpp"
+
+#define ARCHIVE_MAGIC "HCAR"
+#define ARCHIVE_VERSION 2
+#define ARCHIVE_SLOT_SIZE 32   // 8 B sequence + 8 B directory offset + 8 B count + 4 B names size + CRC32C.
+#define ARCHIVE_HEADER_SIZE 72 // Magic + version + two commit slots.
+#define ARCHIVE_ENTRY_SIZE 40  // Size of one fixed size directory entry.
+
+/**
+ * One entry of the archive's central directory.
+ */
+struct archive_entry
+{
+    uint64_t offset = 0; //!< Offset of the encoded stream in the archive.
+    uint64_t size = 0;   //!< Size of the encoded stream (header included).
+    uint32_t width = 0;  //!< Width of the image.
+    uint32_t height = 0; //!< Height of the image.
+    uint8_t options = 0; //!< The options byte of the encoded stream.
+    std::string name;    //!< Name of the image (basename of the input file).
+};
+
+class Archive
+{
+private:
+    std::string path;
+    int fd = -1;
+    bool writable;
+    uint8_t *map = nullptr; //!< Read-only mapping of the whole archive.
+    size_t map_size = 0;
+    uint64_t dir_offset = 0; //!< Offset of the directory (end of the data).
+    uint64_t entry_count = 0;
+    uint64_t names_size = 0; //!< Size of the names area after the directory.
+    uint64_t sequence = 0;   //!< Sequence number of the committed slot.
+    std::vector<struct archive_entry> entries; //!< Directory (writable only).
+    uint64_t data_end = 0;   //!< Offset, at which the next appended stream is written.
+    uint64_t live_offset = 0; //!< Offset of the committed directory on disk.
+    uint64_t live_size = 0;   //!< Size of the committed directory and names.
+    uint64_t committed = 0;   //!< Entries in the committed directory.
+    uint64_t appended = 0;    //!< Bytes appended since the last flush().
+    bool dirty = false;
+
+    void map_file();
+    void unmap_file();
+    struct archive_entry parse_entry(uint64_t index);
+    std::vector<uint8_t> directory(uint64_t count);
+    void commit(uint64_t offset, uint64_t count, uint64_t names);
+    void move_directory(uint64_t offset);
+public:
+    Archive(std::string path, bool writable = false);
+    ~Archive();
+
+    uint64_t count();
+    struct archive_entry entry(uint64_t index);
+    const uint8_t *entry_data(uint64_t index, uint64_t *size);
+    void append(const std::string &name, const uint8_t *data, size_t size);
+    void extract(uint64_t index, std::vector<uint8_t> *out, uint32_t *width, uint32_t *height, struct codec_buffers *buf = nullptr);
+    void flush();
+};
+
+#endif /* ARCHIVE_HPP */
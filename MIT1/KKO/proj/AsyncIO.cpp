@@ -0,0 +1,414 @@
+/**
+ * Implementation of the AsyncIO class. Reads and writes whole files in the
+ * background, so that the caller can work on something else meanwhile.
+ * The requests are carried out with io_uring (Linux 5.6+), which is used
+ * through its system calls directly, or, where io_uring is not available,
+ * by a small pool of threads with blocking pread/pwrite calls.
+ *
+ * With io_uring, every request is a chain of operations (open, reads or
+ * writes, close), each submitted when the previous one completes. All
+ * completions are handled by a single reaper thread.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "AsyncIO.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define STEP_OPEN 0 // The request is opening the file.
+#define STEP_TRANSFER 1 // The request is reading or writing the data.
+#define STEP_CLOSE 2 // The request is closing the file.
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+/**
+ * Returns the error message of a failed request.
+ */
+static const char *request_error(const struct io_request *req)
+{
+    return req->write ? "Output file could not be written." : "Input file could not be read.";
+}
+
+/**
+ * @param use_uring false to always use the thread pool.
+ */
+AsyncIO::AsyncIO(bool use_uring)
+{
+    if (use_uring && setup_uring()) {
+        this->uring = true;
+        this->reaper = std::thread(&AsyncIO::reap, this);
+        return;
+    }
+
+    for (int t = 0; t < IO_THREADS; t++) {
+        this->pool.emplace_back(&AsyncIO::work, this);
+    }
+}
+
+/**
+ * Waits for all the requests in flight and stops the background threads.
+ */
+AsyncIO::~AsyncIO()
+{
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this]() { return this->active == 0; });
+        this->stop = true;
+    }
+    this->changed.notify_all();
+
+    if (this->uring) {
+        submit(nullptr, IORING_OP_NOP); // Wakes the reaper up to exit.
+        this->reaper.join();
+        teardown_uring();
+    }
+    for (auto &t : this->pool) {
+        t.join();
+    }
+}
+
+/**
+ * Returns true if the requests are carried out with io_uring.
+ */
+bool AsyncIO::uses_uring()
+{
+    return this->uring;
+}
+
+/**
+ * Start reading the whole file `req->path` into `req->data`.
+ * @param req pointer to the request.
+ */
+void AsyncIO::read(struct io_request *req)
+{
+    req->write = false;
+    start(req);
+}
+
+/**
+ * Start writing `req->data` to the file `req->path`, which is created or
+ * truncated.
+ * @param req pointer to the request.
+ */
+void AsyncIO::write(struct io_request *req)
+{
+    req->write = true;
+    start(req);
+}
+
+/**
+ * Wait until the request finishes.
+ * @param req pointer to a started request.
+ */
+void AsyncIO::wait(struct io_request *req)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [req]() { return req->done; });
+    if (req->error != nullptr) {
+        throw req->error;
+    }
+}
+
+/**
+ * Hand the request over to the backend. Blocks while IO_QUEUE_DEPTH
+ * requests are in flight.
+ */
+void AsyncIO::start(struct io_request *req)
+{
+    req->done = false;
+    req->error = nullptr;
+    req->fd = -1;
+    req->stage = STEP_OPEN;
+    req->offset = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this]() { return this->active < IO_QUEUE_DEPTH; });
+        this->active++;
+        if (!this->uring) {
+            this->queue.push_back(req);
+            this->changed.notify_all();
+            return;
+        }
+    }
+    submit(req, IORING_OP_OPENAT);
+}
+
+/**
+ * Mark the request as done and wake up whoever waits for it.
+ */
+void AsyncIO::finish(struct io_request *req)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    req->done = true;
+    this->active--;
+    this->changed.notify_all();
+}
+
+/**
+ * Create the io_uring instance and map its rings.
+ * @returns False if io_uring or any of the operations used is not supported.
+ */
+bool AsyncIO::setup_uring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    this->ring_fd = (int) syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+    if (this->ring_fd < 0) {
+        return false;
+    }
+
+    std::vector<uint8_t> probe_data(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe *probe = (struct io_uring_probe *) probe_data.data();
+    const uint8_t opcodes[] = {IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    bool supported = syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (uint8_t op : opcodes) {
+        supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+    }
+    this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_SHARED | MAP_POPULATE;
+    if (supported) {
+        this->sq_ring = mmap(nullptr, this->sq_ring_size, prot, flags, this->ring_fd, IORING_OFF_SQ_RING);
+        supported = this->sq_ring != MAP_FAILED;
+    }
+    if (supported && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+        this->cq_ring = this->sq_ring;
+    } else if (supported) {
+        this->cq_ring = mmap(nullptr, this->cq_ring_size, prot, flags, this->ring_fd, IORING_OFF_CQ_RING);
+        supported = this->cq_ring != MAP_FAILED;
+    }
+    if (supported) {
+        void *sqes = mmap(nullptr, this->sqes_size, prot, flags, this->ring_fd, IORING_OFF_SQES);
+        supported = sqes != MAP_FAILED;
+        this->sqes = supported ? (struct io_uring_sqe *) sqes : nullptr;
+    }
+    if (!supported) {
+        teardown_uring();
+        return false;
+    }
+
+    uint8_t *sq = (uint8_t *) this->sq_ring;
+    uint8_t *cq = (uint8_t *) this->cq_ring;
+    this->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    this->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    this->sq_array = (unsigned *) (sq + params.sq_off.array);
+    this->cq_head = (unsigned *) (cq + params.cq_off.head);
+    this->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    this->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return true;
+}
+
+/**
+ * Unmap the rings and close the io_uring instance.
+ */
+void AsyncIO::teardown_uring()
+{
+    if (this->sqes != nullptr) {
+        munmap(this->sqes, this->sqes_size);
+    }
+    if (this->cq_ring != nullptr && this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring) {
+        munmap(this->cq_ring, this->cq_ring_size);
+    }
+    if (this->sq_ring != nullptr && this->sq_ring != MAP_FAILED) {
+        munmap(this->sq_ring, this->sq_ring_size);
+    }
+    close(this->ring_fd);
+    this->sqes = nullptr;
+    this->sq_ring = this->cq_ring = nullptr;
+    this->ring_fd = -1;
+}
+
+/**
+ * Submit the next operation of a request to the io_uring.
+ * @param req pointer to the request, nullptr to stop the reaper.
+ * @param opcode the operation, one of IORING_OP_*.
+ */
+void AsyncIO::submit(struct io_request *req, uint8_t opcode)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // Every request has at most one operation in flight, so there is always
+    // a free entry (and uring_enter() consumes it right away).
+    const unsigned tail = *this->sq_tail;
+    const unsigned index = tail & *this->sq_mask;
+    struct io_uring_sqe *sqe = &this->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = (uintptr_t) req;
+
+    if (opcode == IORING_OP_OPENAT) {
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) req->path.c_str();
+        sqe->open_flags = req->write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+        sqe->len = req->write ? 0666 : 0; // The mode.
+    } else if (opcode == IORING_OP_READ || opcode == IORING_OP_WRITE) {
+        sqe->fd = req->fd;
+        sqe->addr = (uintptr_t) (req->data.data() + req->offset);
+        sqe->len = (uint32_t) std::min<uint64_t>(req->data.size() - req->offset, IO_MAX_TRANSFER);
+        sqe->off = req->offset;
+    } else if (opcode == IORING_OP_CLOSE) {
+        sqe->fd = req->fd;
+    }
+
+    this->sq_array[index] = index;
+    __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (uring_enter(this->ring_fd, 1, 0, 0) < 0
+            && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+        // The entry stays queued, try again.
+    }
+}
+
+/**
+ * The reaper thread. Takes completions off the io_uring and moves their
+ * requests on until it is told to stop.
+ */
+void AsyncIO::reap()
+{
+    for (;;) {
+        const unsigned head = *this->cq_head;
+        if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+            uring_enter(this->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+
+        const struct io_uring_cqe *cqe = &this->cqes[head & *this->cq_mask];
+        struct io_request *req = (struct io_request *) (uintptr_t) cqe->user_data;
+        const int res = cqe->res;
+        __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (req == nullptr) {
+            return;
+        }
+        advance(req, res);
+    }
+}
+
+/**
+ * Submit the operation following a completed one.
+ * @param req pointer to the request.
+ * @param res result of the completed operation.
+ */
+void AsyncIO::advance(struct io_request *req, int res)
+{
+    if (req->stage == STEP_OPEN) {
+        if (res < 0) {
+            req->error = request_error(req);
+            finish(req);
+            return;
+        }
+        req->fd = res;
+        struct stat results;
+        if (req->write) {
+            // The data is already there.
+        } else if (fstat(req->fd, &results) != 0) {
+            req->error = request_error(req);
+        } else {
+            req->data.resize(results.st_size);
+        }
+    } else if (req->stage == STEP_TRANSFER) {
+        if (res <= 0) {
+            req->error = request_error(req);
+        } else {
+            req->offset += res;
+        }
+    } else {
+        if (res < 0 && req->write) {
+            req->error = request_error(req);
+        }
+        finish(req);
+        return;
+    }
+
+    if (req->error == nullptr && req->offset < req->data.size()) {
+        req->stage = STEP_TRANSFER;
+        submit(req, req->write ? IORING_OP_WRITE : IORING_OP_READ);
+    } else {
+        req->stage = STEP_CLOSE;
+        submit(req, IORING_OP_CLOSE);
+    }
+}
+
+/**
+ * A thread of the pool. Carries out queued requests until it is told to stop.
+ */
+void AsyncIO::work()
+{
+    for (;;) {
+        struct io_request *req;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->changed.wait(lock, [this]() { return this->stop || !this->queue.empty(); });
+            if (this->queue.empty()) {
+                return;
+            }
+            req = this->queue.front();
+            this->queue.pop_front();
+        }
+        transfer(req);
+        finish(req);
+    }
+}
+
+/**
+ * Carry out a request with blocking calls (the thread pool backend).
+ */
+void AsyncIO::transfer(struct io_request *req)
+{
+    const int fd = req->write
+        ? open(req->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)
+        : open(req->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        req->error = request_error(req);
+        return;
+    }
+
+    struct stat results;
+    if (req->write) {
+        // The data is already there.
+    } else if (fstat(fd, &results) != 0) {
+        req->error = request_error(req);
+    } else {
+        req->data.resize(results.st_size);
+    }
+
+    while (req->error == nullptr && req->offset < req->data.size()) {
+        uint8_t *data = req->data.data() + req->offset;
+        const size_t len = std::min<uint64_t>(req->data.size() - req->offset, IO_MAX_TRANSFER);
+        const ssize_t res = req->write
+            ? pwrite(fd, data, len, req->offset)
+            : pread(fd, data, len, req->offset);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            req->error = request_error(req);
+        } else {
+            req->offset += res;
+        }
+    }
+
+    if (close(fd) != 0 && req->write) {
+        req->error = request_error(req);
+    }
+}
@@ -0,0 +1,82 @@
+/**
+ * Header for the AsyncIO class.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef ASYNCIO_HPP
+#define ASYNCIO_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define IO_QUEUE_DEPTH 64 // Most requests in flight at once (io_uring queue entries).
+#define IO_THREADS 4 // Threads of the pread/pwrite pool used without io_uring.
+#define IO_MAX_TRANSFER (1u << 30) // Most bytes read or written by one operation.
+
+/**
+ * A whole-file read or write, see AsyncIO. The request must stay alive and
+ * untouched from AsyncIO::read() or AsyncIO::write() until AsyncIO::wait()
+ * returns, after which it may be reused for another file.
+ */
+struct io_request
+{
+    std::string path;          //!< Path of the file.
+    std::vector<uint8_t> data; //!< Contents of the file, read or to be written.
+
+    bool write = false;        //!< True if writing `data` out.
+    bool done = true;          //!< Set when the request finishes.
+    const char *error = nullptr; //!< Error message if the request failed.
+    int fd = -1;               //!< The open file.
+    int stage = 0;             //!< The pending operation (io_uring only).
+    uint64_t offset = 0;       //!< Bytes transferred so far.
+};
+
+class AsyncIO
+{
+private:
+    bool uring = false;
+    bool stop = false;
+    size_t active = 0;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    // io_uring backend.
+    int ring_fd = -1;
+    void *sq_ring = nullptr, *cq_ring = nullptr;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    std::thread reaper;
+
+    // Thread pool backend.
+    std::deque<struct io_request *> queue;
+    std::vector<std::thread> pool;
+
+    bool setup_uring();
+    void teardown_uring();
+    void reap();
+    void submit(struct io_request *req, uint8_t opcode);
+    void advance(struct io_request *req, int res);
+    void work();
+    void transfer(struct io_request *req);
+    void start(struct io_request *req);
+    void finish(struct io_request *req);
+public:
+    AsyncIO(bool use_uring = true);
+    ~AsyncIO();
+
+    bool uses_uring();
+    void read(struct io_request *req);
+    void write(struct io_request *req);
+    void wait(struct io_request *req);
+};
+
+#endif /* ASYNCIO_HPP */
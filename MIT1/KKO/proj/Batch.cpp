@@ -0,0 +1,321 @@
+/**
+ * Implementation of the Batch class. Compresses or decompresses many images
+ * in a single process using a pool of worker threads. Each worker keeps its
+ * own buffers, so after the first few images no more allocations are made.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "AsyncIO.hpp"
+#include "Batch.hpp"
+#include "Stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+/**
+ * @param inputs paths to the files to be processed.
+ * @param out_dir the directory, to which the output files are written.
+ * @param threads number of worker threads. If 0, the number of hardware
+ * threads is used.
+ */
+Batch::Batch(std::vector<std::string> inputs, std::string out_dir, unsigned threads)
+{
+    this->inputs = inputs;
+    this->out_dir = out_dir;
+
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    this->threads = threads > 0 ? threads : 1;
+}
+
+/**
+ * Collect input files from `path`. If `path` is a directory, all regular
+ * files in it are returned (sorted by name). Otherwise `path` is treated
+ * as a list file with one input path per line.
+ * @param path path to a directory or a list file.
+ * @returns The input file paths.
+ */
+std::vector<std::string> Batch::collect_inputs(std::string path)
+{
+    std::vector<std::string> result;
+
+    if (std::filesystem::is_directory(path)) {
+        for (auto &entry : std::filesystem::directory_iterator(path)) {
+            if (entry.is_regular_file()) {
+                result.push_back(entry.path().string());
+            }
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    std::ifstream list(path);
+    if (!list.is_open()) {
+        throw "Batch input list could not be opened.";
+    }
+
+    std::string line;
+    while (std::getline(list, line)) {
+        if (line.length() > 0) {
+            result.push_back(line);
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Compress all input files as raw images of width `width`.
+ * @param width the width of all the input images.
+ * @param opts encoding options used for all the images.
+ * @returns Statistics of the run.
+ */
+struct batch_stats Batch::compress(uint32_t width, struct enc_options opts)
+{
+    struct batch_stats stats;
+    run(true, width, opts, &stats);
+    return stats;
+}
+
+/**
+ * Decompress all input files into raw images.
+ * @returns Statistics of the run.
+ */
+struct batch_stats Batch::decompress()
+{
+    struct batch_stats stats;
+    struct enc_options opts = {};
+    run(false, 0, opts, &stats);
+    return stats;
+}
+
+/**
+ * Rotate all input files, which are encoded images, into encoded images
+ * (see Codec::rotate()).
+ * @param turn the rotation, one of ROTATE_*.
+ * @returns Statistics of the run.
+ */
+struct batch_stats Batch::rotate(uint8_t turn)
+{
+    struct batch_stats stats;
+    struct enc_options opts = {};
+    run(false, 0, opts, &stats, turn);
+    return stats;
+}
+
+/**
+ * Print the statistics of a batch run to stderr.
+ * @param stats pointer to the statistics.
+ */
+void Batch::print_stats(const struct batch_stats *stats)
+{
+    const double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+
+    std::cerr << "Files:       " << stats->files << " ("
+        << stats->failed << " failed)\n";
+    std::cerr << "Bytes in:    " << stats->bytes_in << '\n';
+    std::cerr << "Bytes out:   " << stats->bytes_out << '\n';
+    std::cerr << "Time:        " << stats->seconds << " s\n";
+    std::cerr << "I/O:         " << (stats->uring ? "io_uring" : "thread pool") << '\n';
+    std::cerr << "Throughput:  " << (stats->bytes_in / 1e6) / seconds
+        << " MB/s in, " << stats->files / seconds << " files/s\n";
+}
+
+/**
+ * Returns the output path for `in_path`. Compressed files get the `.enc`
+ * extension, decompressed files the `.raw` extension.
+ * @param in_path path to an input file.
+ * @param compress true if compressing.
+ * @returns Path in the output directory.
+ */
+std::string Batch::output_path(const std::string &in_path, bool compress)
+{
+    std::filesystem::path name = std::filesystem::path(in_path).filename();
+    name.replace_extension(compress ? ".enc" : ".raw");
+    return (std::filesystem::path(this->out_dir) / name).string();
+}
+
+/**
+ * Process all inputs on `threads` worker threads. The workers pick the next
+ * unprocessed input until none are left. Each worker owns its input/output
+ * buffers and codec buffers and reuses them for every image.
+ *
+ * The files are read and written asynchronously (see AsyncIO): every worker
+ * keeps BATCH_PREFETCH of its next inputs being read and the outputs of up
+ * to BATCH_PREFETCH previous images being written while it encodes or
+ * decodes the current one.
+ * @param compress true to compress, false to decompress (or rotate).
+ * @param width width of the input images (compression only).
+ * @param opts encoding options (compression only).
+ * @param stats pointer to statistics, which are filled in.
+ * @param turn the rotation (one of ROTATE_*) of the encoded inputs instead
+ * of decompressing them, -1 for none.
+ */
+void Batch::run(
+    bool compress, uint32_t width,
+    struct enc_options opts, struct batch_stats *stats, int turn)
+{
+    // Inputs of the same name (e.g. `a.raw` and `a.bin`, or `x/a.raw` and
+    // `y/a.raw` of a list file) would be written to the same output file
+    // by two workers at once, so the run is refused before it starts.
+    std::map<std::string, std::string> outputs;
+    for (const std::string &in_path : this->inputs) {
+        auto added = outputs.emplace(output_path(in_path, compress || turn >= 0), in_path);
+        if (!added.second) {
+            std::cerr << added.first->second << ", " << in_path << ": "
+                << added.first->first << '\n';
+            throw "Batch inputs would be written to the same output file.";
+        }
+    }
+
+    std::filesystem::create_directories(this->out_dir);
+
+    std::atomic<size_t> next(0);
+    std::mutex stats_mutex;
+    AsyncIO io;
+    stats->uring = io.uses_uring();
+
+    // The workers' profiling counters are merged into the calling thread's.
+    struct codec_stats *caller_stats = &thread_stats;
+
+    auto worker = [&]() {
+        struct codec_buffers buf;
+        std::vector<uint8_t> out;
+        struct batch_stats local;
+
+        // Ring of reads: the current input and the prefetched ones after it.
+        struct io_request reads[BATCH_PREFETCH + 1];
+        size_t first_read = 0, pending_reads = 0;
+        // Ring of writes, each with the size of its input.
+        struct io_request writes[BATCH_PREFETCH];
+        uint64_t write_in_size[BATCH_PREFETCH] = {};
+        size_t next_write = 0;
+
+        auto prefetch = [&]() {
+            while (pending_reads < BATCH_PREFETCH) {
+                const size_t i = next++;
+                if (i >= this->inputs.size()) {
+                    return;
+                }
+                struct io_request *req = &reads[(first_read + pending_reads) % (BATCH_PREFETCH + 1)];
+                req->path = this->inputs[i];
+                io.read(req);
+                pending_reads++;
+            }
+        };
+
+        // Waits for a write and counts its file.
+        auto finish_write = [&](struct io_request *req, uint64_t in_size) {
+            if (req->done && req->path.empty()) {
+                return; // Never used.
+            }
+            try
+            {
+                STATS_TIMER(STAGE_IO);
+                io.wait(req);
+                local.files++;
+                local.bytes_in += in_size;
+                local.bytes_out += req->data.size();
+            }
+            catch(const char *e)
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                std::cerr << req->path << ": " << e << '\n';
+                local.failed++;
+            }
+            req->path.clear();
+        };
+
+        prefetch();
+        while (pending_reads > 0) {
+            struct io_request *in = &reads[first_read];
+            first_read = (first_read + 1) % (BATCH_PREFETCH + 1);
+            pending_reads--;
+            prefetch();
+
+            const std::string &in_path = in->path;
+            try
+            {
+                buf.bad_blocks.clear();
+                {
+                    STATS_TIMER(STAGE_IO);
+                    io.wait(in);
+                }
+                const uint64_t in_size = in->data.size();
+                if (compress) {
+                    const uint64_t row_size = (uint64_t) width * opts.channels * (opts.depth / 8);
+                    if (in_size / row_size > UINT32_MAX) {
+                        throw "Image is too tall.";
+                    }
+                    if (in_size % row_size != 0) {
+                        throw "Image load encountered an error.";
+                    }
+                    Codec::encode(in->data.data(), width, (uint32_t) (in_size / row_size), opts, &out, &buf);
+                } else if (turn >= 0) {
+                    Codec::rotate(in->data.data(), in_size, (uint8_t) turn, &out, &buf);
+                } else {
+                    // Decoded straight into the mapped output file.
+                    local.bytes_out += Codec::decode_file(in->data.data(), in_size,
+                        output_path(in_path, compress), &buf);
+                    local.files++;
+                    local.bytes_in += in_size;
+                    continue;
+                }
+
+                // The encoded image is handed over to the write by swapping
+                // buffers, `out` gets the buffer of an older write.
+                struct io_request *req = &writes[next_write];
+                finish_write(req, write_in_size[next_write]);
+                req->path = output_path(in_path, true);
+                req->data.swap(out);
+                write_in_size[next_write] = in_size;
+                next_write = (next_write + 1) % BATCH_PREFETCH;
+                io.write(req);
+            }
+            catch(const char *e)
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                std::cerr << in_path << ": " << e << '\n';
+                for (uint64_t offset : buf.bad_blocks) {
+                    std::cerr << in_path << ": corrupt chunk at offset " << offset << '\n';
+                }
+                local.failed++;
+            }
+        }
+        for (size_t w = 0; w < BATCH_PREFETCH; w++) {
+            finish_write(&writes[w], write_in_size[w]);
+        }
+
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats->files += local.files;
+        stats->failed += local.failed;
+        stats->bytes_in += local.bytes_in;
+        stats->bytes_out += local.bytes_out;
+        if (&thread_stats != caller_stats) {
+            stats_merge(caller_stats, &thread_stats);
+        }
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < this->threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker(); // The calling thread works as well.
+    for (auto &t : pool) {
+        t.join();
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    stats->seconds = std::chrono::duration<double>(end - start).count();
+}
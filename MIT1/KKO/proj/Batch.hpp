@@ -0,0 +1,50 @@
+/**
+ * Header for the Batch class.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Codec.hpp"
+
+#define BATCH_PREFETCH 2 // Inputs read ahead (and outputs written behind) by every worker.
+
+/**
+ * Aggregate statistics of a batch run.
+ */
+struct batch_stats
+{
+    size_t files = 0;      //!< Number of successfully processed files.
+    size_t failed = 0;     //!< Number of files that could not be processed.
+    uint64_t bytes_in = 0;  //!< Sum of input file sizes.
+    uint64_t bytes_out = 0; //!< Sum of output file sizes.
+    double seconds = 0;    //!< Wall time of the whole run.
+    bool uring = false;    //!< True if the files were read and written with io_uring.
+};
+
+class Batch
+{
+private:
+    std::vector<std::string> inputs;
+    std::string out_dir;
+    unsigned threads;
+
+    std::string output_path(const std::string &in_path, bool compress);
+    void run(bool compress, uint32_t width, struct enc_options opts, struct batch_stats *stats, int turn = -1);
+public:
+    Batch(std::vector<std::string> inputs, std::string out_dir, unsigned threads);
+
+    static std::vector<std::string> collect_inputs(std::string path);
+    static void print_stats(const struct batch_stats *stats);
+
+    struct batch_stats compress(uint32_t width, struct enc_options opts);
+    struct batch_stats decompress();
+    struct batch_stats rotate(uint8_t turn);
+};
+
+#endif /* BATCH_HPP */
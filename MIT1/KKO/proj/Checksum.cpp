@@ -0,0 +1,129 @@
+/**
+ * CRC32C (Castagnoli) checksums of encoded data. The checksum is computed
+ * with the SSE4.2 `crc32` instruction, 8 bytes at a time, on CPUs that
+ * have it and with a lookup table one byte at a time otherwise.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "Checksum.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_SSE42 // The SSE4.2 variant is compiled in.
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // The reversed Castagnoli polynomial.
+#define HASH_MUL1 0xbf58476d1ce4e5b9ull // Multipliers of the splitmix64 finalizer.
+#define HASH_MUL2 0x94d049bb133111ebull
+
+/**
+ * Table of the CRC of every byte value, for the table variant.
+ */
+struct Crc32cTable
+{
+    uint32_t entries[256];
+
+    Crc32cTable()
+    {
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            this->entries[byte] = crc;
+        }
+    }
+};
+
+/**
+ * The table variant of crc32c(), `crc` is the inverted running checksum.
+ */
+static uint32_t crc32c_table(const uint8_t *data, size_t size, uint32_t crc)
+{
+    static const Crc32cTable table;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CHECKSUM_SSE42
+/**
+ * The SSE4.2 variant of crc32c(), `crc` is the inverted running checksum.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const uint8_t *data, size_t size, uint32_t crc)
+{
+    size_t i = 0;
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    for (; i < size; i++) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Returns the CRC32C of `size` bytes at `data`.
+ * @param data pointer to the data.
+ * @param size size of the data in bytes.
+ * @param crc checksum of the preceding data, if the checksum is computed
+ * piece by piece (0 to start a new checksum).
+ * @returns The checksum of the preceding data followed by `data`.
+ */
+uint32_t crc32c(const uint8_t *data, size_t size, uint32_t crc)
+{
+#ifdef CHECKSUM_SSE42
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42) {
+        return ~crc32c_sse42(data, size, ~crc);
+    }
+#endif
+    return ~crc32c_table(data, size, ~crc);
+}
+
+/**
+ * Mix the bits of `x` (the splitmix64 finalizer).
+ */
+static uint64_t hash_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * HASH_MUL1;
+    x = (x ^ (x >> 27)) * HASH_MUL2;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Returns a 64-bit hash of `size` bytes at `data`, e.g. to recognise the
+ * same encoded image. Unlike the CRC, which is linear and only 32 bits wide,
+ * the hash is fit to be a key of many images. It is not cryptographic,
+ * so data of the same hash may still differ (and may be made to collide).
+ * @param data pointer to the data.
+ * @param size size of the data in bytes.
+ */
+uint64_t content_hash(const uint8_t *data, size_t size)
+{
+    uint64_t hash = hash_mix(size);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ hash_mix(word)) * HASH_MUL2 + i;
+    }
+
+    uint64_t tail = 0;
+    if (i < size) {
+        memcpy(&tail, data + i, size - i);
+    }
+    return hash_mix(hash ^ hash_mix(tail ^ 0xff));
+}
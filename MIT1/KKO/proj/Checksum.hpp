@@ -0,0 +1,18 @@
+/**
+ * CRC32C (Castagnoli) checksums and content hashes of encoded data.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#define CHECKSUM_SIZE 4 // Bytes of a stored CRC32C (big endian).
+
+uint32_t crc32c(const uint8_t *data, size_t size, uint32_t crc = 0);
+uint64_t content_hash(const uint8_t *data, size_t size);
+
+#endif /* CHECKSUM_HPP */
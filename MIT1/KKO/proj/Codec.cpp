@@ -6,463 +6,3596 @@
  */
 #include <iostream> // cerr
 #include "Codec.hpp"
+#include "Checksum.hpp"
+#include "Pipeline.hpp"
+#include "Stats.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Building blocks of the codec kernels. The kernels (rle_kernel(),
+ * irle_kernel(), changes()) are templates over the pixel type, predictor
+ * and scan order and every combination is instantiated separately,
+ * so that no options are checked per pixel.
+ *
+ * 16-bit pixels are stored little endian in raw images and as two RLE
+ * symbols, the high byte first, in the encoded data.
+ */
+
+/** Returns pixel `i` of raw image data `px`. */
+template <typename Pixel>
+static inline Pixel load_pixel(const uint8_t *px, size_t i);
+
+template <>
+inline uint8_t load_pixel<uint8_t>(const uint8_t *px, size_t i)
+{
+    return px[i];
+}
+
+template <>
+inline uint16_t load_pixel<uint16_t>(const uint8_t *px, size_t i)
+{
+    return (uint16_t) (px[2*i] | (px[2*i + 1] << 8));
+}
+
+/** Sets pixel `i` of raw image data `px` to `value`. */
+template <typename Pixel>
+static inline void store_pixel(uint8_t *px, size_t i, Pixel value);
+
+template <>
+inline void store_pixel<uint8_t>(uint8_t *px, size_t i, uint8_t value)
+{
+    px[i] = value;
+}
+
+template <>
+inline void store_pixel<uint16_t>(uint8_t *px, size_t i, uint16_t value)
+{
+    px[2*i] = value & 0xff;
+    px[2*i + 1] = value >> 8;
+}
+
+/** Appends the RLE symbols of pixel value `value` to `symbols`. */
+template <typename Pixel>
+static inline void push_pixel(std::vector<uint8_t> *symbols, Pixel value);
+
+template <>
+inline void push_pixel<uint8_t>(std::vector<uint8_t> *symbols, uint8_t value)
+{
+    symbols->push_back(value);
+}
+
+template <>
+inline void push_pixel<uint16_t>(std::vector<uint8_t> *symbols, uint16_t value)
+{
+    symbols->push_back(value >> 8);
+    symbols->push_back(value & 0xff);
+}
+
+/**
+ * Reads a pixel value from RLE symbols `symbols` of size `size` at `*i`
+ * and moves `*i` past it.
+ * @returns False if the symbols ended before the whole value was read.
+ */
+template <typename Pixel>
+static inline bool read_pixel(const uint8_t *symbols, size_t size, size_t *i, Pixel *value);
+
+template <>
+inline bool read_pixel<uint8_t>(const uint8_t *symbols, size_t size, size_t *i, uint8_t *value)
+{
+    if (*i >= size) {
+        return false;
+    }
+    *value = symbols[(*i)++];
+    return true;
+}
+
+template <>
+inline bool read_pixel<uint16_t>(const uint8_t *symbols, size_t size, size_t *i, uint16_t *value)
+{
+    if (*i + 2 > size) {
+        return false;
+    }
+    *value = (uint16_t) ((symbols[*i] << 8) | symbols[*i + 1]);
+    *i += 2;
+    return true;
+}
+
+/** Predictor passing the pixel values through (no model). */
+struct PredictNone
+{
+    template <typename Pixel>
+    static inline Pixel residual(const uint8_t *px, size_t i)
+    {
+        return load_pixel<Pixel>(px, i);
+    }
+};
+
+/** The pixel subtraction model, `px[i] - px[i-1]` in row by row order. */
+struct PredictLeft
+{
+    template <typename Pixel>
+    static inline Pixel residual(const uint8_t *px, size_t i)
+    {
+        const Pixel current = load_pixel<Pixel>(px, i);
+        return i > 0 ? (Pixel) (current - load_pixel<Pixel>(px, i - 1)) : current;
+    }
+
+    /**
+     * Restores the pixels of `rows` rows of `width` pixels, `stride` pixels
+     * apart, from their residuals in place. The sum runs on across rows.
+     */
+    template <typename Pixel>
+    static inline void inverse_rows(uint8_t *px, uint32_t width, size_t rows, size_t stride)
+    {
+        Pixel sum = 0;
+        for (size_t y = 0; y < rows; y++, px += stride * sizeof(Pixel)) {
+            for (uint32_t x = 0; x < width; x++) {
+                sum += load_pixel<Pixel>(px, x);
+                store_pixel<Pixel>(px, x, sum);
+            }
+        }
+    }
+
+    /** Restores `size` pixels from their residuals in place. */
+    template <typename Pixel>
+    static inline void inverse(uint8_t *px, size_t size)
+    {
+        Pixel sum = 0;
+        for (size_t i = 0; i < size; i++) {
+            sum += load_pixel<Pixel>(px, i);
+            store_pixel<Pixel>(px, i, sum);
+        }
+    }
+};
+
+/**
+ * Returns the number of pixels between the starts of two rows of an image
+ * of `width` pixels (the scans' `index()` is `y * stride + x`).
+ */
+static inline size_t row_stride(uint32_t width, const struct scan_layout *layout)
+{
+    return layout != nullptr && layout->stride > 0 ? layout->stride : width;
+}
+
+/** Row by row scan order. */
+struct ScanHorizontal
+{
+    size_t i = 0, gap;
+    uint32_t width, x = 0;
+
+    ScanHorizontal(uint32_t width, uint32_t, const struct scan_layout *layout) :
+        gap(row_stride(width, layout) - width), width(width) {}
+    size_t index() const { return i; }
+    void next()
+    {
+        i++;
+        if (++x == width) {
+            x = 0;
+            i += gap;
+        }
+    }
+};
+
+/** Column by column scan order. */
+struct ScanVertical
+{
+    size_t i = 0, stride;
+    uint32_t height, x = 0, y = 0;
+
+    ScanVertical(uint32_t width, uint32_t height, const struct scan_layout *layout) :
+        stride(row_stride(width, layout)), height(height) {}
+    size_t index() const { return i; }
+    void next()
+    {
+        y++;
+        i += stride;
+        if (y >= height) {
+            y = 0;
+            x++;
+            i = x;
+        }
+    }
+};
+
+/**
+ * Tile by tile scan order. The tiles are visited row by row and every tile
+ * is scanned either row by row or column by column, as given by its bit
+ * in `layout->directions`.
+ */
+struct ScanTiled
+{
+    size_t i = 0, stride;
+    uint32_t width, height, tile;
+    const uint8_t *directions;
+    uint64_t bit; //!< Index of the current tile's direction bit.
+    uint32_t x0 = 0, y0 = 0, tile_width = 0, tile_height = 0, x = 0, y = 0;
+    bool vertical = false;
+
+    ScanTiled(uint32_t width, uint32_t height, const struct scan_layout *layout) :
+        stride(row_stride(width, layout)), width(width), height(height), tile(layout->tile),
+        directions(layout->directions), bit(layout->first_tile)
+    {
+        if (width > 0 && height > 0) {
+            start_tile();
+        }
+    }
+
+    size_t index() const { return i; }
+
+    void next()
+    {
+        if (vertical) {
+            y++;
+            i += stride;
+            if (y >= tile_height) {
+                y = 0;
+                x++;
+                i = (size_t) y0 * stride + x0 + x;
+            }
+            if (x >= tile_width) {
+                next_tile();
+            }
+        } else {
+            x++;
+            i++;
+            if (x >= tile_width) {
+                x = 0;
+                y++;
+                i = (size_t) (y0 + y) * stride + x0;
+            }
+            if (y >= tile_height) {
+                next_tile();
+            }
+        }
+    }
+
+    void start_tile()
+    {
+        tile_width = width - x0 < tile ? width - x0 : tile;
+        tile_height = height - y0 < tile ? height - y0 : tile;
+        vertical = (directions[bit >> 3] >> (7 - (bit & 7))) & 1;
+        x = 0;
+        y = 0;
+        i = (size_t) y0 * stride + x0;
+    }
+
+    void next_tile()
+    {
+        bit++;
+        x0 += tile;
+        if (x0 >= width) {
+            x0 = 0;
+            y0 += tile;
+        }
+        if (y0 < height) {
+            start_tile();
+        }
+    }
+};
+
+/**
+ * Block by block scan order. The blocks of `Order::BLOCK` * `Order::BLOCK`
+ * pixels are visited row by row, which keeps the scan within a few rows
+ * of the image at a time, and the pixels of every block are visited in
+ * the order of `Order::table()`, a precomputed table of `(y << 8) | x`
+ * offsets within the block. Offsets outside of the image are skipped
+ * in the blocks on the right and bottom edges.
+ */
+template <typename Order>
+struct ScanBlocks
+{
+    static const uint32_t BLOCK = Order::BLOCK;
+
+    size_t i = 0, base = 0, stride;
+    uint32_t width, height, x0 = 0, y0 = 0, k = 0;
+    const uint16_t *table;
+    //! Offsets of the table entries in the image, so that the pixels
+    //! of whole blocks cost a single lookup.
+    size_t offsets[BLOCK * BLOCK];
+    bool partial = false; //!< True if the current block crosses the image edge.
+
+    ScanBlocks(uint32_t width, uint32_t height, const struct scan_layout *layout) :
+        stride(row_stride(width, layout)), width(width), height(height), table(Order::table())
+    {
+        for (uint32_t n = 0; n < BLOCK * BLOCK; n++) {
+            offsets[n] = (size_t) (table[n] >> 8) * stride + (table[n] & 0xff);
+        }
+        if (width > 0 && height > 0) {
+            start_block();
+        }
+    }
+
+    size_t index() const { return i; }
+
+    void next()
+    {
+        if (!partial && ++k < BLOCK * BLOCK) {
+            i = base + offsets[k];
+            return;
+        }
+        while (partial && ++k < BLOCK * BLOCK) {
+            if (x0 + (table[k] & 0xff) < width && y0 + (table[k] >> 8) < height) {
+                i = base + offsets[k];
+                return;
+            }
+        }
+        x0 += BLOCK;
+        if (x0 >= width) {
+            x0 = 0;
+            y0 += BLOCK;
+        }
+        if (y0 < height) {
+            start_block();
+        }
+    }
+
+    void start_block()
+    {
+        // Both orders start at the top left pixel of the block.
+        partial = width - x0 < BLOCK || height - y0 < BLOCK;
+        k = 0;
+        base = (size_t) y0 * stride + x0;
+        i = base;
+    }
+};
+
+/**
+ * Hilbert curve through a block of HILBERT_BLOCK * HILBERT_BLOCK pixels,
+ * so that consecutive pixels are always neighbours.
+ */
+struct OrderHilbert
+{
+    static const uint32_t BLOCK = HILBERT_BLOCK;
+
+    static const uint16_t *table()
+    {
+        static const std::vector<uint16_t> offsets = []() {
+            std::vector<uint16_t> t(BLOCK * BLOCK);
+            for (uint32_t d = 0; d < BLOCK * BLOCK; d++) {
+                // Converts the distance along the curve to coordinates,
+                // one quadrant level per step.
+                uint32_t x = 0, y = 0, rest = d;
+                for (uint32_t s = 1; s < BLOCK; s *= 2) {
+                    const uint32_t rx = 1 & (rest / 2), ry = 1 & (rest ^ rx);
+                    if (ry == 0) {
+                        if (rx == 1) {
+                            x = s - 1 - x;
+                            y = s - 1 - y;
+                        }
+                        std::swap(x, y);
+                    }
+                    x += s * rx;
+                    y += s * ry;
+                    rest /= 4;
+                }
+                t[d] = (uint16_t) ((y << 8) | x);
+            }
+            return t;
+        }();
+        return offsets.data();
+    }
+};
+
+/**
+ * Zig-zag through a block of ZIGZAG_BLOCK * ZIGZAG_BLOCK pixels along its
+ * anti-diagonals, alternating their direction (as in JPEG).
+ */
+struct OrderZigzag
+{
+    static const uint32_t BLOCK = ZIGZAG_BLOCK;
+
+    static const uint16_t *table()
+    {
+        static const std::vector<uint16_t> offsets = []() {
+            std::vector<uint16_t> t;
+            t.reserve(BLOCK * BLOCK);
+            for (uint32_t diagonal = 0; diagonal < 2 * BLOCK - 1; diagonal++) {
+                const uint32_t low = diagonal < BLOCK ? 0 : diagonal - BLOCK + 1;
+                const uint32_t high = diagonal < BLOCK ? diagonal : BLOCK - 1;
+                for (uint32_t n = low; n <= high; n++) {
+                    // Even diagonals go up and to the right, odd ones down.
+                    const uint32_t y = diagonal % 2 == 0 ? diagonal - n : n;
+                    t.push_back((uint16_t) ((y << 8) | (diagonal - y)));
+                }
+            }
+            return t;
+        }();
+        return offsets.data();
+    }
+};
+
+typedef ScanBlocks<OrderHilbert> ScanHilbert;
+typedef ScanBlocks<OrderZigzag> ScanZigzag;
+
+/**
+ * Returns true if the tile at `x0`, `y0` of `tile_width` * `tile_height`
+ * pixels has fewer value changes when scanned column by column than
+ * row by row (see Codec::best_encoding_direction()).
+ */
+template <typename Pixel>
+static bool tile_is_vertical(
+    const uint8_t *px, uint32_t width,
+    uint32_t x0, uint32_t y0, uint32_t tile_width, uint32_t tile_height)
+{
+    uint64_t horizontal = 0, vertical = 0;
+    Pixel previous = load_pixel<Pixel>(px, (size_t) y0 * width + x0);
+    for (uint32_t y = y0; y < y0 + tile_height; y++) {
+        for (uint32_t x = x0; x < x0 + tile_width; x++) {
+            const Pixel current = load_pixel<Pixel>(px, (size_t) y * width + x);
+            horizontal += current != previous;
+            previous = current;
+        }
+    }
+
+    previous = load_pixel<Pixel>(px, (size_t) y0 * width + x0);
+    for (uint32_t x = x0; x < x0 + tile_width; x++) {
+        for (uint32_t y = y0; y < y0 + tile_height; y++) {
+            const Pixel current = load_pixel<Pixel>(px, (size_t) y * width + x);
+            vertical += current != previous;
+            previous = current;
+        }
+    }
+
+    return vertical < horizontal;
+}
+
+/**
+ * The reversible YCoCg-R colour transform of one RGB pixel, computed
+ * by lifting steps modulo 2^bits of `Pixel` (so the chroma wraps around
+ * instead of needing an extra bit).
+ */
+template <typename Pixel>
+static inline void ycocg_forward(Pixel *c)
+{
+    const Pixel co = (Pixel) (c[0] - c[2]);
+    const Pixel t = (Pixel) (c[2] + (co >> 1));
+    const Pixel cg = (Pixel) (c[1] - t);
+    c[0] = (Pixel) (t + (cg >> 1));
+    c[1] = co;
+    c[2] = cg;
+}
+
+/** Inverse of ycocg_forward(), the lifting steps in reverse. */
+template <typename Pixel>
+static inline void ycocg_inverse(Pixel *c)
+{
+    const Pixel t = (Pixel) (c[0] - (c[2] >> 1));
+    const Pixel g = (Pixel) (c[2] + t);
+    const Pixel b = (Pixel) (t - (c[1] >> 1));
+    c[0] = (Pixel) (b + c[1]);
+    c[1] = g;
+    c[2] = b;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PLANES_SSSE3
+
+/**
+ * Shuffle masks for moving between 16 interleaved pixels of `Channels`
+ * 8-bit channels (`Channels` registers) and 16 pixels of every plane.
+ * `split[k][r]` picks the bytes of plane `k` out of register `r`,
+ * `merge[r][k]` puts the bytes of plane `k` into register `r`. Bytes
+ * of 0x80 are zeroed by the shuffle.
+ */
+template <int Channels>
+struct PlaneMasks
+{
+    alignas(16) uint8_t split[Channels][Channels][16];
+    alignas(16) uint8_t merge[Channels][Channels][16];
+
+    PlaneMasks()
+    {
+        for (int k = 0; k < Channels; k++) {
+            for (int r = 0; r < Channels; r++) {
+                for (int j = 0; j < 16; j++) {
+                    const int from = j * Channels + k;  // Byte of pixel j, channel k.
+                    split[k][r][j] = from / 16 == r ? from % 16 : 0x80;
+                    const int to = r * 16 + j;          // Byte of pixel to / Channels.
+                    merge[r][k][j] = to % Channels == k ? to / Channels : 0x80;
+                }
+            }
+        }
+    }
+};
+
+/** Logical shift right by one of every byte. */
+__attribute__((target("ssse3")))
+static inline __m128i shift_bytes(__m128i x)
+{
+    return _mm_and_si128(_mm_srli_epi16(x, 1), _mm_set1_epi8(0x7f));
+}
+
+/**
+ * split_planes() of 8-bit pixels, 16 pixels at a time using byte shuffles.
+ * @returns The number of pixels split, the rest is left to the caller.
+ */
+template <int Channels, bool Transform>
+__attribute__((target("ssse3")))
+static size_t split_planes_ssse3(const uint8_t *px, size_t pixels, uint8_t *planes)
+{
+    static const PlaneMasks<Channels> masks;
+    __m128i split[Channels][Channels];
+    for (int k = 0; k < Channels; k++) {
+        for (int r = 0; r < Channels; r++) {
+            split[k][r] = _mm_load_si128((const __m128i *) masks.split[k][r]);
+        }
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m128i in[Channels], c[Channels];
+        for (int r = 0; r < Channels; r++) {
+            in[r] = _mm_loadu_si128((const __m128i *) (px + i * Channels + 16 * r));
+        }
+        for (int k = 0; k < Channels; k++) {
+            c[k] = _mm_shuffle_epi8(in[0], split[k][0]);
+            for (int r = 1; r < Channels; r++) {
+                c[k] = _mm_or_si128(c[k], _mm_shuffle_epi8(in[r], split[k][r]));
+            }
+        }
+        if constexpr (Transform) {
+            const __m128i co = _mm_sub_epi8(c[0], c[2]);
+            const __m128i t = _mm_add_epi8(c[2], shift_bytes(co));
+            const __m128i cg = _mm_sub_epi8(c[1], t);
+            c[0] = _mm_add_epi8(t, shift_bytes(cg));
+            c[1] = co;
+            c[2] = cg;
+        }
+        for (int k = 0; k < Channels; k++) {
+            _mm_storeu_si128((__m128i *) (planes + k * pixels + i), c[k]);
+        }
+    }
+    return i;
+}
+
+/** merge_planes() of 8-bit pixels, the inverse of split_planes_ssse3(). */
+template <int Channels, bool Transform>
+__attribute__((target("ssse3")))
+static size_t merge_planes_ssse3(uint8_t *const *planes, size_t pixels, uint8_t *px)
+{
+    static const PlaneMasks<Channels> masks;
+    __m128i merge[Channels][Channels];
+    for (int r = 0; r < Channels; r++) {
+        for (int k = 0; k < Channels; k++) {
+            merge[r][k] = _mm_load_si128((const __m128i *) masks.merge[r][k]);
+        }
+    }
+
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16) {
+        __m128i c[Channels];
+        for (int k = 0; k < Channels; k++) {
+            c[k] = _mm_loadu_si128((const __m128i *) (planes[k] + i));
+        }
+        if constexpr (Transform) {
+            const __m128i t = _mm_sub_epi8(c[0], shift_bytes(c[2]));
+            const __m128i g = _mm_add_epi8(c[2], t);
+            const __m128i b = _mm_sub_epi8(t, shift_bytes(c[1]));
+            c[0] = _mm_add_epi8(b, c[1]);
+            c[1] = g;
+            c[2] = b;
+        }
+        for (int r = 0; r < Channels; r++) {
+            __m128i out = _mm_shuffle_epi8(c[0], merge[r][0]);
+            for (int k = 1; k < Channels; k++) {
+                out = _mm_or_si128(out, _mm_shuffle_epi8(c[k], merge[r][k]));
+            }
+            _mm_storeu_si128((__m128i *) (px + i * Channels + 16 * r), out);
+        }
+    }
+    return i;
+}
+#endif
+
+/**
+ * Splits `pixels` interleaved pixels of `Channels` channels in `px` into
+ * `Channels` consecutive planes in `planes`, applying the colour transform
+ * on the way. 8-bit pixels are split with SSSE3 byte shuffles, if the CPU
+ * has them.
+ */
+template <typename Pixel, int Channels, bool Transform>
+static void split_planes(const uint8_t *px, size_t pixels, uint8_t *planes)
+{
+    size_t i = 0;
+#ifdef PLANES_SSSE3
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if constexpr (sizeof(Pixel) == 1) {
+        if (ssse3) {
+            i = split_planes_ssse3<Channels, Transform && Channels >= 3>(px, pixels, planes);
+        }
+    }
+#endif
+
+    for (; i < pixels; i++) {
+        Pixel c[Channels];
+        for (int k = 0; k < Channels; k++) {
+            c[k] = load_pixel<Pixel>(px, i * Channels + k);
+        }
+        if constexpr (Transform && Channels >= 3) {
+            ycocg_forward<Pixel>(c);
+        }
+        for (int k = 0; k < Channels; k++) {
+            store_pixel<Pixel>(planes, k * pixels + i, c[k]);
+        }
+    }
+}
+
+/** Inverse of split_planes(), interleaves the planes back into `px`. */
+template <typename Pixel, int Channels, bool Transform>
+static void merge_planes(uint8_t *const *planes, size_t pixels, uint8_t *px)
+{
+    size_t i = 0;
+#ifdef PLANES_SSSE3
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if constexpr (sizeof(Pixel) == 1) {
+        if (ssse3) {
+            i = merge_planes_ssse3<Channels, Transform && Channels >= 3>(planes, pixels, px);
+        }
+    }
+#endif
+
+    for (; i < pixels; i++) {
+        Pixel c[Channels];
+        for (int k = 0; k < Channels; k++) {
+            c[k] = load_pixel<Pixel>(planes[k], i);
+        }
+        if constexpr (Transform && Channels >= 3) {
+            ycocg_inverse<Pixel>(c);
+        }
+        for (int k = 0; k < Channels; k++) {
+            store_pixel<Pixel>(px, i * Channels + k, c[k]);
+        }
+    }
+}
+
+typedef void (*plane_merger)(uint8_t *const *, size_t, uint8_t *);
+
+/**
+ * Returns the merge_planes() of `channels` planes of `depth` bits,
+ * which undoes the YCoCg-R transform if `transform` is set.
+ */
+static plane_merger find_merger(uint8_t depth, uint8_t channels, bool transform)
+{
+    static const plane_merger mergers[2][MAX_CHANNELS - 1][2] = { // [16-bit][channels - 2][transform]
+        {
+            {merge_planes<uint8_t, 2, false>, merge_planes<uint8_t, 2, false>},
+            {merge_planes<uint8_t, 3, false>, merge_planes<uint8_t, 3, true>},
+            {merge_planes<uint8_t, 4, false>, merge_planes<uint8_t, 4, true>},
+        },
+        {
+            {merge_planes<uint16_t, 2, false>, merge_planes<uint16_t, 2, false>},
+            {merge_planes<uint16_t, 3, false>, merge_planes<uint16_t, 3, true>},
+            {merge_planes<uint16_t, 4, false>, merge_planes<uint16_t, 4, true>},
+        },
+    };
+    return mergers[depth == 16][channels - 2][transform];
+}
+
+/**
+ * Entry of the chunk table of a chunked image.
+ */
+struct chunk_entry
+{
+    size_t offset;     //!< Offset of the chunk from the start of the chunk table.
+    size_t size;       //!< Encoded size of the chunk in bytes.
+    uint32_t checksum; //!< CRC32C of the chunk (images with checksums only).
+};
+
+/** Returns the size of one entry of the chunk table. */
+static inline size_t chunk_entry_size(bool checksum)
+{
+    return CHUNK_ENTRY_SIZE + (checksum ? CHECKSUM_SIZE : 0);
+}
+
+/**
+ * Returns the size of the chunk table of `chunks` chunks, together with
+ * the checksum of the header and the table, which follows the table
+ * of images with checksums.
+ */
+static inline size_t chunk_table_size(uint64_t chunks, bool checksum)
+{
+    return chunks * chunk_entry_size(checksum) + (checksum ? CHECKSUM_SIZE : 0);
+}
+
+/**
+ * Fills in the entry of chunk `c` in the chunk table at offset `table`
+ * of `out`. The encoded chunk spans from `start` to the end of `out`.
+ * @param checksum true if the CRC32C of the chunk is stored with its size.
+ */
+static void write_chunk_entry(
+    std::vector<uint8_t> *out, size_t table, uint64_t c, size_t start, bool checksum)
+{
+    uint8_t *entry = out->data() + table + c * chunk_entry_size(checksum);
+
+    // The encoded size of the chunk (big endian).
+    const uint64_t chunk_size = out->size() - start;
+    for (int i = 0, shift = 56; shift >= 0; i++, shift -= 8) {
+        entry[i] = chunk_size >> shift;
+    }
+
+    if (checksum) {
+        const uint32_t crc = crc32c(out->data() + start, chunk_size);
+        for (int i = 0, shift = 24; shift >= 0; i++, shift -= 8) {
+            entry[CHUNK_ENTRY_SIZE + i] = crc >> shift;
+        }
+    }
+}
+
+/**
+ * Stores the checksum of the header and the filled in chunk table of
+ * `chunks` chunks at offset `table` of `out` right after the table,
+ * if the image has checksums.
+ */
+static void seal_chunk_table(std::vector<uint8_t> *out, size_t table, uint64_t chunks, bool checksum)
+{
+    if (!checksum) {
+        return;
+    }
+    const size_t end = table + chunks * chunk_entry_size(true);
+    const uint32_t crc = crc32c(out->data(), end);
+    for (int i = 0, shift = 24; shift >= 0; i++, shift -= 8) {
+        (*out)[end + i] = crc >> shift;
+    }
+}
+
+/**
+ * Reads the chunk table of a chunked image. The checksum of the header
+ * and the table is verified, if the image has checksums.
+ * @param data pointer to the chunk table, which directly follows the header.
+ * @param size size of `data` in bytes.
+ * @param header_size size of the header, which precedes `data`.
+ * @param chunks the number of chunks.
+ * @param checksum true if the image has checksums.
+ * @param entries pointer to vector, which is filled with the table entries.
+ * @throws const char * if the table is truncated or fails its checksum.
+ */
+static void read_chunk_table(
+    const uint8_t *data, size_t size, size_t header_size, uint64_t chunks,
+    bool checksum, std::vector<struct chunk_entry> *entries)
+{
+    const size_t entry_size = chunk_entry_size(checksum);
+    if (chunks > size / entry_size || chunk_table_size(chunks, checksum) > size) {
+        throw "Encoded image is truncated.";
+    }
+
+    if (checksum) {
+        const uint8_t *stored = data + chunks * entry_size;
+        const uint32_t crc = (uint32_t) stored[0] << 24 | stored[1] << 16 | stored[2] << 8 | stored[3];
+        if (crc32c(data - header_size, header_size + chunks * entry_size) != crc) {
+            throw "Encoded image has a corrupt header.";
+        }
+    }
+
+    entries->resize(chunks);
+    size_t offset = chunk_table_size(chunks, checksum);
+    for (uint64_t c = 0; c < chunks; c++) {
+        const uint8_t *entry = data + c * entry_size;
+        uint64_t chunk_size = 0;
+        for (int i = 0; i < CHUNK_ENTRY_SIZE; i++) {
+            chunk_size = (chunk_size << 8) | entry[i];
+        }
+        if (chunk_size > size - offset) {
+            throw "Encoded image is truncated.";
+        }
+
+        uint32_t crc = 0;
+        for (int i = 0; checksum && i < CHECKSUM_SIZE; i++) {
+            crc = (crc << 8) | entry[CHUNK_ENTRY_SIZE + i];
+        }
+        (*entries)[c] = {offset, chunk_size, crc};
+        offset += chunk_size;
+    }
+}
+
+/**
+ * Reads the plane table of a multi-channel image (see Codec::encode_planes()).
+ * @param data pointer to the plane table, which directly follows the header.
+ * @param size size of `data` in bytes.
+ * @param channels the number of planes.
+ * @param offsets array, via which the offsets of the planes in `data`
+ * are returned.
+ * @param sizes array, via which the encoded sizes of the planes are returned.
+ */
+static void read_plane_table(
+    const uint8_t *data, size_t size, uint8_t channels, size_t *offsets, size_t *sizes)
+{
+    if (channels > size / PLANE_ENTRY_SIZE) {
+        throw "Encoded image is truncated.";
+    }
+
+    size_t offset = channels * PLANE_ENTRY_SIZE;
+    for (uint8_t p = 0; p < channels; p++) {
+        uint64_t plane_size = 0;
+        for (int i = 0; i < PLANE_ENTRY_SIZE; i++) {
+            plane_size = (plane_size << 8) | data[p * PLANE_ENTRY_SIZE + i];
+        }
+        if (plane_size > size - offset) {
+            throw "Encoded image is truncated.";
+        }
+        offsets[p] = offset;
+        sizes[p] = plane_size;
+        offset += plane_size;
+    }
+}
+
+/** Writes `frame[i] - reference[i]` of `size` pixels to `residuals`. */
+template <typename Pixel>
+static void temporal_residuals(
+    const uint8_t *frame, const uint8_t *reference, uint8_t *residuals, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        store_pixel<Pixel>(residuals, i,
+            (Pixel) (load_pixel<Pixel>(frame, i) - load_pixel<Pixel>(reference, i)));
+    }
+}
+
+/** Adds `reference` to the `size` residuals in `px`. */
+template <typename Pixel>
+static void temporal_inverse(uint8_t *px, const uint8_t *reference, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        store_pixel<Pixel>(px, i,
+            (Pixel) (load_pixel<Pixel>(px, i) + load_pixel<Pixel>(reference, i)));
+    }
+}
+
+/**
+ * Copies the residuals of the pixels in columns [`x_from`, `x_to`) of rows
+ * [`y_from`, `y_to`) of image `px` row by row to `dst`.
+ * @returns The number of pixels copied.
+ */
+template <typename Pixel>
+static size_t copy_residuals(
+    const uint8_t *px, uint32_t width, bool model,
+    uint32_t x_from, uint32_t x_to, uint32_t y_from, uint32_t y_to, uint8_t *dst)
+{
+    size_t n = 0;
+    for (uint32_t y = y_from; y < y_to; y++) {
+        for (uint32_t x = x_from; x < x_to; x++) {
+            const size_t i = (size_t) y * width + x;
+            store_pixel<Pixel>(dst, n++, model ?
+                PredictLeft::residual<Pixel>(px, i) : PredictNone::residual<Pixel>(px, i));
+        }
+    }
+    return n;
+}
+
+/*
+ * Memory bounded decoding (Codec::decode_bounded()). Instead of decoding
+ * the whole Huffman stream, then the whole RLE stream into the whole image,
+ * the stages are fused: a block of SYMBOL_BLOCK symbols at a time is
+ * Huffman decoded and run-length decoded into a band of rows, which is
+ * handed on and reused for the next band.
+ */
+
+/** @returns The message of the error `e` thrown by the Huffman decoder. */
+static const char *huffman_error(int e)
+{
+    switch (e)
+    {
+    case ERR_FIRST_BIT_NOT_0:
+        return "Encoded image is corrupt (Huffman decoder error: first bit not 0).";
+    case ERR_LARGE_KEY:
+        return "Encoded image is corrupt (Huffman decoder error: symbol out of range).";
+    case ERR_ARENA_FULL:
+        return "Encoded image is corrupt (Huffman decoder error: decoder tree full).";
+    default:
+        return "Encoded image is corrupt (Huffman decoder error: non-empty decoder tree).";
+    }
+}
+
+/**
+ * Run-length decoder, which may be stopped after any pixel (e.g. in the
+ * middle of a run) and resumed with more symbols, see irle_kernel().
+ */
+struct RunDecoder
+{
+    uint64_t written = 0; //!< Pixels decoded so far.
+
+    virtual ~RunDecoder() {}
+    /**
+     * Decode `symbols` until the `limit`-th pixel of the scan is written
+     * or the symbols run out. Pixel `i` of the scan is written to
+     * `out[i - offset]`.
+     * @returns The number of symbols consumed, the rest of a pixel value
+     * split across two blocks is left unconsumed.
+     */
+    virtual size_t feed(const uint8_t *symbols, size_t size, uint8_t *out,
+        size_t offset, uint64_t limit) = 0;
+};
+
+template <typename Pixel, typename Scan>
+struct ScanRunDecoder : public RunDecoder
+{
+    Scan scan;
+    Pixel previous = 0;
+    uint32_t run = 0;     //!< How many times `previous` was read in a row.
+    uint32_t repeat = 0;  //!< Repetitions of `previous` not yet written.
+    bool counted = false; //!< True if a run length comes next.
+
+    ScanRunDecoder(uint32_t width, uint32_t height, const struct scan_layout *layout) :
+        scan(width, height, layout) {}
+
+    size_t feed(const uint8_t *symbols, size_t size, uint8_t *out,
+        size_t offset, uint64_t limit) override
+    {
+        auto put = [&](Pixel value) {
+            store_pixel<Pixel>(out, scan.index() - offset, value);
+            scan.next();
+            written++;
+        };
+
+        size_t i = 0;
+        while (written < limit) {
+            if (repeat > 0) {
+                put(previous);
+                repeat--;
+                continue;
+            }
+            if (counted) {
+                if (i >= size) {
+                    break;
+                }
+                repeat = symbols[i++];
+                counted = false;
+                // The next value always starts a new run.
+                run = 0;
+                continue;
+            }
+
+            Pixel value;
+            if (!read_pixel<Pixel>(symbols, size, &i, &value)) {
+                break;
+            }
+            put(value);
+            run = run > 0 && value == previous ? run + 1 : 1;
+            previous = value;
+            // Three same values are followed by the remaining run length.
+            counted = run == 3;
+        }
+        return i;
+    }
+};
+
+template <typename Pixel, typename Scan>
+static RunDecoder *new_run_decoder(uint32_t width, uint32_t height, const struct scan_layout *layout)
+{
+    return new ScanRunDecoder<Pixel, Scan>(width, height, layout);
+}
+
+/**
+ * Restores `pixels` pixels from their model residuals in place, the first
+ * one continuing from the restored pixel `*carry`, which is then updated.
+ */
+template <typename Pixel>
+static void restore_rows(uint8_t *px, size_t pixels, uint32_t *carry)
+{
+    if (pixels == 0) {
+        return;
+    }
+    store_pixel<Pixel>(px, 0, load_pixel<Pixel>(px, 0) + (Pixel) *carry);
+    PredictLeft::inverse<Pixel>(px, pixels);
+    *carry = load_pixel<Pixel>(px, pixels - 1);
+}
+
+/**
+ * Writes all `size` bytes of `data` to file `fd` at `offset`.
+ */
+static void write_fully(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        const ssize_t n = pwrite(fd, data, size, offset);
+        if (n <= 0) {
+            throw "Output file could not be written.";
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+/**
+ * Limits of a memory bounded decoding, see Codec::decode_bounded().
+ */
+struct bounded_context
+{
+    uint64_t budget;             //!< Bytes, which the buffers of a RowSource may take.
+    std::string scratch_dir;     //!< Directory of the temporary files.
+    std::vector<uint64_t> *bad;  //!< Offsets of the chunks failing their checksums.
+};
+
+/**
+ * Source of the decoded rows of an image, from the first to the last.
+ */
+class RowSource
+{
+public:
+    virtual ~RowSource() {}
+    //! Writes the next `rows` rows (contiguous, without gaps) to `dst`.
+    virtual void read(uint8_t *dst, uint32_t rows) = 0;
+};
+
+/**
+ * Geometry and coding of one Huffman stream of a memory bounded decoding,
+ * i.e. of a whole single-channel image or of one of its chunks.
+ */
+struct bounded_stream
+{
+    uint32_t width;
+    uint8_t depth;
+    bool model;
+    uint8_t direction;
+    uint16_t tile;
+    const uint8_t *tile_directions;
+    const HuffmanModel *huffman_model;
+    uint32_t band_rows; //!< Rows decoded at a time.
+    //! Columns of the strips, in which vertically scanned streams are
+    //! staged in a temporary file (0 = decoded in bands of rows).
+    uint32_t strip;
+    std::string scratch_dir;
+};
+
+/**
+ * Rows of one Huffman stream. The rows are decoded a band of `band_rows`
+ * rows at a time. A vertically scanned stream, whose whole does not fit
+ * into the memory limit, is decoded a strip of columns at a time into
+ * a temporary file first, from which its rows are read back. The stream
+ * must be in a read-only file mapping, the pages of which are dropped
+ * once decoded.
+ */
+class StreamRows : public RowSource
+{
+private:
+    struct bounded_stream geo;
+    uint32_t height = 0;
+    size_t row_size;
+    const uint8_t *code = nullptr;
+    size_t size = 0, pos = 0;
+    bool more = false; //!< True until the Huffman stream ends.
+    Huffman huffman;
+    std::vector<uint8_t> symbols;
+    size_t used = 0;   //!< Symbols already run-length decoded.
+    std::unique_ptr<RunDecoder> run;
+    std::vector<uint8_t> band;
+    uint32_t next_row = 0;
+    size_t band_size = 0, band_pos = 0;
+    uint32_t carry = 0; //!< The last restored pixel of the model.
+    int scratch = -1;
+    uintptr_t dropped = 0; //!< End of the pages of the stream dropped so far.
+
+    void drop_decoded()
+    {
+        static const uintptr_t page = sysconf(_SC_PAGESIZE);
+        const uintptr_t start = std::max(dropped, ((uintptr_t) code + page - 1) & ~(page - 1));
+        const uintptr_t end = ((uintptr_t) code + pos / 8) & ~(page - 1);
+        if (end >= start + DROP_BYTES) {
+            madvise((void *) start, end - start, MADV_DONTNEED);
+            dropped = end;
+        }
+    }
+
+    void fill(uint8_t *out, size_t offset, uint64_t limit)
+    {
+        while (true) {
+            used += run->feed(symbols.data() + used, symbols.size() - used, out, offset, limit);
+            if (run->written >= limit || !more) {
+                return;
+            }
+            symbols.erase(symbols.begin(), symbols.begin() + used);
+            used = 0;
+            try
+            {
+                more = huffman.decode_some(code, size, &pos, &symbols, SYMBOL_BLOCK);
+            }
+            catch(int e)
+            {
+                more = false;
+                corrupt = true;
+                throw huffman_error(e);
+            }
+            drop_decoded();
+        }
+    }
+
+    void decode_strips()
+    {
+        if (scratch < 0) {
+            scratch = open(geo.scratch_dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+            if (scratch < 0) {
+                throw "Could not create a temporary file for decoding.";
+            }
+        }
+        // Pixels missing from a truncated stream stay zero.
+        if (ftruncate(scratch, 0) != 0 || ftruncate(scratch, (off_t) row_size * height) != 0) {
+            throw "Could not create a temporary file for decoding.";
+        }
+
+        const size_t pixel_size = geo.depth / 8;
+        for (uint32_t x0 = 0; x0 < geo.width; x0 += geo.strip) {
+            const uint32_t columns = std::min(geo.strip, geo.width - x0);
+            memset(band.data(), 0, band.size());
+            fill(band.data(), x0, (uint64_t) (x0 + columns) * height);
+            for (uint32_t y = 0; y < height; y++) {
+                write_fully(scratch, band.data() + (size_t) y * geo.strip * pixel_size,
+                    columns * pixel_size, ((uint64_t) y * geo.width + x0) * pixel_size);
+            }
+            sync_file_range(scratch, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+
+    void next_band()
+    {
+        const uint32_t rows = std::min(geo.band_rows, height - next_row);
+        band_size = rows * row_size;
+        band_pos = 0;
+        if (scratch >= 0) {
+            if (pread(scratch, band.data(), band_size, (off_t) next_row * row_size)
+                != (ssize_t) band_size) {
+                throw "Could not read a temporary file for decoding.";
+            }
+        } else {
+            memset(band.data(), 0, band_size);
+            fill(band.data(), (size_t) next_row * geo.width, (uint64_t) (next_row + rows) * geo.width);
+        }
+        if (geo.model) {
+            if (geo.depth == 16) {
+                restore_rows<uint16_t>(band.data(), (size_t) rows * geo.width, &carry);
+            } else {
+                restore_rows<uint8_t>(band.data(), (size_t) rows * geo.width, &carry);
+            }
+        }
+        next_row += rows;
+    }
+public:
+    bool corrupt = false; //!< True once the Huffman decoder failed on the stream.
+
+    StreamRows(const struct bounded_stream *geo, uint32_t max_height) : geo(*geo)
+    {
+        row_size = (size_t) geo->width * (geo->depth / 8);
+        symbols.reserve(2 * SYMBOL_BLOCK);
+        band.resize(std::max((size_t) geo->strip * max_height * (geo->depth / 8),
+            geo->band_rows * row_size));
+    }
+
+    ~StreamRows()
+    {
+        if (scratch >= 0) {
+            close(scratch);
+        }
+    }
+
+    /**
+     * Start decoding the stream `code` of `size` bytes of `height` rows.
+     * @param first_tile index of the direction bit of the stream's first tile.
+     */
+    void start(const uint8_t *code, size_t size, uint32_t height, uint64_t first_tile)
+    {
+        typedef RunDecoder *(*factory)(uint32_t, uint32_t, const struct scan_layout *);
+        static const factory factories[2][5] = { // [16-bit][scan]
+            {new_run_decoder<uint8_t, ScanHorizontal>, new_run_decoder<uint8_t, ScanVertical>,
+                new_run_decoder<uint8_t, ScanHilbert>, new_run_decoder<uint8_t, ScanZigzag>,
+                new_run_decoder<uint8_t, ScanTiled>},
+            {new_run_decoder<uint16_t, ScanHorizontal>, new_run_decoder<uint16_t, ScanVertical>,
+                new_run_decoder<uint16_t, ScanHilbert>, new_run_decoder<uint16_t, ScanZigzag>,
+                new_run_decoder<uint16_t, ScanTiled>},
+        };
+
+        this->code = code;
+        this->size = size;
+        this->height = height;
+        dropped = 0;
+        pos = 0;
+        more = false;
+        corrupt = false;
+        symbols.clear();
+        used = 0;
+        next_row = 0;
+        band_size = 0;
+        band_pos = 0;
+        carry = 0;
+
+        if (geo.huffman_model != nullptr) {
+            huffman = *(geo.huffman_model->tree());
+        } else {
+            huffman.reset_tree();
+        }
+        if (size > 0) {
+            try
+            {
+                pos = huffman.decode_begin(code, size);
+                more = true;
+            }
+            catch(int e)
+            {
+                corrupt = true;
+                throw huffman_error(e);
+            }
+        }
+
+        // The strips are decoded as if their rows were `strip` pixels apart.
+        struct scan_layout layout = {geo.tile, geo.tile_directions, first_tile};
+        layout.stride = geo.strip;
+        const int scan = geo.tile > 0 ? SCAN_ORDERS : geo.direction;
+        run.reset(factories[geo.depth == 16][scan](geo.width, height, &layout));
+
+        if (geo.strip > 0) {
+            decode_strips();
+        }
+    }
+
+    void read(uint8_t *dst, uint32_t rows) override
+    {
+        size_t left = rows * row_size;
+        while (left > 0) {
+            if (band_pos == band_size) {
+                next_band();
+            }
+            const size_t n = std::min(left, band_size - band_pos);
+            memcpy(dst, band.data() + band_pos, n);
+            band_pos += n;
+            dst += n;
+            left -= n;
+        }
+    }
+};
+
+/**
+ * Rows of a chunked image, decoded chunk by chunk. The rows of a chunk,
+ * which fails its checksum, are zeros, as are the rows of a chunk from
+ * the band, in which it fails to decode.
+ */
+class ChunkRows : public RowSource
+{
+private:
+    StreamRows stream;
+    const uint8_t *data; //!< The chunk table.
+    std::vector<struct chunk_entry> entries;
+    uint64_t base;       //!< Offset of the chunk table in the file.
+    uint64_t rows_per_chunk, chunk_tiles;
+    uint32_t height;
+    size_t row_size;
+    bool checksum;
+    std::vector<uint64_t> *bad;
+    uint64_t chunk = 0;
+    uint32_t left = 0;   //!< Rows left in the current chunk.
+    bool corrupt = false;
+public:
+    ChunkRows(const struct bounded_stream *geo, const uint8_t *data, size_t size,
+        size_t header_size, uint64_t base, uint32_t height, uint64_t rows_per_chunk, uint64_t chunk_tiles, bool checksum,
+        std::vector<uint64_t> *bad) :
+        stream(geo, (uint32_t) std::min<uint64_t>(rows_per_chunk, height)),
+        data(data), base(base + header_size), rows_per_chunk(rows_per_chunk), chunk_tiles(chunk_tiles),
+        height(height), row_size((size_t) geo->width * (geo->depth / 8)),
+        checksum(checksum), bad(bad)
+    {
+        const uint64_t chunks = (height + rows_per_chunk - 1) / rows_per_chunk;
+        read_chunk_table(data, size, header_size, chunks, checksum, &entries);
+    }
+
+    void read(uint8_t *dst, uint32_t rows) override
+    {
+        while (rows > 0) {
+            if (left == 0) {
+                const struct chunk_entry &entry = entries[chunk];
+                const uint64_t first = chunk * rows_per_chunk;
+                left = (uint32_t) std::min<uint64_t>(rows_per_chunk, height - first);
+                corrupt = checksum && crc32c(data + entry.offset, entry.size) != entry.checksum;
+                if (!corrupt) {
+                    try
+                    {
+                        stream.start(data + entry.offset, entry.size, left, chunk * chunk_tiles);
+                    }
+                    catch(const char *e)
+                    {
+                        if (!stream.corrupt) {
+                            throw;
+                        }
+                        corrupt = true;
+                    }
+                }
+                if (corrupt) {
+                    bad->push_back(base + entry.offset);
+                }
+                chunk++;
+            }
+            const uint32_t n = std::min(rows, left);
+            if (!corrupt) {
+                try
+                {
+                    stream.read(dst, n);
+                }
+                catch(const char *e)
+                {
+                    if (!stream.corrupt) {
+                        throw;
+                    }
+                    // The rows already handed on cannot be zeroed anymore.
+                    corrupt = true;
+                    bad->push_back(base + entries[chunk - 1].offset);
+                }
+            }
+            if (corrupt) {
+                memset(dst, 0, n * row_size);
+            }
+            dst += n * row_size;
+            rows -= n;
+            left -= n;
+        }
+    }
+};
+
+/**
+ * Rows of a multi-channel image, interleaved from the rows of its planes.
+ */
+class PlaneRows : public RowSource
+{
+private:
+    std::vector<std::unique_ptr<RowSource>> planes;
+    std::vector<std::vector<uint8_t>> plane_rows;
+    plane_merger merge;
+    uint32_t width, batch;
+    size_t plane_row;
+public:
+    PlaneRows(std::vector<std::unique_ptr<RowSource>> *planes, plane_merger merge,
+        uint32_t width, uint8_t depth, uint32_t batch) :
+        planes(std::move(*planes)), plane_rows(this->planes.size()), merge(merge),
+        width(width), batch(batch), plane_row((size_t) width * (depth / 8))
+    {
+        for (auto &rows : plane_rows) {
+            rows.resize(batch * plane_row);
+        }
+    }
+
+    void read(uint8_t *dst, uint32_t rows) override
+    {
+        uint8_t *sources[MAX_CHANNELS];
+        while (rows > 0) {
+            const uint32_t n = std::min(rows, batch);
+            for (size_t p = 0; p < planes.size(); p++) {
+                planes[p]->read(plane_rows[p].data(), n);
+                sources[p] = plane_rows[p].data();
+            }
+            merge(sources, (size_t) n * width, dst);
+            dst += n * plane_row * planes.size();
+            rows -= n;
+        }
+    }
+};
+
 Codec::Codec(Image *img)
 {
-    this->img = img;
+    this->img = img;
+}
+
+/** Default constructor.
+ */
+Codec::Codec()
+{
+}
+
+Codec::~Codec()
+{
+}
+
+/**
+ * Load RAW image from `img_path` with `width`, `depth` bits per channel
+ * and `channels` interleaved channels.
+ */
+void Codec::open_image(std::string img_path, uint32_t width, uint8_t depth, uint8_t channels)
+{
+    STATS_TIMER(STAGE_IO);
+    this->img_data.load(img_path, width, depth, channels);
+    this->img = &(this->img_data);
+}
+
+/**
+ * Load encoded image from file `img_path`.
+ * @param img_path the path to encoded image file.
+ */
+void Codec::open_image(std::string img_path)
+{
+    std::vector<uint8_t> *original = &(this->buffers.file);
+    uint32_t width, height;
+    uint8_t depth, channels;
+    std::fstream fs;
+
+    {
+        STATS_TIMER(STAGE_IO);
+        fs.open(img_path, std::ios_base::in | std::ios_base::binary);
+
+        // Load data from file to memory.
+        load_encoded_data(&fs, original);
+
+        fs.close();
+    }
+
+    decode(original->data(), original->size(), &(this->buffers.pixels),
+        &width, &height, &(this->buffers), &depth, &channels);
+
+    // Save image data. The previous image's storage is swapped
+    // into the buffers for reuse.
+    this->img_data.assign(&(this->buffers.pixels), width, height, depth, channels);
+    this->img = &(this->img_data);
+}
+
+/**
+ * Decode the encoded image file `in_path` straight into the raw image file
+ * `out_path` (see Codec::decode_file()), without keeping the pixels.
+ */
+void Codec::decode(std::string in_path, std::string out_path)
+{
+    std::vector<uint8_t> *original = &(this->buffers.file);
+    {
+        STATS_TIMER(STAGE_IO);
+        std::fstream fs;
+        fs.open(in_path, std::ios_base::in | std::ios_base::binary);
+        load_encoded_data(&fs, original);
+        fs.close();
+    }
+
+    decode_file(original->data(), original->size(), out_path, &(this->buffers));
+}
+
+/**
+ * Returns the offsets of the chunks of the last decoded image, which
+ * failed their checksum (see Codec::decode_chunked()).
+ */
+const std::vector<uint64_t> &Codec::corrupt_blocks()
+{
+    return this->buffers.bad_blocks;
+}
+
+/**
+ * Save pixel data to file `out_path` as raw pixel data.
+ * @param out_path specifies the file, to which to save the image.
+ */
+void Codec::save_raw(std::string out_path)
+{
+    STATS_TIMER(STAGE_IO);
+    std::fstream fs;
+    fs.open(out_path, std::ios_base::out | std::ios_base::binary);
+
+    fs.write((char *) this->img->data(), this->img->size());
+
+    fs.close();
+}
+
+void Codec::encode(std::string out_path, struct enc_options opts)
+{
+    uint32_t width, height;
+    this->img->dimensions(&width, &height);
+    opts.depth = this->img->depth();
+    opts.channels = this->img->channels();
+
+    std::vector<uint8_t> *encoded = &(this->buffers.file);
+    encode(this->img->data(), width, height, opts, encoded, &(this->buffers));
+
+    STATS_TIMER(STAGE_IO);
+    std::fstream fs;
+    fs.open(out_path, std::ios_base::out | std::ios_base::binary);
+    fs.write((char *) encoded->data(), encoded->size());
+    fs.close();
+}
+
+/**
+ * Encode `width` * `height` pixels of raw image data in `data` into `out`.
+ * The header (dimensions and options) is written first, followed by the
+ * Huffman coded data - the same layout as an encoded file.
+ * The input data is never modified and the method keeps no state between
+ * calls, so it may be called concurrently from multiple threads.
+ * @param data pointer to raw pixel data, row by row. Pixels of multi-channel
+ * images are interleaved (see Codec::encode_planes()).
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts encoding options. `opts.direction` is set here based
+ * on `opts.scan` or `opts.adaptive`. If `opts.search` is set, the model
+ * and scan order are picked by encoding with all of their combinations. If `opts.effort`
+ * is set, it overrides both (see Codec::encode_effort()). Otherwise, if
+ * `opts.tile` is set, the direction is picked for every tile.
+ * @param out pointer to caller's vector, which will be overwritten with
+ * the encoded image. Its capacity is reused.
+ * @param buf optional intermediate buffers to be reused. If nullptr,
+ * temporary buffers are allocated for this call only.
+ */
+void Codec::encode(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
+{
+    struct codec_buffers local;
+    if (buf == nullptr) {
+        buf = &local;
+    }
+
+    if (opts.channels > 1) {
+        encode_planes(data, width, height, opts, out, buf);
+        return;
+    }
+
+    if (opts.chain != nullptr) {
+        encode_chained(data, width, height, opts, out, buf);
+        return;
+    }
+
+    const size_t pixels = (size_t) width * height;
+    if (opts.chunk_rows == 0 && pixels > CHUNK_THRESHOLD) {
+        opts.chunk_rows = CHUNK_PIXELS / width > 0 ? CHUNK_PIXELS / width : 1;
+    }
+    if (opts.chunk_rows == 0 && opts.checksum) {
+        // The chunks are the blocks, which are checked on their own.
+        opts.chunk_rows = width > 0 && CHECKSUM_PIXELS / width > 0 ? CHECKSUM_PIXELS / width : 1;
+    }
+
+    if (opts.effort >= 0 || opts.search) {
+        // The option searches pick a single direction for the whole image.
+        opts.tile = 0;
+    }
+
+    if (opts.effort >= 0) {
+        encode_effort(data, width, height, opts, out, buf);
+        return;
+    }
+
+    if (opts.search) {
+        std::vector<struct enc_options> candidates;
+        for (int model = 0; model <= 1; model++) {
+            for (int direction = 0; direction < SCAN_ORDERS; direction++) {
+                struct enc_options candidate = opts;
+                candidate.model = model;
+                candidate.direction = direction;
+                candidate.adaptive = false;
+                candidate.search = false;
+                candidates.push_back(candidate);
+            }
+        }
+        encode_best(data, width, height, candidates, out, buf);
+        return;
+    }
+
+    if (opts.tile > 0) {
+        // Every tile is scanned in its own direction.
+        opts.direction = DIRECTION_HORIZONTAL;
+        tile_directions(data, width, height, opts, &(buf->tile_directions));
+        opts.tile_directions = buf->tile_directions.data();
+        encode_with(data, width, height, opts, out, buf);
+        return;
+    }
+
+    // If adaptive, then choose best direction. Otherwise use horizontal
+    if (opts.scan >= 0) {
+        opts.direction = (uint8_t) opts.scan;
+    } else if (opts.adaptive) {
+        opts.direction = best_encoding_direction(data, width, height, opts.depth);
+    } else {
+        opts.direction = DIRECTION_HORIZONTAL;
+    }
+
+    encode_with(data, width, height, opts, out, buf);
+}
+
+/**
+ * Encode `data` as a delta frame: the per-pixel difference to the previous
+ * frame `reference` (modulo 2^depth) is encoded with the options `opts`,
+ * as an image of its own would be. The spatial model may be applied on top.
+ * Mostly static scenes leave long runs of zeros.
+ * @param data pointer to raw pixel data of the frame, row by row.
+ * @param reference pointer to raw pixel data of the previous frame.
+ * See Codec::encode() for the other parameters.
+ */
+void Codec::encode_delta(
+    const uint8_t *data, const uint8_t *reference,
+    uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
+{
+    struct codec_buffers local;
+    if (buf == nullptr) {
+        buf = &local;
+    }
+
+    const size_t samples = (size_t) width * height * opts.channels;
+    buf->residuals.resize(samples * (opts.depth / 8));
+    if (opts.depth == 16) {
+        temporal_residuals<uint16_t>(data, reference, buf->residuals.data(), samples);
+    } else {
+        temporal_residuals<uint8_t>(data, reference, buf->residuals.data(), samples);
+    }
+
+    opts.delta = true;
+    encode(buf->residuals.data(), width, height, opts, out, buf);
+}
+
+/**
+ * Encode the image exactly with the options `opts` (`opts.direction`, or
+ * `opts.tile_directions` of a tiled image, must already be set).
+ * See Codec::encode() for the parameters.
+ */
+void Codec::encode_with(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
+{
+    const size_t pixels = (size_t) width * height;
+    if (opts.chunk_rows > 0) {
+        encode_chunked(data, width, height, opts, out, buf);
+        return;
+    }
+
+    std::vector<uint8_t> *encoded = &(buf->symbols);
+    encoded->clear();
+    encoded->reserve(rle_bound(pixels, opts.depth));
+
+    // Run-length encoding (with the subtraction model applied on the fly
+    // if requested).
+    const struct scan_layout layout = {opts.tile, opts.tile_directions, 0};
+    rle(data, width, height, opts.model, opts.direction, encoded, opts.depth, &layout);
+
+    // Every RLE symbol is coded with at most 9 + depth bits, but most
+    // are far shorter. Reserve the header plus 9 bits per symbol.
+    out->clear();
+    out->reserve(HEADER_SIZE + MODEL_ID_SIZE + encoded->size() + encoded->size() / 8 + 2);
+    write_header(width, height, opts, out);
+
+    // Huffman encoding, appended right after the header.
+    huffman_enc(encoded, out, opts.huffman_model, &(buf->huffman));
+
+    STATS_INC(images);
+    STATS_ADD(bytes_in, pixels * (opts.depth / 8));
+    STATS_ADD(bytes_out, out->size());
+}
+
+/**
+ * Encode the image with the chain of stages `opts.chain` (see Pipeline)
+ * instead of the fixed model, scanning and Huffman coding. The chain is
+ * described in the header, so the decoder can build the same chain.
+ * Chains encode the image as a whole, they cannot be combined with chunks,
+ * checksums or tiles. See Codec::encode() for the parameters.
+ */
+void Codec::encode_chained(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
+{
+    const size_t pixels = (size_t) width * height;
+    if (opts.chunk_rows > 0 || opts.checksum || opts.tile > 0 || pixels > CHUNK_THRESHOLD) {
+        throw "Transform chains cannot be combined with chunks, checksums or tiles.";
+    }
+
+    out->clear();
+    write_header(width, height, opts, out);
+    const struct stage_image img = {width, height, opts.depth};
+    opts.chain->encode(data, &img, out, buf);
+
+    STATS_INC(images);
+    STATS_ADD(bytes_in, pixels * (opts.depth / 8));
+    STATS_ADD(bytes_out, out->size());
+}
+
+/**
+ * Encode the image in chunks of `opts.chunk_rows` rows. Every chunk is
+ * run-length and Huffman encoded on its own (the model and scanning
+ * restart in every chunk), so the intermediate buffers only ever hold
+ * a single chunk. The header is followed by a table of the encoded sizes
+ * of all chunks and then by the chunks. See Codec::encode() for the
+ * parameters.
+ */
+void Codec::encode_chunked(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
+{
+    const uint64_t rows = opts.chunk_rows;
+    const uint64_t chunks = (height + rows - 1) / rows;
+    const size_t row_size = (size_t) width * (opts.depth / 8);
+
+    out->clear();
+    write_header(width, height, opts, out);
+    const size_t table = out->size();
+    out->resize(table + chunk_table_size(chunks, opts.checksum));
+
+    std::vector<uint8_t> *encoded = &(buf->symbols);
+    struct scan_layout layout = {opts.tile, opts.tile_directions, 0};
+    for (uint64_t c = 0; c < chunks; c++) {
+        const uint64_t first = c * rows;
+        const uint32_t chunk_height = (uint32_t) (height - first < rows ? height - first : rows);
+
+        encoded->clear();
+        encoded->reserve(rle_bound((size_t) width * chunk_height, opts.depth));
+        rle(data + first * row_size, width, chunk_height, opts.model,
+            opts.direction, encoded, opts.depth, &layout);
+        layout.first_tile += tile_count(width, chunk_height, opts.tile, 0);
+
+        const size_t start = out->size();
+        huffman_enc(encoded, out, opts.huffman_model, &(buf->huffman));
+        write_chunk_entry(out, table, c, start, opts.checksum);
+    }
+    seal_chunk_table(out, table, chunks, opts.checksum);
+
+    STATS_INC(images);
+    STATS_ADD(bytes_in, (size_t) height * row_size);
+    STATS_ADD(bytes_out, out->size());
+}
+
+/**
+ * Encode the image with each of the `candidates` options, each on its own
+ * thread, and keep the smallest output. The calling thread encodes the first
+ * candidate itself using `buf`, the others use their own temporary buffers.
+ * Ties are won by the earlier candidate. See Codec::encode() for the other
+ * parameters.
+ * @param candidates the options to be tried (with `direction` set).
+ */
+void Codec::encode_best(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    const std::vector<struct enc_options> &candidates,
+    std::vector<uint8_t> *out, struct codec_buffers *buf)
+{
+    std::vector<std::vector<uint8_t>> outputs(candidates.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < candidates.size(); i++) {
+        threads.emplace_back([&, i]() {
+            struct codec_buffers thread_buf;
+            encode_with(data, width, height, candidates[i], &outputs[i], &thread_buf);
+        });
+    }
+    outputs[0].swap(*out);
+    encode_with(data, width, height, candidates[0], &outputs[0], buf);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    size_t best = 0;
+    for (size_t i = 1; i < outputs.size(); i++) {
+        if (outputs[i].size() < outputs[best].size()) {
+            best = i;
+        }
+    }
+    out->swap(outputs[best]);
+}
+
+/**
+ * Encode the image using the strategy of effort level `opts.effort`:
+ *  - 0: horizontal scanning without the model, no analysis at all,
+ *  - 1: scanning direction by counting value changes, model as given,
+ *  - 2-4: model and direction with the best estimated size, sampling every
+ *    4 * ESTIMATE_STRIDE (2), ESTIMATE_STRIDE (3) or ESTIMATE_STRIDE / 4
+ *    (4) rows/columns,
+ *  - 5: the two options with the best (densely) estimated sizes are encoded
+ *    and the smallest output is kept, as with all levels below,
+ *  - 6: as 5, plus the Hilbert and zig-zag scans with the better model,
+ *  - 7: all four estimated options, plus the Hilbert and zig-zag scans with
+ *    the better model,
+ *  - 8: all model/scan order combinations (as with `opts.search`),
+ *  - 9: as 8, plus tiled scanning with the model for each of EFFORT_TILES.
+ *
+ * If `opts.budget_ms` is set, the options are estimated first and the
+ * strategy is downgraded whenever the estimated encoding time would overrun
+ * the budget: the candidates of the lowest priority (tiles, then the scans
+ * which are not estimated, then the worst estimates) are dropped and if even
+ * a single one does not fit, the fastest one is used.
+ * See Codec::encode() for the parameters.
+ */
+void Codec::encode_effort(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const int effort = opts.effort;
+    opts.effort = -1;
+    opts.adaptive = false;
+    opts.search = false;
+
+    if (effort <= 0) {
+        opts.model = false;
+        opts.direction = DIRECTION_HORIZONTAL;
+        encode_with(data, width, height, opts, out, buf);
+        return;
+    }
+
+    std::vector<struct enc_options> candidates;
+    std::vector<struct size_estimate> estimates;
+    if (effort >= 2 || opts.budget_ms > 0) {
+        const uint32_t every = effort == 2 ? ESTIMATE_STRIDE * 4
+            : (effort >= 4 ? ESTIMATE_STRIDE / 4 : ESTIMATE_STRIDE);
+        estimate(data, width, height, opts, &estimates, every);
+    }
+
+    if (effort <= 1) {
+        opts.direction = best_encoding_direction(data, width, height, opts.depth);
+        candidates.push_back(opts);
+    } else {
+        // Best estimated sizes first, ties won by the simpler options.
+        std::vector<struct size_estimate> ranked = estimates;
+        std::stable_sort(ranked.begin(), ranked.end(),
+            [](const struct size_estimate &a, const struct size_estimate &b) {
+                return a.bytes < b.bytes;
+            });
+        const size_t count = effort >= 7 ? ranked.size() : (effort >= 5 ? 2 : 1);
+        for (size_t i = 0; i < count && i < ranked.size(); i++) {
+            candidates.push_back(ranked[i].opts);
+        }
+
+        // The other scan orders are not estimated, so they are tried with
+        // the model of the best estimate (and with both models from 8 on).
+        const bool best_model = ranked.empty() ? opts.model : ranked[0].opts.model;
+        for (int m = 0; effort >= 6 && m < (effort >= 8 ? 2 : 1); m++) {
+            for (int direction = DIRECTION_HILBERT; direction < SCAN_ORDERS; direction++) {
+                struct enc_options candidate = opts;
+                candidate.model = m == 0 ? best_model : !best_model;
+                candidate.direction = direction;
+                candidates.push_back(candidate);
+            }
+        }
+
+        if (effort >= 9) {
+            for (uint16_t tile : EFFORT_TILES) {
+                struct enc_options candidate = opts;
+                candidate.model = true;
+                candidate.tile = tile;
+                candidate.direction = DIRECTION_HORIZONTAL;
+                candidates.push_back(candidate);
+            }
+        }
+    }
+
+    if (opts.budget_ms > 0) {
+        // Scan orders, which are not estimated, cost about as much as
+        // horizontal scanning with the same model.
+        auto predicted = [&](const struct enc_options &c) -> double {
+            const uint8_t direction = c.direction <= DIRECTION_VERTICAL && c.tile == 0
+                ? c.direction : DIRECTION_HORIZONTAL;
+            for (auto &e : estimates) {
+                if (e.opts.model == c.model && e.opts.direction == direction) {
+                    return e.seconds;
+                }
+            }
+            return 0.0;
+        };
+        // Candidates are encoded concurrently, bounded by the number of cores.
+        const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        auto cost = [&]() -> double {
+            double sum = 0.0, longest = 0.0;
+            for (auto &c : candidates) {
+                sum += predicted(c);
+                longest = std::max(longest, predicted(c));
+            }
+            return std::max(longest, sum / std::min<size_t>(cores, candidates.size()));
+        };
+
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const double remaining = opts.budget_ms / 1000.0 - elapsed.count();
+
+        while (candidates.size() > 1 && cost() > remaining) {
+            candidates.pop_back();
+        }
+        if (cost() > remaining) {
+            // Even the best option would overrun. Use the fastest one.
+            const struct size_estimate *fastest = &estimates[0];
+            for (auto &e : estimates) {
+                if (e.seconds < fastest->seconds) {
+                    fastest = &e;
+                }
+            }
+            candidates[0] = fastest->opts;
+        }
+    }
+
+    // The tiles' directions are picked only for the candidates, which are
+    // left after the budget, and must outlive them.
+    std::vector<std::vector<uint8_t>> tile_bits(candidates.size());
+    for (size_t i = 0; i < candidates.size(); i++) {
+        if (candidates[i].tile > 0) {
+            tile_directions(data, width, height, candidates[i], &tile_bits[i]);
+            candidates[i].tile_directions = tile_bits[i].data();
+        }
+    }
+
+    if (candidates.size() == 1) {
+        encode_with(data, width, height, candidates[0], out, buf);
+    } else {
+        encode_best(data, width, height, candidates, out, buf);
+    }
+}
+
+/**
+ * Decode an encoded image held in memory (header included) into `out`.
+ * The method keeps no state between calls, so it may be called concurrently
+ * from multiple threads.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param out pointer to caller's vector, which will be overwritten with the
+ * decoded pixels. Its capacity is reused.
+ * @param width pointer, via which the image width is returned.
+ * @param height pointer, via which the image height is returned.
+ * @param buf optional intermediate buffers to be reused. If nullptr,
+ * temporary buffers are allocated for this call only.
+ * @param depth optional pointer, via which the bits per pixel are returned.
+ * @param channels optional pointer, via which the number of channels
+ * is returned.
+ * @throws const char * if the image is a delta frame (see decode_delta()).
+ */
+void Codec::decode(
+    const uint8_t *data, size_t size, std::vector<uint8_t> *out,
+    uint32_t *width, uint32_t *height, struct codec_buffers *buf,
+    uint8_t *depth, uint8_t *channels)
+{
+    decode_frame(data, size, nullptr, out, nullptr, 0, 0, width, height, buf, depth, channels);
+}
+
+/**
+ * Decode an encoded image held in memory straight into the caller's memory
+ * `dst`, e.g. a framebuffer or a mapped file, without any intermediate copy
+ * of the pixels. Row `y` of the image is written to `dst + y * stride`,
+ * the bytes between the rows are left untouched. Use Codec::info() to get
+ * the dimensions of the image first.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param dst pointer to the first row of the destination.
+ * @param stride bytes between the starts of two rows in `dst`, at least
+ * the size of a row and a multiple of the size of one channel of a pixel.
+ * @param capacity size of `dst` in bytes.
+ * @param width pointer, via which the image width is returned.
+ * @param height pointer, via which the image height is returned.
+ * @param buf optional intermediate buffers to be reused. If nullptr,
+ * temporary buffers are allocated for this call only.
+ * @throws const char * if the rows do not fit into `dst` or if the image
+ * is a delta frame.
+ */
+void Codec::decode_into(
+    const uint8_t *data, size_t size, uint8_t *dst, size_t stride, size_t capacity,
+    uint32_t *width, uint32_t *height, struct codec_buffers *buf)
+{
+    decode_frame(data, size, nullptr, nullptr, dst, stride, capacity, width, height, buf, nullptr);
+}
+
+/**
+ * Returns the dimensions and the pixel format of an encoded image from its
+ * header, without decoding it.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param width pointer, via which the image width is returned.
+ * @param height pointer, via which the image height is returned.
+ * @param depth optional pointer, via which the bits per channel are returned.
+ * @param channels optional pointer, via which the number of channels
+ * is returned.
+ */
+void Codec::info(
+    const uint8_t *data, size_t size, uint32_t *width, uint32_t *height,
+    uint8_t *depth, uint8_t *channels)
+{
+    struct enc_options opts;
+    read_header(data, size, width, height, &opts);
+    if (depth != nullptr) {
+        *depth = opts.depth;
+    }
+    if (channels != nullptr) {
+        *channels = opts.channels;
+    }
+}
+
+/**
+ * Decode an encoded image held in memory into the raw image file `out_path`.
+ * The file is created with its final size and mapped into memory, so that
+ * the pixels are decoded straight into the page cache.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param out_path path of the raw image file to be written.
+ * @param buf optional intermediate buffers to be reused.
+ * @returns The size of the written file in bytes.
+ */
+uint64_t Codec::decode_file(
+    const uint8_t *data, size_t size, std::string out_path,
+    struct codec_buffers *buf)
+{
+    uint32_t width, height;
+    uint8_t depth, channels;
+    info(data, size, &width, &height, &depth, &channels);
+    const uint64_t row_size = (uint64_t) width * channels * (depth / 8);
+    const uint64_t out_size = row_size * height;
+
+    const int fd = open(out_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw "Output file could not be written.";
+    }
+    if (ftruncate(fd, out_size) != 0) {
+        close(fd);
+        throw "Output file could not be written.";
+    }
+    if (out_size == 0) {
+        close(fd);
+        decode_into(data, size, nullptr, row_size, 0, &width, &height, buf);
+        return 0;
+    }
+
+    void *map = mmap(nullptr, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw "Output file could not be mapped.";
+    }
+
+    try
+    {
+        decode_into(data, size, (uint8_t *) map, row_size, out_size,
+            &width, &height, buf);
+    }
+    catch(...)
+    {
+        munmap(map, out_size);
+        throw;
+    }
+    munmap(map, out_size);
+    return out_size;
+}
+
+/**
+ * Returns the rows of the bands, in which a stream of `height` rows of
+ * `row_size` bytes is decoded within `budget` bytes: all rows if they fit,
+ * otherwise a multiple of `unit` rows (the height of the blocks of the scan),
+ * or 0 if not even `unit` rows fit.
+ */
+static uint32_t band_rows(uint64_t budget, size_t row_size, uint32_t height, uint32_t unit)
+{
+    if (row_size == 0 || budget / row_size >= height) {
+        return std::max(height, 1u);
+    }
+    return (uint32_t) (budget / row_size / unit * unit);
+}
+
+/**
+ * Open the rows of encoded image `data` for Codec::decode_bounded(). Their
+ * buffers take about `ctx->budget` bytes at most, a multi-channel image
+ * splits the budget among its planes.
+ * @param data pointer to the encoded image.
+ * @param size size of `data` in bytes.
+ * @param base offset of `data` in the encoded file.
+ * @param ctx the limits of the decoding.
+ * @param width pointer, via which the width of the image is returned.
+ * @param height pointer, via which the height of the image is returned.
+ * @param row_size pointer, via which the size of a decoded row is returned.
+ * @return the rows, to be deleted by the caller.
+ */
+RowSource *Codec::open_rows(
+    const uint8_t *data, size_t size, uint64_t base, const struct bounded_context *ctx,
+    uint32_t *width, uint32_t *height, size_t *row_size)
+{
+    struct enc_options opts;
+    const size_t header_size = read_header(data, size, width, height, &opts);
+    if (opts.delta) {
+        throw "Delta frames cannot be decoded within a memory limit.";
+    }
+    if (opts.chained) {
+        throw "Images encoded with a transform chain cannot be decoded within a memory limit.";
+    }
+    const size_t pixel_size = opts.depth / 8;
+    const size_t plane_row = (size_t) *width * pixel_size;
+    *row_size = plane_row * opts.channels;
+
+    if (opts.channels > 1) {
+        size_t offsets[MAX_CHANNELS], sizes[MAX_CHANNELS];
+        read_plane_table(data + header_size, size - header_size, opts.channels, offsets, sizes);
+
+        // Half of the budget goes to the planes, half to the rows merged.
+        struct bounded_context plane_ctx = *ctx;
+        plane_ctx.budget = ctx->budget / 2 / opts.channels;
+        std::vector<std::unique_ptr<RowSource>> planes;
+        for (uint8_t p = 0; p < opts.channels; p++) {
+            uint32_t plane_width, plane_height;
+            size_t plane_row_size;
+            planes.emplace_back(open_rows(data + header_size + offsets[p], sizes[p],
+                base + header_size + offsets[p], &plane_ctx,
+                &plane_width, &plane_height, &plane_row_size));
+            if (plane_width != *width || plane_height != *height || plane_row_size != plane_row) {
+                throw "Encoded image has a plane of a different size.";
+            }
+        }
+        const uint32_t batch = band_rows(plane_ctx.budget, plane_row, *height, 1);
+        if (batch == 0) {
+            throw "The image cannot be decoded within the memory limit.";
+        }
+        return new PlaneRows(&planes, find_merger(opts.depth, opts.channels, opts.color_transform),
+            *width, opts.depth, batch);
+    }
+
+    const uint32_t stream_height = opts.chunk_rows > 0 ?
+        std::min(opts.chunk_rows, *height) : *height;
+    struct bounded_stream geo = {*width, opts.depth, opts.model, opts.direction, opts.tile,
+        opts.tile_directions, opts.huffman_model, 0, 0, ctx->scratch_dir};
+    const bool vertical = opts.tile == 0 && opts.direction == DIRECTION_VERTICAL;
+    uint32_t unit = 1;
+    if (opts.tile > 0) {
+        unit = opts.tile;
+    } else if (opts.direction == DIRECTION_HILBERT) {
+        unit = HILBERT_BLOCK;
+    } else if (opts.direction == DIRECTION_ZIGZAG) {
+        unit = ZIGZAG_BLOCK;
+    } else if (vertical) {
+        unit = stream_height;
+    }
+    geo.band_rows = band_rows(ctx->budget, plane_row, stream_height, unit);
+    if (geo.band_rows == 0 && vertical) {
+        // Columns are only complete at the end of a vertical scan, so
+        // the stream is staged in strips and read back in bands.
+        geo.strip = (uint32_t) std::min<uint64_t>(*width,
+            ctx->budget / 2 / ((uint64_t) stream_height * pixel_size));
+        geo.band_rows = band_rows(ctx->budget / 2, plane_row, stream_height, 1);
+        if (geo.strip == 0) {
+            geo.band_rows = 0;
+        }
+    }
+    if (geo.band_rows == 0) {
+        throw "The image cannot be decoded within the memory limit.";
+    }
+
+    if (opts.chunk_rows > 0) {
+        return new ChunkRows(&geo, data + header_size, size - header_size, header_size, base,
+            *height, opts.chunk_rows, tile_count(*width, opts.chunk_rows, opts.tile, 0),
+            opts.checksum, ctx->bad);
+    }
+    std::unique_ptr<StreamRows> rows(new StreamRows(&geo, stream_height));
+    rows->start(data + header_size, size - header_size, *height, 0);
+    return rows.release();
+}
+
+/**
+ * Decode the encoded image file `in_path` into the raw image file
+ * `out_path`, so that the process takes about `max_memory` bytes at most.
+ * Unlike Codec::decode(), the encoded file is mapped and its pages dropped
+ * once decoded, and the Huffman decoding, run-length decoding and model are
+ * fused (see RowSource), a band of rows at a time, on one thread. The rows
+ * are written out band by band. Vertically scanned images, which do not fit,
+ * are staged in a temporary file next to `out_path`. The offsets of corrupt
+ * chunks are kept for Codec::corrupt_blocks().
+ * @param in_path path to the encoded image.
+ * @param out_path path to the decoded raw image.
+ * @param max_memory the limit in bytes, MEMORY_RESERVE of which is taken
+ * by the process itself.
+ */
+void Codec::decode_bounded(std::string in_path, std::string out_path, uint64_t max_memory)
+{
+    std::vector<uint64_t> *bad = &(this->buffers.bad_blocks);
+    bad->clear();
+    if (max_memory <= MEMORY_RESERVE) {
+        throw "The memory limit is too low.";
+    }
+    const uint64_t budget = max_memory - MEMORY_RESERVE;
+
+    const int in = open(in_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0) {
+        if (in >= 0) {
+            close(in);
+        }
+        throw "Could not open the encoded image.";
+    }
+    const size_t size = st.st_size;
+    if (size < HEADER_SIZE) {
+        close(in);
+        throw "Encoded image is missing its header.";
+    }
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+    close(in);
+    if (map == MAP_FAILED) {
+        throw "Could not open the encoded image.";
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const int out = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        munmap(map, size);
+        throw "Output file could not be written.";
+    }
+
+    uint32_t width = 0, height = 0;
+    size_t row_size = 0;
+    try
+    {
+        const std::string dir = std::filesystem::path(out_path).parent_path().string();
+        // Half of the budget goes to the decoding, half to the rows written.
+        const struct bounded_context ctx = {budget / 2, dir.empty() ? "." : dir, bad};
+        std::unique_ptr<RowSource> rows(open_rows((const uint8_t *) map, size, 0, &ctx,
+            &width, &height, &row_size));
+        const uint32_t batch = band_rows(budget / 2, row_size, height, 1);
+        if (batch == 0) {
+            throw "The image cannot be decoded within the memory limit.";
+        }
+
+        std::vector<uint8_t> pixels(std::min(batch, height) * row_size);
+        for (uint32_t y = 0; y < height; ) {
+            const uint32_t n = std::min(batch, height - y);
+            rows->read(pixels.data(), n);
+            write_fully(out, pixels.data(), n * row_size, (uint64_t) y * row_size);
+            // The rows written are not kept in memory.
+            sync_file_range(out, (uint64_t) y * row_size, n * row_size, SYNC_FILE_RANGE_WRITE);
+            y += n;
+        }
+    }
+    catch(...)
+    {
+        close(out);
+        munmap(map, size);
+        throw;
+    }
+    close(out);
+    munmap(map, size);
+
+    STATS_INC(images);
+    STATS_ADD(bytes_in, size);
+    STATS_ADD(bytes_out, (uint64_t) height * row_size);
+
+    // The rest of the image is decoded, the corrupt chunks are zeroed.
+    if (!bad->empty()) {
+        std::sort(bad->begin(), bad->end());
+        throw "Encoded image has corrupt chunks.";
+    }
+}
+
+/**
+ * Decode an encoded delta frame (see Codec::encode_delta()) held in memory
+ * into `out`. Frames, which are not delta frames, are decoded as with
+ * Codec::decode() and `reference` is ignored.
+ * @param reference pointer to the decoded previous frame of the same size
+ * (a delta frame of any other size is rejected).
+ * See Codec::decode() for the other parameters.
+ */
+void Codec::decode_delta(
+    const uint8_t *data, size_t size, const std::vector<uint8_t> *reference,
+    std::vector<uint8_t> *out, uint32_t *width, uint32_t *height,
+    struct codec_buffers *buf)
+{
+    decode_frame(data, size, reference, out, nullptr, 0, 0, width, height, buf, nullptr);
 }
 
-/** Default constructor.
+/**
+ * Implementation of Codec::decode(), Codec::decode_into() and
+ * Codec::decode_delta(). The pixels are decoded into `out`, if it is set,
+ * otherwise into the rows of `dst`.
  */
-Codec::Codec()
+void Codec::decode_frame(
+    const uint8_t *data, size_t size, const std::vector<uint8_t> *reference,
+    std::vector<uint8_t> *out, uint8_t *dst, size_t stride, size_t capacity,
+    uint32_t *width, uint32_t *height, struct codec_buffers *buf, uint8_t *depth,
+    uint8_t *channels)
 {
+    struct codec_buffers local;
+    if (buf == nullptr) {
+        buf = &local;
+    }
+
+    buf->bad_blocks.clear();
+
+    struct enc_options opts;
+    const size_t header_size = read_header(data, size, width, height, &opts);
+    if (depth != nullptr) {
+        *depth = opts.depth;
+    }
+    if (channels != nullptr) {
+        *channels = opts.channels;
+    }
+    if (opts.delta && reference == nullptr) {
+        throw "Encoded image is a delta frame, its reference frame is needed.";
+    }
+
+    const size_t pixels = (size_t) (*width) * (*height);
+    const size_t samples = pixels * opts.channels;
+    const size_t sample_size = opts.depth / 8;
+    const size_t row_size = (size_t) (*width) * opts.channels * sample_size;
+    if (opts.delta && reference->size() != samples * sample_size) {
+        throw "Encoded image is a delta frame of a different size than its reference frame.";
+    }
+
+    if (out != nullptr) {
+        try
+        {
+            out->resize(samples * sample_size);
+        }
+        catch(const std::bad_alloc &e)
+        {
+            throw "Not enough memory to decode the image.";
+        }
+        dst = out->data();
+        stride = row_size;
+    } else if (stride < row_size || stride % sample_size != 0) {
+        throw "Row stride is smaller than a row or not a multiple of the pixel size.";
+    } else if (*height > 0 && row_size > 0
+        && (capacity < row_size || (capacity - row_size) / stride < *height - 1)) {
+        throw "Output buffer is too small for the image.";
+    }
+
+    decode_pixels(data + header_size, size - header_size, header_size, dst, stride,
+        *width, *height, opts, buf);
+
+    // Add the reference frame to the residuals of a delta frame.
+    if (opts.delta) {
+        delta_inverse(dst, reference->data(), samples, opts.depth,
+            *width * opts.channels, stride / sample_size);
+    }
+
+    STATS_INC(images);
+    STATS_ADD(bytes_in, size);
+    STATS_ADD(bytes_out, samples * sample_size);
+
+    // The rest of the image is decoded, the corrupt chunks are zeroed.
+    if (!buf->bad_blocks.empty()) {
+        throw "Encoded image has corrupt chunks.";
+    }
 }
 
-Codec::~Codec()
+/**
+ * Decode the encoded pixels, which follow the header, into the rows
+ * of `dst`. The residuals of a delta frame are left as they are.
+ * @param data pointer to the data following the header.
+ * @param size size of `data` in bytes.
+ * @param header_size size of the header, which precedes `data`.
+ * @param dst pointer to the first row of the decoded image.
+ * @param stride bytes between the starts of two rows in `dst`.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts the options read from the header.
+ * @param buf intermediate buffers to be reused.
+ */
+void Codec::decode_pixels(
+    const uint8_t *data, size_t size, size_t header_size, uint8_t *dst, size_t stride,
+    uint32_t width, uint32_t height, struct enc_options opts,
+    struct codec_buffers *buf)
 {
+    if (opts.channels > 1) {
+        decode_planes(data, size, header_size, dst, stride, width, height, opts, buf);
+        return;
+    }
+    if (opts.chunk_rows > 0) {
+        decode_chunked(data, size, header_size, dst, stride, width, height, opts, buf);
+        return;
+    }
+    if (opts.chained) {
+        // The description of the chain starts the data.
+        Pipeline chain;
+        const size_t used = chain.read(data, size);
+        const struct stage_image img = {width, height, opts.depth};
+        chain.decode(data + used, size - used, &img, dst, stride, buf);
+        return;
+    }
+
+    const size_t pixels = (size_t) width * height;
+    std::vector<uint8_t> *decoded = &(buf->symbols);
+    decoded->clear();
+    decoded->reserve(rle_bound(pixels, opts.depth));
+
+    // Huffman decoding
+    huffman_dec(data, size, decoded, opts.huffman_model, &(buf->huffman));
+
+    // Run-length decoding, straight into the destination rows. The scans
+    // and inverses count in pixels, not bytes.
+    const size_t stride_pixels = stride / (opts.depth / 8);
+    struct scan_layout layout = {opts.tile, opts.tile_directions, 0};
+    layout.stride = stride_pixels;
+    irle(decoded, dst, width, height, opts.direction, opts.depth, &layout);
+
+    // Invert the subtraction model if it was used during encoding.
+    if (opts.model) {
+        model_sub_inverse(dst, pixels, opts.depth, width, stride_pixels);
+    }
 }
 
 /**
- * Load RAW image from `img_path` with `width`.
+ * Decode the chunk table and chunks of a chunked image (see
+ * Codec::encode_chunked()) into `dst`. The chunks are independent, so they
+ * are decoded concurrently, on up to one thread per core. The chunks of
+ * an image with checksums are verified first: the rows of a chunk, which
+ * fails its checksum or fails to decode, are zeroed instead and its offset
+ * is added to `buf->bad_blocks`, the other chunks are decoded as usual.
+ * @param data pointer to the chunk table, which directly follows the header.
+ * @param size size of `data` in bytes.
+ * @param header_size size of the header, which precedes `data`.
+ * @param dst pointer to the first row of the decoded image.
+ * @param stride bytes between the starts of two rows in `dst`.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts the options read from the header.
+ * @param buf intermediate buffers to be reused.
  */
-void Codec::open_image(std::string img_path, uint32_t width)
+void Codec::decode_chunked(
+    const uint8_t *data, size_t size, size_t header_size, uint8_t *dst, size_t stride,
+    uint32_t width, uint32_t height, struct enc_options opts,
+    struct codec_buffers *buf)
 {
-    this->img_data = Image(img_path, width);
-    this->img = &(this->img_data);
+    const uint64_t rows = opts.chunk_rows;
+    const uint64_t chunks = (height + rows - 1) / rows;
+    const size_t stride_pixels = stride / (opts.depth / 8);
+    const size_t row_size = (size_t) width * (opts.depth / 8);
+    const uint64_t chunk_tiles = tile_count(width, opts.chunk_rows, opts.tile, 0);
+
+    std::vector<struct chunk_entry> entries;
+    read_chunk_table(data, size, header_size, chunks, opts.checksum, &entries);
+
+    std::atomic<uint64_t> next(0);
+    std::mutex mutex;
+    auto work = [&](struct codec_buffers *b) {
+        for (uint64_t c = next++; c < chunks; c = next++) {
+            const struct chunk_entry &entry = entries[c];
+            const uint64_t first = c * rows;
+            const uint32_t chunk_height = (uint32_t) (height - first < rows ? height - first : rows);
+            uint8_t *chunk_px = dst + first * stride;
+
+            if (opts.checksum && crc32c(data + entry.offset, entry.size) != entry.checksum) {
+                for (uint32_t y = 0; y < chunk_height; y++) {
+                    memset(chunk_px + y * stride, 0, row_size);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                buf->bad_blocks.push_back(header_size + entry.offset);
+                continue;
+            }
+
+            try
+            {
+                std::vector<uint8_t> *decoded = &(b->symbols);
+                decoded->clear();
+                decoded->reserve(rle_bound((size_t) width * chunk_height, opts.depth));
+                huffman_dec(data + entry.offset, entry.size, decoded,
+                    opts.huffman_model, &(b->huffman));
+
+                // All chunks but the last have the same number of tiles.
+                struct scan_layout layout = {opts.tile, opts.tile_directions, c * chunk_tiles};
+                layout.stride = stride_pixels;
+                irle(decoded, chunk_px, width, chunk_height, opts.direction, opts.depth, &layout);
+                if (opts.model) {
+                    model_sub_inverse(chunk_px, (size_t) width * chunk_height, opts.depth,
+                        width, stride_pixels);
+                }
+            }
+            catch(const char *e)
+            {
+                // A chunk, which fails to decode, is corrupt like one,
+                // which fails its checksum.
+                for (uint32_t y = 0; y < chunk_height; y++) {
+                    memset(chunk_px + y * stride, 0, row_size);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                buf->bad_blocks.push_back(header_size + entry.offset);
+            }
+        }
+    };
+
+    const uint64_t workers = std::min<uint64_t>(chunks, std::max(1u, std::thread::hardware_concurrency()));
+    buf->chunk_buffers.resize(workers > 1 ? workers - 1 : 0);
+    std::vector<std::thread> threads;
+    for (uint64_t t = 1; t < workers; t++) {
+        threads.emplace_back(work, &(buf->chunk_buffers[t - 1]));
+    }
+    work(buf);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::sort(buf->bad_blocks.begin(), buf->bad_blocks.end());
 }
 
 /**
- * Load encoded image from file `img_path`.
- * @param img_path the path to encoded image file.
+ * Encode a multi-channel image of `opts.channels` interleaved channels.
+ * The pixels are split into planes (one per channel, optionally after
+ * the YCoCg-R transform of the first three) and every plane is encoded
+ * as a whole single-channel image on its own thread, with its own model
+ * and Huffman trees. The header is followed by the table of the encoded
+ * plane sizes and the planes. See Codec::encode() for the parameters.
  */
-void Codec::open_image(std::string img_path)
+void Codec::encode_planes(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
 {
-    std::vector<uint8_t> original, decoded;
-    uint32_t width, height;
-    std::fstream fs;
+    typedef void (*splitter)(const uint8_t *, size_t, uint8_t *);
+    static const splitter splitters[2][MAX_CHANNELS - 1][2] = { // [16-bit][channels - 2][transform]
+        {
+            {split_planes<uint8_t, 2, false>, split_planes<uint8_t, 2, false>},
+            {split_planes<uint8_t, 3, false>, split_planes<uint8_t, 3, true>},
+            {split_planes<uint8_t, 4, false>, split_planes<uint8_t, 4, true>},
+        },
+        {
+            {split_planes<uint16_t, 2, false>, split_planes<uint16_t, 2, false>},
+            {split_planes<uint16_t, 3, false>, split_planes<uint16_t, 3, true>},
+            {split_planes<uint16_t, 4, false>, split_planes<uint16_t, 4, true>},
+        },
+    };
 
-    fs.open(img_path, std::ios_base::in | std::ios_base::binary);
+    const uint8_t channels = opts.channels;
+    const size_t pixels = (size_t) width * height;
+    const size_t plane_size = pixels * (opts.depth / 8);
+    {
+        STATS_TIMER(STAGE_PLANES);
+        buf->planes.resize(plane_size * channels);
+        splitters[opts.depth == 16][channels - 2][opts.color_transform](
+            data, pixels, buf->planes.data());
+    }
 
-    // First 8 bytes are the image dimensions.
-    read_dimensions(&fs, &width, &height);
+    struct enc_options plane_opts = opts;
+    plane_opts.channels = 1;
+    plane_opts.color_transform = false;
+    plane_opts.delta = false;
+    buf->plane_data.resize(channels);
+    buf->plane_buffers.resize(channels);
 
-    // Next byte is the encoding options.
-    struct enc_options opts;
-    read_options(&fs, &opts);
+    auto work = [&](uint8_t p) {
+        encode(buf->planes.data() + p * plane_size, width, height, plane_opts,
+            &(buf->plane_data[p]), &(buf->plane_buffers[p]));
+    };
+    std::vector<std::thread> threads;
+    for (uint8_t p = 1; p < channels; p++) {
+        threads.emplace_back(work, p);
+    }
+    work(0);
+    for (auto &t : threads) {
+        t.join();
+    }
 
-    // Load data from file to memory.
-    load_encoded_data(&fs, &original);
+    out->clear();
+    write_header(width, height, opts, out);
+    for (uint8_t p = 0; p < channels; p++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out->push_back((uint64_t) buf->plane_data[p].size() >> shift);
+        }
+    }
+    for (uint8_t p = 0; p < channels; p++) {
+        out->insert(out->end(), buf->plane_data[p].begin(), buf->plane_data[p].end());
+    }
+}
 
-    // Huffman decoding
-    huffman_dec(&original);
+/**
+ * Decode the plane table and planes of a multi-channel image (see
+ * Codec::encode_planes()) into `out`. The planes are decoded concurrently
+ * and then interleaved into pixels. The corrupt chunks of the planes are
+ * added to `buf->bad_blocks`.
+ * @param data pointer to the plane table, which directly follows the header.
+ * @param size size of `data` in bytes.
+ * @param header_size size of the header, which precedes `data`.
+ * @param dst pointer to the first row of the decoded (interleaved) pixels.
+ * @param stride bytes between the starts of two rows in `dst`.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts the options read from the header.
+ * @param buf intermediate buffers to be reused.
+ */
+void Codec::decode_planes(
+    const uint8_t *data, size_t size, size_t header_size, uint8_t *dst, size_t stride,
+    uint32_t width, uint32_t height, struct enc_options opts,
+    struct codec_buffers *buf)
+{
+    const uint8_t channels = opts.channels;
+    size_t offsets[MAX_CHANNELS], sizes[MAX_CHANNELS];
+    read_plane_table(data, size, channels, offsets, sizes);
 
-    // Run-length decoding
-    irle(&original, &decoded, width, height, opts.direction);
+    const size_t pixels = (size_t) width * height;
+    buf->plane_data.resize(channels);
+    buf->plane_buffers.resize(channels);
 
-    // Invert the subtraction model if it was used during encoding.
-    if (opts.model) {
-        model_sub_inverse(&decoded);
+    // Errors of the planes are passed on once all threads are done.
+    const char *errors[MAX_CHANNELS] = {};
+    auto work = [&](uint8_t p) {
+        try
+        {
+            uint32_t plane_width, plane_height;
+            uint8_t plane_depth;
+            try
+            {
+                decode(data + offsets[p], sizes[p], &(buf->plane_data[p]),
+                    &plane_width, &plane_height, &(buf->plane_buffers[p]), &plane_depth);
+            }
+            catch(const char *e)
+            {
+                // The rest of a plane with corrupt chunks is decoded.
+                if (buf->plane_buffers[p].bad_blocks.empty()) {
+                    throw;
+                }
+            }
+            if (plane_width != width || plane_height != height || plane_depth != opts.depth
+                || buf->plane_data[p].size() != pixels * (opts.depth / 8)) {
+                errors[p] = "Encoded image has a plane of a different size.";
+            }
+        }
+        catch(const char *e)
+        {
+            errors[p] = e;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint8_t p = 1; p < channels; p++) {
+        threads.emplace_back(work, p);
+    }
+    work(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (uint8_t p = 0; p < channels; p++) {
+        if (errors[p] != nullptr) {
+            throw errors[p];
+        }
+        for (uint64_t offset : buf->plane_buffers[p].bad_blocks) {
+            buf->bad_blocks.push_back(header_size + offsets[p] + offset);
+        }
     }
 
-    fs.close();
+    STATS_TIMER(STAGE_PLANES);
+    const plane_merger merge = find_merger(opts.depth, channels, opts.color_transform);
+    const size_t plane_row = (size_t) width * (opts.depth / 8);
+    uint8_t *planes[MAX_CHANNELS];
+    for (uint8_t p = 0; p < channels; p++) {
+        planes[p] = buf->plane_data[p].data();
+    }
+    if (stride == plane_row * channels) {
+        merge(planes, pixels, dst);
+        return;
+    }
 
-    // Save image data.
-    this->img_data = Image(&decoded, width, height);
-    this->img = &(this->img_data);
+    // Rows with gaps between them are merged one by one.
+    for (uint32_t y = 0; y < height; y++) {
+        merge(planes, width, dst + y * stride);
+        for (uint8_t p = 0; p < channels; p++) {
+            planes[p] += plane_row;
+        }
+    }
 }
 
 /**
- * Save pixel data to file `out_path` as raw pixel data.
- * @param out_path specifies the file, to which to save the image.
+ * Transpose or rotate an encoded image (see ROTATE_*) without decoding it
+ * where the encoding allows: a horizontally scanned image is a vertically
+ * scanned image of its transpose, so an image scanned horizontally or
+ * vertically without the model, tiles or chunks is transposed by swapping
+ * its width and height and its scan order in the header. Every other case
+ * is decoded once and re-encoded through a rotated view of the decoded
+ * pixels, without a second, rotated copy of the image. The re-encoded image
+ * keeps the model, chunking, Huffman model and delta frame options, and is
+ * scanned horizontally or vertically (whichever matches the original scan
+ * in the rotated image), without tiles. Multi-channel images are rotated
+ * plane by plane.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param turn the rotation, one of ROTATE_*.
+ * @param out pointer to caller's vector, which will be overwritten with the
+ * rotated encoded image. Its capacity is reused.
+ * @param buf optional intermediate buffers to be reused. If nullptr,
+ * temporary buffers are allocated for this call only.
+ * @returns True if the image was rotated without being decoded.
  */
-void Codec::save_raw(std::string out_path)
+bool Codec::rotate(
+    const uint8_t *data, size_t size, uint8_t turn, std::vector<uint8_t> *out,
+    struct codec_buffers *buf)
 {
-    std::fstream fs;
-    fs.open(out_path, std::ios_base::out | std::ios_base::binary);
+    struct codec_buffers local;
+    if (buf == nullptr) {
+        buf = &local;
+    }
+
+    buf->bad_blocks.clear();
 
-    for (uint64_t i = 0; i < this->img->size(); i++) {
-        uint8_t pixel = (*this->img)[i];
-        fs.write((char *) &pixel, sizeof(uint8_t));
+    uint32_t width, height;
+    struct enc_options opts;
+    const size_t header_size = read_header(data, size, &width, &height, &opts);
+    if (opts.channels > 1) {
+        return rotate_planes(data, size, header_size, turn, width, height, opts, out, buf);
     }
 
-    fs.close();
+    const bool swap = turn != ROTATE_180;
+    const uint32_t out_width = swap ? height : width;
+    const uint32_t out_height = swap ? width : height;
+
+    if (turn == ROTATE_TRANSPOSE && !opts.model && opts.tile == 0 && !opts.chained
+        && opts.chunk_rows == 0 && opts.direction <= DIRECTION_VERTICAL) {
+        out->assign(data, data + size);
+        std::swap_ranges(out->begin(), out->begin() + 4, out->begin() + 4);
+        (*out)[8] ^= 1 << 1; // Horizontal <-> vertical.
+        return true;
+    }
+
+    const size_t pixels = (size_t) width * height;
+    buf->pixels.resize(pixels * (opts.depth / 8));
+    decode_pixels(data + header_size, size - header_size, header_size, buf->pixels.data(),
+        (size_t) width * (opts.depth / 8), width, height, opts, buf);
+    if (!buf->bad_blocks.empty()) {
+        throw "Encoded image has corrupt chunks.";
+    }
+
+    // The view shows the decoded pixels as the rotated image, see pixel_view.
+    const ptrdiff_t w = width, h = height;
+    struct pixel_view view;
+    switch (turn)
+    {
+    case ROTATE_TRANSPOSE:
+        view = {0, w, 1};
+        break;
+    case ROTATE_90:
+        view = {(h - 1) * w, -w, 1};
+        break;
+    case ROTATE_180:
+        view = {h * w - 1, -1, -w};
+        break;
+    case ROTATE_270:
+        view = {w - 1, w, -1};
+        break;
+    default:
+        throw "Unknown rotation.";
+    }
+
+    if (opts.direction > DIRECTION_VERTICAL || opts.tile > 0) {
+        opts.direction = DIRECTION_HORIZONTAL;
+    } else if (swap) {
+        opts.direction ^= 1;
+    }
+    opts.tile = 0;
+    opts.tile_directions = nullptr;
+    if (opts.chunk_rows == 0 && pixels > CHUNK_THRESHOLD) {
+        opts.chunk_rows = CHUNK_PIXELS / out_width > 0 ? CHUNK_PIXELS / out_width : 1;
+    }
+
+    encode_view(buf->pixels.data(), &view, out_width, out_height, opts, out, buf);
+    return false;
 }
 
-void Codec::encode(std::string out_path, struct enc_options opts)
+/**
+ * Rotate every plane of a multi-channel image on its own thread (see
+ * Codec::rotate()). The header is copied with the width and height swapped
+ * if needed, the plane table is rewritten.
+ * @param header_size size of the header of the image.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts the options read from the header.
+ * See Codec::rotate() for the other parameters.
+ * @returns True if all planes were rotated without being decoded.
+ */
+bool Codec::rotate_planes(
+    const uint8_t *data, size_t size, size_t header_size, uint8_t turn,
+    uint32_t width, uint32_t height, struct enc_options opts,
+    std::vector<uint8_t> *out, struct codec_buffers *buf)
 {
-    // If adaptive, then choose best direction. Otherwise use horizontal
-    if (opts.adaptive) {
-        opts.direction = (bool) best_encoding_direction();
+    const uint8_t channels = opts.channels;
+    size_t offsets[MAX_CHANNELS], sizes[MAX_CHANNELS];
+    read_plane_table(data + header_size, size - header_size, channels, offsets, sizes);
+
+    buf->plane_data.resize(channels);
+    buf->plane_buffers.resize(channels);
+
+    // Errors of the planes are passed on once all threads are done.
+    const char *errors[MAX_CHANNELS] = {};
+    bool in_place[MAX_CHANNELS] = {};
+    auto work = [&](uint8_t p) {
+        try
+        {
+            in_place[p] = rotate(data + header_size + offsets[p], sizes[p], turn,
+                &(buf->plane_data[p]), &(buf->plane_buffers[p]));
+        }
+        catch(const char *e)
+        {
+            errors[p] = e;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint8_t p = 1; p < channels; p++) {
+        threads.emplace_back(work, p);
+    }
+    work(0);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    bool all_in_place = true;
+    for (uint8_t p = 0; p < channels; p++) {
+        if (errors[p] != nullptr) {
+            throw errors[p];
+        }
+        all_in_place = all_in_place && in_place[p];
+    }
+
+    out->clear();
+    if (turn == ROTATE_180) {
+        write_header(width, height, opts, out);
     } else {
-        opts.direction = (bool) DIRECTION_HORIZONTAL;
+        write_header(height, width, opts, out);
     }
+    for (uint8_t p = 0; p < channels; p++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out->push_back((uint64_t) buf->plane_data[p].size() >> shift);
+        }
+    }
+    for (uint8_t p = 0; p < channels; p++) {
+        out->insert(out->end(), buf->plane_data[p].begin(), buf->plane_data[p].end());
+    }
+    return all_in_place;
+}
 
-    std::vector<uint8_t> encoded;
+/**
+ * Encode the image shown by `view` of the pixels `data` (e.g. a rotation
+ * of them) with the options `opts` (`opts.direction` must be horizontal
+ * or vertical, tiles are not supported). Chunked images are encoded chunk
+ * by chunk as in Codec::encode_chunked().
+ * @param data pointer to the raw pixels, which the view shows.
+ * @param view the view of the pixels, which is encoded.
+ * @param width the width of the view.
+ * @param height the height of the view.
+ * See Codec::encode() for the other parameters.
+ */
+void Codec::encode_view(
+    const uint8_t *data, const struct pixel_view *view,
+    uint32_t width, uint32_t height, struct enc_options opts,
+    std::vector<uint8_t> *out, struct codec_buffers *buf)
+{
+    // An image, which is not chunked, is encoded as a single chunk.
+    const uint64_t rows = opts.chunk_rows > 0 ? opts.chunk_rows : height;
+    const uint64_t chunks = opts.chunk_rows > 0 ? (height + rows - 1) / rows : 1;
 
-    // Apply subtraction model if requested.
-    if (opts.model) {
-        model_sub();
+    out->clear();
+    write_header(width, height, opts, out);
+    const size_t table = out->size();
+    if (opts.chunk_rows > 0) {
+        out->resize(table + chunk_table_size(chunks, opts.checksum));
     }
 
-    // Run-length encoding
-    rle(&encoded, opts.direction);
+    std::vector<uint8_t> *encoded = &(buf->symbols);
+    for (uint64_t c = 0; c < chunks; c++) {
+        const uint64_t first = c * rows;
+        const uint32_t chunk_height = (uint32_t) (height - first < rows ? height - first : rows);
 
-    // Huffman encoding
-    huffman_enc(&encoded);
+        encoded->clear();
+        encoded->reserve(rle_bound((size_t) width * chunk_height, opts.depth));
+        rle_view(data, view, width, (uint32_t) first, chunk_height, opts.model,
+            opts.direction, encoded, opts.depth);
 
-    std::fstream fs;
-    fs.open(out_path, std::ios_base::out | std::ios_base::binary);
+        const size_t start = out->size();
+        huffman_enc(encoded, out, opts.huffman_model, &(buf->huffman));
+        if (opts.chunk_rows > 0) {
+            write_chunk_entry(out, table, c, start, opts.checksum);
+        }
+    }
+    if (opts.chunk_rows > 0) {
+        seal_chunk_table(out, table, chunks, opts.checksum);
+    }
+
+    STATS_INC(images);
+    STATS_ADD(bytes_in, (size_t) width * height * (opts.depth / 8));
+    STATS_ADD(bytes_out, out->size());
+}
+
+/**
+ * Verifies the checksums of an encoded image with checksums (see
+ * enc_options::checksum) without decoding it. The checksum of the header
+ * and the chunk table is verified first, then the CRC32C of every chunk.
+ * The planes of multi-channel images are verified one by one.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param bad pointer to vector, which is filled with the offsets of
+ * the chunks, which failed their checksum, from the start of the image.
+ * @returns The number of verified chunks.
+ * @throws const char * if the image has no checksums or its header (or
+ * chunk table) is corrupt.
+ */
+uint64_t Codec::verify(const uint8_t *data, size_t size, std::vector<uint64_t> *bad)
+{
+    uint32_t width, height;
+    struct enc_options opts;
+    // The checksums cover the coded bytes, the model is not needed.
+    const size_t header_size = read_header(data, size, &width, &height, &opts, false);
+    bad->clear();
+
+    if (opts.channels > 1) {
+        size_t offsets[MAX_CHANNELS], sizes[MAX_CHANNELS];
+        read_plane_table(data + header_size, size - header_size, opts.channels, offsets, sizes);
+
+        uint64_t chunks = 0;
+        std::vector<uint64_t> plane_bad;
+        for (uint8_t p = 0; p < opts.channels; p++) {
+            chunks += verify(data + header_size + offsets[p], sizes[p], &plane_bad);
+            for (uint64_t offset : plane_bad) {
+                bad->push_back(header_size + offsets[p] + offset);
+            }
+        }
+        return chunks;
+    }
+
+    if (!opts.checksum) {
+        throw "Encoded image has no checksums.";
+    }
+
+    const uint64_t chunks = ((uint64_t) height + opts.chunk_rows - 1) / opts.chunk_rows;
+    std::vector<struct chunk_entry> entries;
+    read_chunk_table(data + header_size, size - header_size, header_size, chunks, true, &entries);
+    for (auto &entry : entries) {
+        if (crc32c(data + header_size + entry.offset, entry.size) != entry.checksum) {
+            bad->push_back(header_size + entry.offset);
+        }
+    }
+    return chunks;
+}
+
+/**
+ * Predicts the encoded size and encoding time of the image for every
+ * combination of the subtraction model and scanning direction, without
+ * encoding it. Bands of ESTIMATE_BAND rows (horizontal scanning) or columns
+ * (vertical scanning) are sampled every `every` rows/columns and run
+ * through the model and RLE. The size of the Huffman code is predicted from
+ * the zeroth-order entropy of the sampled RLE symbols, the time from the time
+ * spent on the sample and the calibrated speed of the Huffman coder. This
+ * costs only a small fraction of encoding the image even once.
+ * @param data pointer to raw pixel data, row by row.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts encoding options. Only `opts.huffman_model` is taken into
+ * account (for the header size), the rest is set in the estimates.
+ * @param out pointer to vector, which is filled with the estimates.
+ * @param every distance of the sampled bands in rows/columns (at least
+ * ESTIMATE_BAND), the smaller the more accurate and the slower the estimate.
+ */
+void Codec::estimate(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<struct size_estimate> *out,
+    uint32_t every)
+{
+    out->clear();
+    std::vector<uint8_t> sample, symbols;
+
+    for (int direction = 0; direction <= 1; direction++) {
+        // Bands run across the scanning direction, so that the runs
+        // inside them are the runs of the full image.
+        const uint32_t lines = direction == DIRECTION_HORIZONTAL ? height : width;
+        const uint32_t line_size = direction == DIRECTION_HORIZONTAL ? width : height;
+        const uint32_t band = lines < ESTIMATE_BAND ? lines : ESTIMATE_BAND;
+        const uint32_t bands = lines < every ? 1 : lines / every;
+        const uint32_t stride = lines < every ? lines : every;
+
+        for (int model = 0; model <= 1; model++) {
+            const auto start = std::chrono::steady_clock::now();
+
+            // Copy the bands (with the model applied) into a sample image.
+            sample.resize((size_t) bands * band * line_size * (opts.depth / 8));
+            symbols.clear();
+            symbols.reserve(rle_bound((size_t) bands * band * line_size, opts.depth));
+            size_t pos = 0;
+            for (uint32_t b = 0; b < bands; b++) {
+                const uint32_t first = b * stride + (stride - band) / 2;
+                const bool rows = direction == DIRECTION_HORIZONTAL;
+                const uint32_t x_from = rows ? 0 : first, x_to = rows ? width : first + band;
+                const uint32_t y_from = rows ? first : 0, y_to = rows ? first + band : height;
+                uint8_t *dst = sample.data() + pos * (opts.depth / 8);
+                if (opts.depth == 16) {
+                    pos += copy_residuals<uint16_t>(data, width, model, x_from, x_to, y_from, y_to, dst);
+                } else {
+                    pos += copy_residuals<uint8_t>(data, width, model, x_from, x_to, y_from, y_to, dst);
+                }
+                // A band of columns is copied as an image of its own,
+                // `band` pixels wide, so its columns are scanned one by one.
+                if (!rows) {
+                    rle(dst, band, height, false, direction, &symbols, opts.depth);
+                }
+            }
+            if (direction == DIRECTION_HORIZONTAL) {
+                rle(sample.data(), width, bands * band, false, direction, &symbols, opts.depth);
+            }
+
+            uint64_t hist[256] = {};
+            for (auto symbol : symbols) {
+                hist[symbol]++;
+            }
+            double entropy = 0.0;
+            uint32_t distinct = 0;
+            for (auto count : hist) {
+                if (count > 0) {
+                    const double p = (double) count / symbols.size();
+                    entropy -= p * std::log2(p);
+                    distinct++;
+                }
+            }
+
+            // Huffman codes are at least 1 bit long. Every new symbol
+            // is sent as the NYT code followed by the 9 bits of the symbol.
+            const double scale = lines > 0 ? (double) lines / (bands * band) : 1.0;
+            const double total_symbols = symbols.size() * scale;
+            const double escape_bits = 9.0 + std::log2(distinct + 1.0);
+            const double bits = total_symbols * (entropy < 1.0 ? 1.0 : entropy)
+                + (distinct + 1) * escape_bits; // + EOF
+
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+            struct size_estimate e;
+            e.opts = opts;
+            e.opts.model = model;
+            e.opts.direction = direction;
+            e.opts.adaptive = false;
+            e.opts.search = false;
+            e.opts.effort = -1;
+            e.bytes = HEADER_SIZE + (opts.huffman_model != nullptr ? MODEL_ID_SIZE : 0)
+                + (uint64_t) std::ceil(bits / 8);
+            e.seconds = elapsed.count() * scale
+                + total_symbols * huffman_ns_per_symbol(distinct) * 1e-9;
+            out->push_back(e);
+        }
+    }
+}
+
+/**
+ * Returns the time the adaptive Huffman encoder needs per symbol on this
+ * machine, if `distinct` different symbols are being encoded. The time grows
+ * linearly with the size of the tree (searching for the highest numbered
+ * node of a block), so it is measured once per process for two alphabet
+ * sizes and interpolated.
+ */
+double Codec::huffman_ns_per_symbol(uint32_t distinct)
+{
+    static std::once_flag measured;
+    static double base_ns, per_leaf_ns;
+
+    std::call_once(measured, []() {
+        const uint32_t alphabets[2] = {4, 128};
+        double ns[2];
+        std::vector<uint8_t> code;
+        code.reserve(1 << 13);
+        Huffman huf;
+        uint32_t x = 2463534242u; // xorshift32 state
+
+        for (int a = 0; a < 2; a++) {
+            code.clear();
+            BitWriter bits(&code);
+            huf.reset_tree();
+
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < (1 << 12); i++) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                huf.insert((uint8_t) (x % alphabets[a]), &bits);
+            }
+            const std::chrono::duration<double, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+            ns[a] = elapsed.count() / (1 << 12);
+        }
+
+        per_leaf_ns = (ns[1] - ns[0]) / (alphabets[1] - alphabets[0]);
+        if (per_leaf_ns < 0.0) {
+            per_leaf_ns = 0.0;
+        }
+        base_ns = ns[0] - alphabets[0] * per_leaf_ns;
+        if (base_ns < 0.0) {
+            base_ns = 0.0;
+        }
+    });
+
+    return base_ns + distinct * per_leaf_ns;
+}
+
+/**
+ * Computes the histogram and the range of the pixel values of an encoded
+ * image, without decoding the pixels. The Huffman coded RLE tokens are
+ * walked and every run is added to the histogram at once. With the
+ * subtraction model, the pixel values are tracked by a running sum
+ * of the residuals instead. The model with any other than horizontal
+ * scanning is the only case, where the image has to be fully decoded
+ * (its residuals are not in row by row order), besides multi-channel
+ * images, whose histogram is of the samples of all their channels together
+ * (so it adds up to `stats->samples`, not `stats->pixels`).
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param stats pointer, via which the statistics are returned.
+ * @param buf optional intermediate buffers to be reused. If nullptr,
+ * temporary buffers are allocated for this call only.
+ */
+void Codec::pixel_statistics(
+    const uint8_t *data, size_t size, struct pixel_stats *stats,
+    struct codec_buffers *buf)
+{
+    struct codec_buffers local;
+    if (buf == nullptr) {
+        buf = &local;
+    }
+
+    uint32_t width, height;
+    struct enc_options opts;
+    const size_t header_size = read_header(data, size, &width, &height, &opts);
+    if (opts.delta) {
+        throw "Encoded image is a delta frame, its reference frame is needed.";
+    }
+    stats->pixels = (uint64_t) width * height;
+    stats->samples = stats->pixels * opts.channels;
+    stats->histogram.assign((size_t) 1 << opts.depth, 0);
+
+    if (opts.channels > 1 || opts.chained
+        || (opts.model && (opts.direction != DIRECTION_HORIZONTAL || opts.tile > 0))) {
+        decode(data, size, &(buf->pixels), &width, &height, buf);
+        for (size_t i = 0; i < buf->pixels.size() / (opts.depth / 8); i++) {
+            if (opts.depth == 16) {
+                stats->histogram[load_pixel<uint16_t>(buf->pixels.data(), i)]++;
+            } else {
+                stats->histogram[load_pixel<uint8_t>(buf->pixels.data(), i)]++;
+            }
+        }
+    } else {
+        // Chunked images are walked chunk by chunk, others as a single chunk.
+        const uint64_t rows = opts.chunk_rows > 0 ? opts.chunk_rows : height;
+        const uint64_t chunks = rows > 0 ? (height + rows - 1) / rows : 0;
+        const uint8_t *chunk = data + header_size;
+        std::vector<struct chunk_entry> entries(chunks, {0, size - header_size, 0});
+        if (opts.chunk_rows > 0) {
+            read_chunk_table(chunk, size - header_size, header_size, chunks,
+                opts.checksum, &entries);
+        }
+
+        for (uint64_t c = 0; c < chunks; c++) {
+            const uint64_t chunk_height = height - c * rows < rows ? height - c * rows : rows;
+            if (opts.checksum && crc32c(chunk + entries[c].offset, entries[c].size) != entries[c].checksum) {
+                throw "Encoded image has corrupt chunks.";
+            }
+
+            buf->symbols.clear();
+            huffman_dec(chunk + entries[c].offset, entries[c].size, &(buf->symbols),
+                opts.huffman_model, &(buf->huffman));
+            if (opts.depth == 16) {
+                histogram_tokens<uint16_t>(&(buf->symbols), (size_t) width * chunk_height,
+                    opts.model, &(stats->histogram));
+            } else {
+                histogram_tokens<uint8_t>(&(buf->symbols), (size_t) width * chunk_height,
+                    opts.model, &(stats->histogram));
+            }
+        }
+    }
+
+    stats->min = 0;
+    stats->max = 0;
+    bool found = false;
+    for (size_t value = 0; value < stats->histogram.size(); value++) {
+        if (stats->histogram[value] > 0) {
+            if (!found) {
+                stats->min = value;
+                found = true;
+            }
+            stats->max = value;
+        }
+    }
+}
+
+/**
+ * Adds the pixels encoded by RLE symbols `symbols` to the histogram `hist`.
+ * The symbols are walked the same way as by irle_kernel(), but the runs are
+ * not expanded into pixels.
+ * @param symbols the RLE symbols of the image (or of one chunk).
+ * @param pixels the number of pixels the symbols encode.
+ * @param model true if the symbols are residuals of the subtraction model
+ * in row by row order.
+ * @param hist pointer to the histogram, which is added to.
+ */
+template <typename Pixel>
+void Codec::histogram_tokens(
+    const std::vector<uint8_t> *symbols, size_t pixels, bool model,
+    std::vector<uint64_t> *hist)
+{
+    const uint8_t *data = symbols->data();
+    const size_t size = symbols->size();
+    uint64_t *bins = hist->data();
+    size_t i = 0, written = 0;
+    Pixel sum = 0; // The last pixel value, if the model was used.
+
+    // Adds a run of `count` same values (or residuals) to the histogram.
+    auto add = [&](Pixel value, size_t count) {
+        if (!model) {
+            bins[value] += count;
+        } else if (value == 0) {
+            bins[sum] += count;
+        } else {
+            for (size_t k = 0; k < count; k++) {
+                sum += value;
+                bins[sum]++;
+            }
+        }
+        written += count;
+    };
+
+    Pixel value, previous = 0;
+    uint32_t run = 0; // How many times `previous` was read in a row.
+    while (written < pixels && read_pixel<Pixel>(data, size, &i, &value)) {
+        add(value, 1);
 
-    // First 8 bytes are the image width.
-    write_dimensions(&fs);
+        if (run > 0 && value == previous) {
+            run++;
+        } else {
+            run = 1;
+        }
+        previous = value;
+
+        if (run == 3) {
+            // Three same values are followed by the remaining run length.
+            if (i >= size) {
+                break;
+            }
+            const size_t count = data[i];
+            i++;
+            add(previous, count < pixels - written ? count : pixels - written);
+            // The next value always starts a new run.
+            run = 0;
+        }
+    }
+}
+
+/**
+ * Adds the RLE symbols, which would be Huffman coded when encoding
+ * the image with options `opts`, to the histogram `hist`. Used to train
+ * Huffman models from a corpus of images.
+ * @param data pointer to raw pixel data, row by row.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts encoding options.
+ * @param hist histogram of the 256 symbols, which is added to.
+ */
+void Codec::symbol_histogram(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, uint64_t hist[256])
+{
+    if (opts.scan >= 0) {
+        opts.direction = (uint8_t) opts.scan;
+    } else if (opts.adaptive) {
+        opts.direction = best_encoding_direction(data, width, height, opts.depth);
+    } else {
+        opts.direction = DIRECTION_HORIZONTAL;
+    }
 
-    // Next byte is the encoding options.
-    write_options(&fs, opts);
+    std::vector<uint8_t> encoded;
+    encoded.reserve(rle_bound((size_t) width * height, opts.depth));
+    rle(data, width, height, opts.model, opts.direction, &encoded, opts.depth);
 
-    for (uint64_t i = 0; i < encoded.size(); i++) {
-        fs.write((char *) &(encoded[i]), sizeof(uint8_t) * 1);
+    for (auto symbol : encoded) {
+        hist[symbol]++;
     }
-
-    fs.close();
 }
 
 /**
- * Overwrites the input parameter `data` containing adaptive Huffman encoded
- * data with the decoded data. The `data` vector will therefore have
- * a different size after this method finishes.
- * @param data pointer to data encoded with adaptive Huffman encoding, which
- * will be replaced with decoded data.
+ * Decodes adaptive Huffman encoded data from `data` and appends the decoded
+ * symbols to `decoded`.
+ * @param data pointer to data encoded with adaptive Huffman encoding.
+ * @param size size of `data` in bytes.
+ * @param decoded pointer to vector, to which the decoded data is appended.
+ * @param model the model the encoder's tree was primed with (or nullptr).
+ * @param huf pointer to the Huffman tree to be (re)used for decoding.
+ * @throws const char * if the Huffman decoder fails on corrupt data.
  */
-void Codec::huffman_dec(std::vector<uint8_t> *data)
+void Codec::huffman_dec(
+    const uint8_t *data, size_t size, std::vector<uint8_t> *decoded,
+    const HuffmanModel *model, Huffman *huf)
 {
-    uint8_t mask = 128;
-    std::vector<bool> bits;
-
-    // Parse each byte into 8 bits.
-    for (auto byte : (*data)) {
-        mask = 128;
-        for (int i = 8; i > 0; i--) {
-            bits.push_back(byte & mask);
-            mask = mask >> 1;
-        }
+    if (size == 0) {
+        return;
     }
 
-    Huffman *huf = new Huffman();
-    std::vector<uint8_t> dec_tmp;
+    STATS_TIMER(STAGE_HUFFMAN_DEC);
+    const size_t start = decoded->size();
+
+    if (model != nullptr) {
+        *huf = *(model->tree());
+    } else {
+        huf->reset_tree();
+    }
 
     try
     {
-        huf->decode(&bits, &dec_tmp);
+        huf->decode(data, size, decoded);
     }
     catch(int e)
     {
-        std::cerr << "Huffman decoder error: "
-            << (e == ERR_FIRST_BIT_NOT_0 ?
-                "first bit not 0." : "non-empty decoder tree.")
-            << '\n';
-        // TODO figure out how to handle this.
+        throw huffman_error(e);
     }
-    delete huf;
 
-    // Replace original data with Huffman decoded data in the caller's vector.
-    data->swap(dec_tmp);
+    STATS_ADD(symbols, decoded->size() - start + 1); // + EOF
+    STATS_ADD(code_bits, size * 8);
 }
 
 /**
- * Overwrites the input parameter `data` containing 8-bit valued data with
- * adaptive Huffman encoded data. As Huffman codes are variable length codes,
- * the end of the encoded data is always padded to a multiple of 8 (which means
- * at most 7 bits of overall overhead) for easier handling
- * with byte sized data structures.
- * @param data pointer to data to be replaced with Huffman encoded data.
+ * Appends adaptive Huffman encoded `data` to `out`. As Huffman codes
+ * are variable length codes, the end of the encoded data is always padded
+ * to a multiple of 8 (which means at most 7 bits of overall overhead)
+ * for easier handling with byte sized data structures.
+ * @param data pointer to 8-bit valued data to be encoded.
+ * @param out pointer to vector, to which the encoded data is appended.
+ * @param model if not nullptr, the tree is primed with this model.
+ * @param huf pointer to the Huffman tree to be (re)used for encoding.
  */
-void Codec::huffman_enc(std::vector<uint8_t> *data)
+void Codec::huffman_enc(
+    const std::vector<uint8_t> *data, std::vector<uint8_t> *out,
+    const HuffmanModel *model, Huffman *huf)
 {
-    std::vector<bool> bits;
-    Huffman *huf = new Huffman();
+    STATS_TIMER(STAGE_HUFFMAN_ENC);
+    const size_t start = out->size();
+
+    BitWriter bits(out);
+    if (model != nullptr) {
+        *huf = *(model->tree());
+    } else {
+        huf->reset_tree();
+    }
 
     for (auto elem : (*data)) {
         huf->insert(elem, &bits);
     }
     huf->insert(EOF_KEY, &bits);
 
-    delete huf;
-
-    std::vector<uint8_t> enc_tmp;
-    uint8_t mask = 128, byte = 0;
-    for (auto bit : bits) {
-        if (bit) {
-            byte += mask;
-        }
-        mask = rotr8(mask, 1);
-
-        if (mask == 128) {
-            enc_tmp.push_back(byte);
-            byte = 0;
-        }
-    }
-
-    if (mask != 128) {
-        // Huffman code ended before completing a byte. Push it as well.
-        enc_tmp.push_back(byte);
-    }
-
-    // Replace original data with Huffman encoded data in the caller's vector.
-    data->swap(enc_tmp);
-}
+    // Huffman code may end before completing a byte. Push it as well.
+    bits.flush();
 
-/**
- * Efficient bitwise right-rotation of 8-bit value `x` by `n` positions.
- * Modified from: https://blog.regehr.org/archives/1063
- * @param x value to be rotated to the right.
- * @param n by how many bits to rotate.
- * @returns The right-rotated value `x` by `n` bit positions.
- */
-uint8_t Codec::rotr8(uint8_t x, uint8_t n)
-{
-    return (x>>n) | (x<<(8-n));
+    STATS_ADD(symbols, data->size() + 1); // + EOF
+    STATS_ADD(code_bits, (out->size() - start) * 8);
 }
 
 /**
- * Decode an RLE encoded image saved in `original`. The decoded image
- * is returned via the `decoded` vector.
+ * Decode RLE encoded data saved in `original` directly into `decoded`.
+ * Decoding stops after `width` * `height` pixels were written, even if
+ * the encoded data is longer.
  * @param original pointer to data to be decoded.
- * @param decoded pointer to vector, which will contain the decoded data.
+ * @param decoded pointer to at least `width` * `height` pixels, to which
+ * the decoded pixels are written.
  * @param width width of the image after decoding.
  * @param height height of the image after decoding.
- * @param direction the direction, in which the image was RLE encoded
- * (true for vertical, false for horizontal).
+ * @param direction the scan order, in which the image was RLE encoded
+ * (one of DIRECTION_*).
+ * @param depth bits per pixel, 8 or 16.
+ * @param layout the tiles of a tiled scan (overrides `direction`),
+ * nullptr if not tiled.
  */
 void Codec::irle(
-    std::vector<uint8_t> *original, std::vector<uint8_t> *decoded,
+    const std::vector<uint8_t> *original, uint8_t *decoded,
     uint32_t width, uint32_t height,
-    bool direction)
+    uint8_t direction, uint8_t depth, const struct scan_layout *layout)
 {
-    if (direction == (bool) DIRECTION_HORIZONTAL) {
-        irle_horizontal(original, decoded);
-    } else {
-        irle_vertical(original, decoded, width, height);
-    }
+    STATS_TIMER(STAGE_IRLE);
+    typedef void (*kernel)(const std::vector<uint8_t> *, uint8_t *, uint32_t, uint32_t,
+        const struct scan_layout *);
+    static const kernel kernels[2][5] = { // [16-bit][scan]
+        {irle_kernel<uint8_t, ScanHorizontal>, irle_kernel<uint8_t, ScanVertical>,
+            irle_kernel<uint8_t, ScanHilbert>, irle_kernel<uint8_t, ScanZigzag>,
+            irle_kernel<uint8_t, ScanTiled>},
+        {irle_kernel<uint16_t, ScanHorizontal>, irle_kernel<uint16_t, ScanVertical>,
+            irle_kernel<uint16_t, ScanHilbert>, irle_kernel<uint16_t, ScanZigzag>,
+            irle_kernel<uint16_t, ScanTiled>},
+    };
+
+    const int scan = layout != nullptr && layout->tile > 0 ? SCAN_ORDERS : direction;
+    kernels[depth == 16][scan](original, decoded, width, height, layout);
 }
 
-/** RLE decoding in the horizontal direction.
- * @param original pointer to data to be decoded.
- * @param decoded pointer to vector, which will contain the decoded data.
+/**
+ * Kernel of irle() specialized for one pixel type and scan order.
  */
-void Codec::irle_horizontal(std::vector<uint8_t> *original, std::vector<uint8_t> *decoded)
+template <typename Pixel, typename Scan>
+void Codec::irle_kernel(
+    const std::vector<uint8_t> *original, uint8_t *decoded,
+    uint32_t width, uint32_t height, const struct scan_layout *layout)
 {
-    uint8_t byte, previous;
+    const uint8_t *symbols = original->data();
     const size_t size = original->size();
-    size_t i = 0;
+    const size_t pixels = (size_t) width * height;
+    size_t i = 0, written = 0;
+    Scan scan(width, height, layout);
 
-    byte = (*original)[i];
-    i++;
-    decoded->push_back(byte);
+    // Writes one pixel and moves to the next position in the scan order.
+    auto put = [&](Pixel value) {
+        store_pixel<Pixel>(decoded, scan.index(), value);
+        scan.next();
+        written++;
+    };
 
-    previous = byte;
-    while (true) {
-        if (i > size) {
-            break;
-        }
+    Pixel value, previous = 0;
+    uint32_t run = 0; // How many times `previous` was read in a row.
+    while (written < pixels && read_pixel<Pixel>(symbols, size, &i, &value)) {
+        put(value);
 
-        byte = (*original)[i];
-        i++;
-        if (i > size) {
-            break;
+        if (run > 0 && value == previous) {
+            run++;
+        } else {
+            run = 1;
         }
+        previous = value;
 
-        if (byte == previous) {
-            decoded->push_back(byte);
-
-            byte = (*original)[i];
-            i++;
-            if (i > size) {
+        if (run == 3) {
+            // Three same values are followed by the remaining run length.
+            if (i >= size) {
                 break;
             }
-
-            if (byte == previous) {
-                decoded->push_back(byte);
-                byte = (*original)[i];
-                i++;
-                push_n(previous, byte, decoded);
-
-                byte = (*original)[i];
-                i++;
-                if (i > size) {
-                    break;
-                }
-
-                decoded->push_back(byte);
-                previous = byte;
-            } else {
-                decoded->push_back(byte);
-                previous = byte;
+            const uint8_t count = symbols[i];
+            i++;
+            for (uint8_t k = 0; k < count && written < pixels; k++) {
+                put(previous);
             }
-        } else {
-            decoded->push_back(byte);
-            previous = byte;
+            // The next value always starts a new run.
+            run = 0;
         }
     }
 }
 
 /**
- * RLE decoding in the vertical direction.
- * @param original pointer to data to be decoded.
- * @param decoded pointer to vector, which will contain the decoded data.
- * @param width width of the image after decoding.
- * @param height height of the image after decoding.
+ * Encode an image using run-length encoding.
+ * @param px pointer to the raw pixel data.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param model if true, the pixel subtraction model is applied on the fly,
+ * i.e. each pixel value is replaced by `px[i] - px[i-1]` (in row by row
+ * order, regardless of `direction`), without modifying `px`.
+ * @param direction the scan order (one of DIRECTION_*).
+ * @param result pointer to vector, to which to save the encoded pixels.
+ * @param depth bits per pixel, 8 or 16.
+ * @param layout the tiles of a tiled scan (overrides `direction`),
+ * nullptr if not tiled.
  */
-void Codec::irle_vertical(
-    std::vector<uint8_t> *original, std::vector<uint8_t> *decoded,
-    uint32_t width, uint32_t height)
+void Codec::rle(
+    const uint8_t *px, uint32_t width, uint32_t height,
+    bool model, uint8_t direction, std::vector<uint8_t> *result, uint8_t depth,
+    const struct scan_layout *layout)
 {
-    uint8_t byte, previous;
-    const size_t size = original->size();
-    size_t i = 0;
-
-    // Easier if I have the array preemptively resized
-    // and then accessed by index as needed.
-    decoded->resize(width*height);
+    STATS_TIMER(STAGE_RLE);
+    typedef void (*kernel)(const uint8_t *, uint32_t, uint32_t, std::vector<uint8_t> *,
+        const struct scan_layout *);
+    static const kernel kernels[2][5][2] = { // [16-bit][scan][model]
+        {
+            {rle_kernel<uint8_t, PredictNone, ScanHorizontal>, rle_kernel<uint8_t, PredictLeft, ScanHorizontal>},
+            {rle_kernel<uint8_t, PredictNone, ScanVertical>, rle_kernel<uint8_t, PredictLeft, ScanVertical>},
+            {rle_kernel<uint8_t, PredictNone, ScanHilbert>, rle_kernel<uint8_t, PredictLeft, ScanHilbert>},
+            {rle_kernel<uint8_t, PredictNone, ScanZigzag>, rle_kernel<uint8_t, PredictLeft, ScanZigzag>},
+            {rle_kernel<uint8_t, PredictNone, ScanTiled>, rle_kernel<uint8_t, PredictLeft, ScanTiled>},
+        },
+        {
+            {rle_kernel<uint16_t, PredictNone, ScanHorizontal>, rle_kernel<uint16_t, PredictLeft, ScanHorizontal>},
+            {rle_kernel<uint16_t, PredictNone, ScanVertical>, rle_kernel<uint16_t, PredictLeft, ScanVertical>},
+            {rle_kernel<uint16_t, PredictNone, ScanHilbert>, rle_kernel<uint16_t, PredictLeft, ScanHilbert>},
+            {rle_kernel<uint16_t, PredictNone, ScanZigzag>, rle_kernel<uint16_t, PredictLeft, ScanZigzag>},
+            {rle_kernel<uint16_t, PredictNone, ScanTiled>, rle_kernel<uint16_t, PredictLeft, ScanTiled>},
+        },
+    };
 
-    uint32_t y = 0, x = 0;
-    size_t j = y * width + x;
-
-    byte = (*original)[i];
-    i++;
-    (*decoded)[j] = byte;
-    j = increment_vertical_index(&x, &y, width, height);
-
-    previous = byte;
-    while (true) {
-        if (i > size) {
-            break;
-        }
-
-        byte = (*original)[i];
-        i++;
-        if (i > size) {
-            break;
-        }
-
-        if (byte == previous) {
-            (*decoded)[j] = byte;
-            j = increment_vertical_index(&x, &y, width, height);
-
-            byte = (*original)[i];
-            i++;
-            if (i > size) {
-                break;
-            }
-
-            if (byte == previous) {
-                (*decoded)[j] = byte;
-                j = increment_vertical_index(&x, &y, width, height);
-
-                byte = (*original)[i];
-                i++;
-                for (uint8_t k = 0; k < byte; k++) {
-                    (*decoded)[j] = previous;
-                    j = increment_vertical_index(&x, &y, width, height);
-                }
-
-                byte = (*original)[i];
-                i++;
-                if (i > size) {
-                    break;
-                }
+    const int scan = layout != nullptr && layout->tile > 0 ? SCAN_ORDERS : direction;
+    kernels[depth == 16][scan][model](px, width, height, result, layout);
+}
 
-                (*decoded)[j] = byte;
-                j = increment_vertical_index(&x, &y, width, height);
+/**
+ * Kernel of rle() specialized for one pixel type, predictor and scan order.
+ */
+template <typename Pixel, typename Predictor, typename Scan>
+void Codec::rle_kernel(
+    const uint8_t *px, uint32_t width, uint32_t height,
+    std::vector<uint8_t> *result, const struct scan_layout *layout)
+{
+    const size_t size = (size_t) width * height;
+    if (size == 0) {
+        return;
+    }
 
-                previous = byte;
-            } else {
-                (*decoded)[j] = byte;
-                j = increment_vertical_index(&x, &y, width, height);
+    Scan scan(width, height, layout);
+    Pixel previous = Predictor::template residual<Pixel>(px, scan.index());
+    uint32_t counter = 1;
+    scan.next();
 
-                previous = byte;
-            }
+    for (size_t n = 1; n < size; n++, scan.next()) {
+        const Pixel current = Predictor::template residual<Pixel>(px, scan.index());
+        if (previous == current && counter <= 257) { // 258 - 3 = 255
+            counter++;
         } else {
-            (*decoded)[j] = byte;
-            j = increment_vertical_index(&x, &y, width, height);
-
-            previous = byte;
+            enc<Pixel>(counter, previous, result);
+            counter = 1;
+            previous = current;
         }
     }
+    enc<Pixel>(counter, previous, result);
 }
 
 /**
- * Given a 2D array of `width` and `height`, for which coordinates `x` and `y`
- * address an element, return an *incremented* index that is usable in the
- * flattened (to 1D) representation of that 2D array, so that this new index
- * is incremented in the vertical direction.
- * Basically just increment index in the vertical direction.
- * @param x pointer to x coordinate (may get incremented).
- * @param y pointer to y coordinate (may get incremented or reset to 0).
- * @param width width of the 2D array.
- * @param height height of the 2D array.
- * @returns Index `j`, that is the index to the next element in the 2D array
- * when traversed vertically.
+ * Run-length encode rows `first_row` to `first_row + rows - 1` of the image
+ * shown by `view` of the pixels `px` (see pixel_view), as rle() would encode
+ * them if they were a standalone image (the model restarts at `first_row`).
+ * @param px pointer to the pixels, which the view shows.
+ * @param view the view of the pixels.
+ * @param width the width of the view.
+ * @param first_row the first row of the view to be encoded.
+ * @param rows the number of rows to be encoded.
+ * @param model true if the pixel subtraction model should be applied.
+ * @param direction DIRECTION_HORIZONTAL or DIRECTION_VERTICAL.
+ * @param result pointer to vector, to which to save the encoded pixels.
+ * @param depth bits per pixel, 8 or 16.
  */
-size_t Codec::increment_vertical_index(
-    uint32_t *x, uint32_t *y,
-    const uint32_t width, const uint32_t height)
+void Codec::rle_view(
+    const uint8_t *px, const struct pixel_view *view,
+    uint32_t width, uint32_t first_row, uint32_t rows,
+    bool model, uint8_t direction, std::vector<uint8_t> *result, uint8_t depth)
 {
-    (*y)++;
-    if ((*y) >= height) {
-        (*y) = 0;
-        (*x)++;
-    }
-    return (*y) * width + (*x);
+    STATS_TIMER(STAGE_RLE);
+    typedef void (*kernel)(const uint8_t *, const struct pixel_view *, uint32_t, uint32_t,
+        uint32_t, std::vector<uint8_t> *);
+    static const kernel kernels[2][2][2] = { // [16-bit][vertical][model]
+        {
+            {rle_view_kernel<uint8_t, false, false>, rle_view_kernel<uint8_t, true, false>},
+            {rle_view_kernel<uint8_t, false, true>, rle_view_kernel<uint8_t, true, true>},
+        },
+        {
+            {rle_view_kernel<uint16_t, false, false>, rle_view_kernel<uint16_t, true, false>},
+            {rle_view_kernel<uint16_t, false, true>, rle_view_kernel<uint16_t, true, true>},
+        },
+    };
+
+    kernels[depth == 16][direction == DIRECTION_VERTICAL][model](
+        px, view, width, first_row, rows, result);
 }
 
 /**
- * Encode a loaded image using run-length encoding.
- * @param result pointer to vector, to which to save the encoded pixels.
+ * Kernel of rle_view() specialized for one pixel type, model and scan order.
+ * The residual of the model is the difference to the previous pixel of
+ * the view in row by row order, as with PredictLeft.
  */
-void Codec::rle(std::vector<uint8_t> *result, bool direction)
+template <typename Pixel, bool Model, bool Vertical>
+void Codec::rle_view_kernel(
+    const uint8_t *px, const struct pixel_view *view,
+    uint32_t width, uint32_t first_row, uint32_t rows,
+    std::vector<uint8_t> *result)
 {
-    const size_t size = this->img->size();
-    uint8_t previous = (*this->img)[0];
-    uint32_t counter = 1;
-    uint32_t width, height;
-    this->img->dimensions(&width, &height);
+    if ((size_t) width * rows == 0) {
+        return;
+    }
 
-    if (direction == DIRECTION_HORIZONTAL) {
-        // Horizontal encoding
-        for (size_t i = 1; i < size; i++) {
-            if (previous == (*this->img)[i] && counter <= 257) { // 258 - 3 = 255
-                counter++;
-            } else {
-                enc(counter, previous, result);
-                counter = 1;
-                previous = (*this->img)[i];
+    const ptrdiff_t step_x = view->step_x, step_y = view->step_y;
+    const uint32_t lines = Vertical ? width : rows;  // Columns or rows scanned.
+    const uint32_t length = Vertical ? rows : width; // Pixels in one of them.
+    const ptrdiff_t step = Vertical ? step_y : step_x;
+    const ptrdiff_t origin = view->origin + (ptrdiff_t) first_row * step_y;
+
+    Pixel previous = 0;
+    uint32_t counter = 0;
+    for (uint32_t line = 0; line < lines; line++) {
+        ptrdiff_t i = origin + line * (Vertical ? step_x : step_y);
+        for (uint32_t n = 0; n < length; n++, i += step) {
+            Pixel current = load_pixel<Pixel>(px, i);
+            if (Model) {
+                // The previous pixel of the view in row by row order.
+                const uint32_t x = Vertical ? line : n, y = Vertical ? n : line;
+                if (x > 0) {
+                    current -= load_pixel<Pixel>(px, i - step_x);
+                } else if (y > 0) {
+                    current -= load_pixel<Pixel>(px, i - step_y + (ptrdiff_t) (width - 1) * step_x);
+                }
             }
-        }
-        enc(counter, previous, result);
-    } else {
-        // Vertical encoding
-        // TODO repeated code... Check if these loops could somehow be merged.
-        uint32_t y = 1, x = 0;
-        for (size_t i = y * width + x; x < width; i = y * width + x) {
-            if (previous == (*this->img)[i] && counter <= 257) { // 258 - 3 = 255
+
+            if (counter > 0 && previous == current && counter <= 257) { // 258 - 3 = 255
                 counter++;
             } else {
-                enc(counter, previous, result);
+                if (counter > 0) {
+                    enc<Pixel>(counter, previous, result);
+                }
                 counter = 1;
-                previous = (*this->img)[i];
-            }
-
-            y++;
-            if (y >= height) {
-                y = 0;
-                x++;
+                previous = current;
             }
         }
-        enc(counter, previous, result);
     }
+    enc<Pixel>(counter, previous, result);
+}
+
+/**
+ * Returns the maximum number of RLE symbols produced for an image
+ * of `pixels` pixels. Runs of 1 or 2 pixels produce as many pixel values
+ * as pixels, longer runs produce 3 pixel values and a count for at least
+ * 3 pixels.
+ * @param pixels the number of pixels in the image.
+ * @param depth bits per pixel, 8 or 16.
+ * @returns The upper bound of the RLE encoded data size.
+ */
+size_t Codec::rle_bound(size_t pixels, uint8_t depth)
+{
+    return pixels * (depth / 8) + pixels / 3 + 1;
 }
 
 /**
@@ -472,70 +3605,181 @@ void Codec::rle(std::vector<uint8_t> *result, bool direction)
  * @param value the pixel value of the current run.
  * @param result pointer to vector, to which to save the encoded pixels.
  */
-void Codec::enc(uint32_t count, uint8_t value, std::vector<uint8_t> *result)
+template <typename Pixel>
+void Codec::enc(uint32_t count, Pixel value, std::vector<uint8_t> *result)
 {
     if (count < 3) {
         for (uint32_t i = 0; i < count; i++) {
-            result->push_back(value);
+            push_pixel<Pixel>(result, value);
         }
     } else {
         for (uint8_t i = 0; i < 3; i++) {
-            result->push_back(value);
+            push_pixel<Pixel>(result, value);
         }
         result->push_back(count-3);
     }
 }
 
 /**
- * Pushes value `val` `n`-times into vector `vect`.
- * @param val the value to be pushed.
- * @param n how many times to push it.
- * @param vect pointer to the vector to be pushed in.
+ * Apply an inverse of the pixel subtraction model to the loaded image.
+ * The model works in the horizontal direction, where
+ * each new pixel value is calculated as `Image[i] = Image[i] + Image[i-1]`.
+ * The resulting image data is modified in-place, therefore the resulting
+ * modified data is returned via the `subd` pointer.
+ * @param subd is the subtracted image data calculated by `Codec::rle()`
+ * with the model enabled.
+ * @param size the number of pixels in `subd`.
+ * @param depth bits per pixel, 8 or 16.
+ * @param width the width of the image, if its rows are `stride` pixels apart.
+ * @param stride pixels between the starts of two rows, 0 if the rows
+ * follow each other.
  */
-void Codec::push_n(const uint8_t val, uint8_t n, std::vector<uint8_t> *vect)
+void Codec::model_sub_inverse(uint8_t *subd, size_t size, uint8_t depth, uint32_t width, size_t stride)
 {
-    for (uint8_t i = 0; i < n; i++) {
-        vect->push_back(val);
+    STATS_TIMER(STAGE_MODEL_INVERSE);
+    if (stride > width) {
+        if (depth == 16) {
+            PredictLeft::inverse_rows<uint16_t>(subd, width, size / width, stride);
+        } else {
+            PredictLeft::inverse_rows<uint8_t>(subd, width, size / width, stride);
+        }
+    } else if (depth == 16) {
+        PredictLeft::inverse<uint16_t>(subd, size);
+    } else {
+        PredictLeft::inverse<uint8_t>(subd, size);
     }
 }
 
 /**
- * Apply a pixel subtraction model to the loaded image.
- * The model works in the horizontal direction, where
- * each pixel new value is calculated as `Image[i] - Image[i-1]`.
- * **!!The old image data stored in `Codec::img` is overwritten.!!**
+ * Apply the pixel subtraction model to `size` pixels of `px`, i.e. write
+ * `px[i] - px[i-1]` (in row by row order) to `out`, as rle() does on the fly.
+ * @param px pointer to the raw pixel data.
+ * @param size the number of pixels.
+ * @param depth bits per pixel, 8 or 16.
+ * @param out pointer to `size` pixels, to which the residuals are written.
  */
-void Codec::model_sub()
+void Codec::model_sub(const uint8_t *px, size_t size, uint8_t depth, uint8_t *out)
 {
-    const size_t size = this->img->size();
-    std::vector<uint8_t> subd;
+    if (depth == 16) {
+        for (size_t i = 0; i < size; i++) {
+            store_pixel<uint16_t>(out, i, PredictLeft::residual<uint16_t>(px, i));
+        }
+    } else {
+        for (size_t i = 0; i < size; i++) {
+            store_pixel<uint8_t>(out, i, PredictLeft::residual<uint8_t>(px, i));
+        }
+    }
+}
 
-    subd.push_back((*this->img)[0]);
-    for (size_t i = 1; i < size; i++) {
-        subd.push_back((*this->img)[i] - (*this->img)[i-1]);
+/**
+ * Returns the prediction of the median edge detector (of LOCO-I) from
+ * the left (`a`), upper (`b`) and upper left (`c`) neighbours.
+ */
+static inline int32_t med_predict(int32_t a, int32_t b, int32_t c)
+{
+    if (c >= std::max(a, b)) {
+        return std::min(a, b);
     }
+    if (c <= std::min(a, b)) {
+        return std::max(a, b);
+    }
+    return a + b - c;
+}
 
-    uint32_t width, height;
-    this->img->dimensions(&width, &height);
+/**
+ * Kernel of med_sub() and med_sub_inverse(). Pixels of the first row are
+ * predicted by their left neighbour, the first pixels of the other rows
+ * by their upper neighbour.
+ */
+template <typename Pixel, bool Inverse>
+static void med_kernel(const uint8_t *px, uint32_t width, uint32_t height, uint8_t *out)
+{
+    // The predictions are made from the original pixels, which are `out`
+    // itself when restoring them.
+    const uint8_t *original = Inverse ? out : px;
+    for (uint32_t y = 0; y < height; y++) {
+        const size_t row = (size_t) y * width;
+        for (uint32_t x = 0; x < width; x++) {
+            const size_t i = row + x;
+            int32_t predicted = 0;
+            if (y == 0) {
+                predicted = x > 0 ? load_pixel<Pixel>(original, i - 1) : 0;
+            } else if (x == 0) {
+                predicted = load_pixel<Pixel>(original, i - width);
+            } else {
+                predicted = med_predict(load_pixel<Pixel>(original, i - 1),
+                    load_pixel<Pixel>(original, i - width),
+                    load_pixel<Pixel>(original, i - width - 1));
+            }
+            const Pixel value = load_pixel<Pixel>(px, i);
+            store_pixel<Pixel>(out, i, Inverse ? value + predicted : value - predicted);
+        }
+    }
+}
 
-    this->img_data = Image(&subd, width, height);
-    this->img = &(this->img_data);
+/**
+ * Write the differences of the pixels of `px` to the prediction of
+ * the median edge detector (modulo 2^depth) to `out`. Unlike the model,
+ * which predicts from the left pixel only, it follows both horizontal and
+ * vertical edges.
+ * @param px pointer to the raw pixel data.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param depth bits per pixel, 8 or 16.
+ * @param out pointer to the pixels, to which the residuals are written.
+ */
+void Codec::med_sub(const uint8_t *px, uint32_t width, uint32_t height, uint8_t depth, uint8_t *out)
+{
+    if (depth == 16) {
+        med_kernel<uint16_t, false>(px, width, height, out);
+    } else {
+        med_kernel<uint8_t, false>(px, width, height, out);
+    }
 }
 
 /**
- * Apply an inverse of the pixel subtraction model to the loaded image.
- * The model works in the horizontal direction, where
- * each new pixel value is calculated as `Image[i] = Image[i] + Image[i-1]`.
- * The resulting image data is modified in-place, therefore the resulting
- * modified data is returned via the `subd` pointer.
- * @param subd is the subtracted image data calculated by `Codec::model_sub()`.
+ * Restore the pixels from the residuals of med_sub() in place.
+ * See Codec::med_sub() for the parameters.
  */
-void Codec::model_sub_inverse(std::vector<uint8_t> *subd)
+void Codec::med_sub_inverse(uint8_t *px, uint32_t width, uint32_t height, uint8_t depth)
 {
-    const size_t size = subd->size();
+    STATS_TIMER(STAGE_MODEL_INVERSE);
+    if (depth == 16) {
+        med_kernel<uint16_t, true>(px, width, height, px);
+    } else {
+        med_kernel<uint8_t, true>(px, width, height, px);
+    }
+}
 
-    for (size_t i = 1; i < size; i++) {
-        (*subd)[i] = (*subd)[i] + (*subd)[i-1];
+/**
+ * Restores a delta frame in place by adding the previous frame to it.
+ * @param px the residuals of the delta frame, overwritten with its pixels.
+ * @param reference the previous frame.
+ * @param size the number of pixels.
+ * @param depth bits per pixel, 8 or 16.
+ * @param row pixels in a row of `px`, if its rows are `stride` pixels apart
+ * (`reference` is always without gaps).
+ * @param stride pixels between the starts of two rows of `px`, 0 if the rows
+ * follow each other.
+ */
+void Codec::delta_inverse(
+    uint8_t *px, const uint8_t *reference, size_t size, uint8_t depth,
+    size_t row, size_t stride)
+{
+    STATS_TIMER(STAGE_MODEL_INVERSE);
+    if (stride <= row) {
+        row = size;
+        stride = size;
+    }
+    const size_t sample_size = depth / 8;
+    for (size_t done = 0; done < size; done += row) {
+        uint8_t *px_row = px + done / row * stride * sample_size;
+        const uint8_t *ref_row = reference + done * sample_size;
+        if (depth == 16) {
+            temporal_inverse<uint16_t>(px_row, ref_row, row);
+        } else {
+            temporal_inverse<uint8_t>(px_row, ref_row, row);
+        }
     }
 }
 
@@ -546,13 +3790,25 @@ void Codec::model_sub_inverse(std::vector<uint8_t> *subd)
  * 1100
  * 0000
  * has 3 changes in the vertical direction, but only 1 change horizontally.
+ * @param depth bits per pixel, 8 or 16.
  * @returns The best encoding direction for RLE. The direction values are
  * defined as DIRECTION_* macros in "Code.hpp".
  */
-uint8_t Codec::best_encoding_direction()
+uint8_t Codec::best_encoding_direction(const uint8_t *px, uint32_t width, uint32_t height, uint8_t depth)
 {
-    uint32_t chg_horiz = changes_horizontally();
-    uint32_t chg_verti = changes_vertically();
+    STATS_TIMER(STAGE_DIRECTION);
+    if ((size_t) width * height == 0) {
+        return DIRECTION_HORIZONTAL;
+    }
+
+    uint64_t chg_horiz, chg_verti;
+    if (depth == 16) {
+        chg_horiz = changes<uint16_t, ScanHorizontal>(px, width, height);
+        chg_verti = changes<uint16_t, ScanVertical>(px, width, height);
+    } else {
+        chg_horiz = changes<uint8_t, ScanHorizontal>(px, width, height);
+        chg_verti = changes<uint8_t, ScanVertical>(px, width, height);
+    }
 
     if (chg_horiz <= chg_verti) {
         return DIRECTION_HORIZONTAL;
@@ -564,153 +3820,417 @@ uint8_t Codec::best_encoding_direction()
     return DIRECTION_HORIZONTAL;
 }
 
-/** Calculate how many times values change in the image in the horizontal
- * direction. Used for determinig in which direction run-length encoding should
+/** Calculate how many times values change in the image in the given scan
+ * order. Used for determinig in which direction run-length encoding should
  * be implemented.
- * @returns The ammount of times pixel runs in the horizontal direction
- * changed value.
+ * @returns The ammount of times pixel runs in the scan order changed value.
  */
-uint32_t Codec::changes_horizontally()
+template <typename Pixel, typename Scan>
+uint64_t Codec::changes(const uint8_t *px, uint32_t width, uint32_t height)
 {
-    uint32_t change_count = 0;
-    uint8_t previous = (*this->img)[0];
+    const size_t size = (size_t) width * height;
+    Scan scan(width, height, nullptr);
+
+    uint64_t change_count = 0;
+    Pixel previous = load_pixel<Pixel>(px, scan.index());
+    scan.next();
 
-    for (uint32_t i = 1; i < this->img->size(); i++) {
-        if (previous != (*this->img)[i]) {
+    for (size_t n = 1; n < size; n++, scan.next()) {
+        const Pixel current = load_pixel<Pixel>(px, scan.index());
+        if (previous != current) {
             change_count++;
         }
-        previous = (*this->img)[i];
+        previous = current;
     }
 
     return change_count;
 }
 
-/** Calculate how many times values change in the image in the vertical
- * direction. Used for determinig in which direction run-length encoding should
- * be implemented.
- * @returns The ammount of times pixel runs in the vertical direction
- * changed value.
+/**
+ * Returns the number of tiles of side `tile` of an image. With chunks,
+ * the tiles of every chunk are counted separately (tiles do not cross
+ * chunk boundaries).
+ * @param chunk_rows rows per chunk, 0 if not chunked.
  */
-uint32_t Codec::changes_vertically()
+uint64_t Codec::tile_count(uint32_t width, uint32_t height, uint32_t tile, uint32_t chunk_rows)
 {
-    uint32_t width, height;
-    this->img->dimensions(&width, &height);
-    const uint32_t stride = width;
+    if (tile == 0) {
+        return 0;
+    }
+
+    const uint64_t columns = ((uint64_t) width + tile - 1) / tile;
+    if (chunk_rows == 0) {
+        return columns * (((uint64_t) height + tile - 1) / tile);
+    }
+
+    const uint64_t full = height / chunk_rows, rest = height % chunk_rows;
+    const uint64_t per_chunk = ((uint64_t) chunk_rows + tile - 1) / tile;
+    return columns * (full * per_chunk + (rest + tile - 1) / tile);
+}
 
-    uint32_t change_count = 0;
-    uint8_t previous = (*this->img)[0];
+/**
+ * Picks the scanning direction of every tile of side `opts.tile` (per chunk
+ * of `opts.chunk_rows` rows, if chunked). The tiles are split between
+ * threads, each of which counts the value changes of its tiles in both
+ * directions.
+ * @param data pointer to raw pixel data, row by row.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts encoding options.
+ * @param bits pointer to vector, which is overwritten with the direction
+ * bits of the tiles (set for vertical), MSb first, in row by row order of
+ * the tiles (chunk by chunk).
+ */
+void Codec::tile_directions(
+    const uint8_t *data, uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *bits)
+{
+    STATS_TIMER(STAGE_DIRECTION);
+    struct tile_rect { uint32_t x, y, width, height; };
+    std::vector<struct tile_rect> tiles;
+    tiles.reserve(tile_count(width, height, opts.tile, opts.chunk_rows));
 
-    for (uint32_t i = 0; i < width; i++) {
-        for (uint32_t k = 0, j = i; k < height; k++, j += stride) {
-            // Used two variables in this loop so I don't have to do arithmetics.
-            if (previous != (*this->img)[j]) {
-                change_count++;
+    const uint32_t tile = opts.tile;
+    const uint64_t rows = opts.chunk_rows > 0 ? opts.chunk_rows : height;
+    for (uint64_t first = 0; first < height; first += rows) {
+        const uint64_t chunk_end = height - first < rows ? height : first + rows;
+        for (uint64_t y = first; y < chunk_end; y += tile) {
+            for (uint64_t x = 0; x < width; x += tile) {
+                tiles.push_back({(uint32_t) x, (uint32_t) y,
+                    (uint32_t) (width - x < tile ? width - x : tile),
+                    (uint32_t) (chunk_end - y < tile ? chunk_end - y : tile)});
             }
-            previous = (*this->img)[j];
         }
     }
 
-    return change_count;
+    std::vector<uint8_t> vertical(tiles.size());
+    auto work = [&](size_t from, size_t to) {
+        for (size_t t = from; t < to; t++) {
+            const struct tile_rect &r = tiles[t];
+            vertical[t] = opts.depth == 16 ?
+                tile_is_vertical<uint16_t>(data, width, r.x, r.y, r.width, r.height) :
+                tile_is_vertical<uint8_t>(data, width, r.x, r.y, r.width, r.height);
+        }
+    };
+
+    // Small images are not worth starting threads for.
+    const size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    const size_t count = std::min(hw, (size_t) width * height / TILE_PIXELS_PER_THREAD + 1);
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < count; k++) {
+        threads.emplace_back(work, k * tiles.size() / count, (k + 1) * tiles.size() / count);
+    }
+    work(0, tiles.size() / count);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    bits->assign((tiles.size() + 7) / 8, 0);
+    for (size_t t = 0; t < tiles.size(); t++) {
+        if (vertical[t]) {
+            (*bits)[t >> 3] |= 0x80 >> (t & 7);
+        }
+    }
 }
 
 /**
- * Writes 8 bytes to `*fs`. These 8 bytes represent the original width
- * and height of the encoded image.
- * @param fs pointer to an outbound fstream.
+ * Appends the 9 byte header to `out`. The first 8 bytes represent
+ * the original width and height of the encoded image, the last byte holds
+ * the encoding options, that were used during encoding. Chunked images
+ * continue with the header version. If a Huffman model is used, its 4 byte
+ * id follows. Chunked images continue with the 8 byte number of rows
+ * per chunk. Tiled images end the header with the 2 byte tile size and
+ * the direction bits of the tiles.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts structure with the encoding options.
+ * @param out pointer to vector, to which the header is appended.
  */
-void Codec::write_dimensions(std::fstream *fs)
+void Codec::write_header(
+    uint32_t width, uint32_t height,
+    struct enc_options opts, std::vector<uint8_t> *out)
 {
-    uint32_t width, height;
-    this->img->dimensions(&width, &height);
-
     // First 4 bytes of the encoded image are the image width.
-    uint8_t byte;
     for (int shift = 24; shift >= 0; shift -= 8) {
-        byte = width >> shift;
-        fs->write((char *) &(byte), sizeof(uint8_t));
+        out->push_back(width >> shift);
     }
 
     // Next 4 bytes of the encoded image are the image height.
     for (int shift = 24; shift >= 0; shift -= 8) {
-        byte = height >> shift;
-        fs->write((char *) &(byte), sizeof(uint8_t));
+        out->push_back(height >> shift);
+    }
+
+    if (opts.channels > 1) {
+        // Every plane has its own header, see Codec::encode_planes().
+        out->push_back((opts.depth == 16 ? OPTION_DEPTH16 : 0)
+            | (opts.delta ? OPTION_DELTA : 0) | 0x80);
+        out->push_back(HEADER_VERSION_PLANES);
+        out->push_back(opts.channels | (opts.color_transform ? CHANNELS_TRANSFORM : 0));
+        return;
+    }
+
+    if (opts.chain != nullptr) {
+        // The chain replaces the other options, see Codec::encode_chained().
+        out->push_back((opts.depth == 16 ? OPTION_DEPTH16 : 0)
+            | (opts.delta ? OPTION_DELTA : 0) | 0x80);
+        out->push_back(HEADER_VERSION_CHAIN);
+        opts.chain->write(out);
+        return;
     }
-}
 
-/**
- * Reads 8 bytes from fstream `*fs`, interprets them as
- * two unsigned 32 bit integers, and returns these values via the `width`
- * and `height` pointers. Used to read the first 8 bytes of an encoded
- * image, where the dimensions of the image are stored.
- * @param fs pointer to an inbound fstream.
- */
-void Codec::read_dimensions(std::fstream *fs, uint32_t *width, uint32_t *height)
-{
-    *width = 0, *height = 0;
     uint8_t byte = 0;
+    byte |= opts.model << 0;
+    byte |= (opts.direction & 1) << 1;
+    byte |= (opts.direction >> 1) << 5;
+    byte |= (opts.huffman_model != nullptr) << 2;
+    byte |= opts.depth == 16 ? OPTION_DEPTH16 : 0;
+    byte |= (opts.tile > 0) << 4;
+    byte |= opts.delta ? OPTION_DELTA : 0;
+    // More options may be added.
+    byte |= (opts.chunk_rows > 0) << 7;
 
-    for (int shift = 24; shift >= 0; shift -= 8) {
-        fs->read((char *) &byte, sizeof(uint8_t));
+    out->push_back(byte);
 
-        *width |= byte<<shift;
+    if (opts.chunk_rows > 0) {
+        out->push_back(opts.checksum ? HEADER_VERSION_CRC : HEADER_VERSION);
     }
 
-    for (int shift = 24; shift >= 0; shift -= 8) {
-        fs->read((char *) &byte, sizeof(uint8_t));
+    if (opts.huffman_model != nullptr) {
+        const uint32_t id = opts.huffman_model->id();
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out->push_back(id >> shift);
+        }
+    }
 
-        *height |= byte<<shift;
+    if (opts.chunk_rows > 0) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            out->push_back((uint64_t) opts.chunk_rows >> shift);
+        }
+    }
+
+    if (opts.tile > 0) {
+        out->push_back(opts.tile >> 8);
+        out->push_back(opts.tile & 0xff);
+        const uint64_t tiles = tile_count(width, height, opts.tile, opts.chunk_rows);
+        out->insert(out->end(), opts.tile_directions, opts.tile_directions + (tiles + 7) / 8);
     }
 }
 
 /**
- * Writes one byte to `*fs`. This byte will hold the encoding options,
- * that were used during encoding.
- * @param fs pointer to an outbound filestream.
- * @param opts structure with the encoding options.
+ * Checks, that the dimensions read from a header are plausible, before
+ * anything is allocated for the image: the decoded image must not be
+ * larger than MAX_IMAGE_BYTES and its `payload` bytes must be enough
+ * to hold all its samples.
+ * @param width the width of the image.
+ * @param height the height of the image.
+ * @param opts the options read from the header.
+ * @param payload bytes of the encoded image, which follow the header.
+ * @param expansion the most samples, which one byte of the payload decodes
+ * to (MAX_PIXELS_PER_BYTE for Huffman coded RLE).
+ * @throws const char * if the dimensions are not plausible.
  */
-void Codec::write_options(std::fstream *fs, struct enc_options opts)
+void Codec::check_dimensions(
+    uint32_t width, uint32_t height, const struct enc_options *opts,
+    size_t payload, uint64_t expansion)
 {
-    uint8_t byte = 0;
-    byte |= opts.model << 0;
-    byte |= opts.direction << 1;
-    // More options may be added.
-
-    fs->write((char *) &(byte), sizeof(uint8_t));
+    const uint64_t pixels = (uint64_t) width * height;
+    const uint64_t sample_size = opts->depth / 8;
+    if (pixels > MAX_IMAGE_BYTES / opts->channels / sample_size) {
+        throw "Encoded image has an invalid header (the image is too large).";
+    }
+    if (pixels * opts->channels / expansion > payload) {
+        throw "Encoded image has an invalid header (the image is too large for its data).";
+    }
 }
 
 /**
- * Reads one byte from `*fs` and interprets it as options set during encoding.
- * the options are returned via the `*opts` pointer.
- * @param fs pointer to an inbound filestream.
+ * Parses the 9 byte header at the start of an encoded image. The width
+ * and height are stored as two unsigned big endian 32 bit integers, which
+ * are followed by a byte of options set during encoding and the id of
+ * the Huffman model, if one was used. The model is looked up among
+ * the registered models.
+ * @param data pointer to the encoded image.
+ * @param size size of the encoded image in bytes.
+ * @param width pointer, via which the image width is returned.
+ * @param height pointer, via which the image height is returned.
  * @param opts pointer to a structure of options, which will hold the parsed
  * options.
+ * @param find_model false if the model is not needed (e.g. to verify
+ * the checksums), `opts->huffman_model` is then left nullptr.
+ * @returns The size of the header in bytes.
+ * @throws const char * if the header is invalid, including implausible
+ * dimensions (see Codec::check_dimensions()).
  */
-void Codec::read_options(std::fstream *fs, struct enc_options *opts)
+size_t Codec::read_header(
+    const uint8_t *data, size_t size,
+    uint32_t *width, uint32_t *height, struct enc_options *opts,
+    bool find_model)
 {
-    uint8_t byte = 0, mask = 0x01;
-    fs->read((char *) &byte, sizeof(uint8_t));
+    if (size < HEADER_SIZE) {
+        throw "Encoded image is missing its header.";
+    }
+
+    *width = 0, *height = 0;
+    for (int i = 0, shift = 24; shift >= 0; i++, shift -= 8) {
+        *width |= (uint32_t) data[i] << shift;
+        *height |= (uint32_t) data[i + 4] << shift;
+    }
+
+    uint8_t byte = data[8], mask = 0x01;
 
     byte & mask ? opts->model = true : opts->model = false;
     mask = mask << 1;
-    byte & mask ? opts->direction = true : opts->direction = false;
+    opts->direction = (byte & mask) ? 1 : 0;
+    opts->direction |= (byte & 0x20) ? 2 : 0; // The high bit of the scan order.
+    mask = mask << 1;
+    const bool primed = byte & mask;
+    mask = mask << 1;
+    byte & mask ? opts->depth = 16 : opts->depth = 8;
+    mask = mask << 1;
+    const bool tiled = byte & mask;
+    mask = mask << 2; // bit5 was read with bit1.
+    byte & mask ? opts->delta = true : opts->delta = false;
     mask = mask << 1;
     // More options may be added.
+    const bool extended = byte & 0x80;
+    opts->adaptive = false;
+    opts->huffman_model = nullptr;
+    opts->chunk_rows = 0;
+    opts->checksum = false;
+    opts->tile = 0;
+    opts->tile_directions = nullptr;
+    opts->channels = 1;
+    opts->color_transform = false;
+    opts->chain = nullptr;
+    opts->chained = false;
+
+    size_t pos = HEADER_SIZE;
+    if (extended) {
+        if (size < pos + 1) {
+            throw "Encoded image is missing its header.";
+        }
+        if (data[pos] == HEADER_VERSION_PLANES) {
+            if (size < pos + 2) {
+                throw "Encoded image is missing its header.";
+            }
+            opts->channels = data[pos + 1] & ~CHANNELS_TRANSFORM;
+            opts->color_transform = data[pos + 1] & CHANNELS_TRANSFORM;
+            if (opts->channels < 2 || opts->channels > MAX_CHANNELS
+                || (opts->color_transform && opts->channels < 3)) {
+                throw "Encoded image has an invalid header.";
+            }
+            check_dimensions(*width, *height, opts, size - pos - 2);
+            return pos + 2;
+        }
+        if (data[pos] == HEADER_VERSION_CHAIN) {
+            // The chain follows, it is read by Codec::decode_pixels().
+            if (opts->model || opts->direction != DIRECTION_HORIZONTAL || primed || tiled) {
+                throw "Encoded image has an invalid header.";
+            }
+            opts->chained = true;
+
+            check_dimensions(*width, *height, opts, size - pos - 1,
+                Pipeline::expansion(data + pos + 1, size - pos - 1));
+            return pos + 1;
+        }
+        if (data[pos] != HEADER_VERSION && data[pos] != HEADER_VERSION_CRC) {
+            throw "Encoded image has an unsupported header version.";
+        }
+        opts->checksum = data[pos] == HEADER_VERSION_CRC;
+        pos++;
+    }
+
+    if (primed) {
+        if (size < pos + MODEL_ID_SIZE) {
+            throw "Encoded image is missing its header.";
+        }
+
+        uint32_t id = 0;
+        for (int i = 0; i < MODEL_ID_SIZE; i++) {
+            id = (id << 8) | data[pos + i];
+        }
+        pos += MODEL_ID_SIZE;
+
+        opts->huffman_model = find_model ? HuffmanModel::find(id) : nullptr;
+        if (find_model && opts->huffman_model == nullptr) {
+            throw "Encoded image requires a Huffman model, which was not loaded.";
+        }
+    }
+
+    if (extended) {
+        if (size < pos + CHUNK_ROWS_SIZE) {
+            throw "Encoded image is missing its header.";
+        }
+
+        uint64_t rows = 0;
+        for (int i = 0; i < CHUNK_ROWS_SIZE; i++) {
+            rows = (rows << 8) | data[pos + i];
+        }
+        pos += CHUNK_ROWS_SIZE;
+
+        if (rows == 0 || rows > UINT32_MAX) {
+            throw "Encoded image has an invalid header.";
+        }
+        opts->chunk_rows = (uint32_t) rows;
+    }
+
+    if (tiled) {
+        if (size < pos + TILE_SIZE_SIZE || opts->direction != DIRECTION_HORIZONTAL) {
+            throw "Encoded image is missing its header.";
+        }
+        opts->tile = (data[pos] << 8) | data[pos + 1];
+        pos += TILE_SIZE_SIZE;
+        if (opts->tile == 0) {
+            throw "Encoded image has an invalid header.";
+        }
+
+        const uint64_t bytes = (tile_count(*width, *height, opts->tile, opts->chunk_rows) + 7) / 8;
+        if (size - pos < bytes) {
+            throw "Encoded image is missing its header.";
+        }
+        opts->tile_directions = data + pos;
+        pos += bytes;
+    }
+
+    check_dimensions(*width, *height, opts, size - pos);
+    return pos;
 }
 
 /**
  * Load all data from filestream `fs` until EOF into vector `loaded`
  * @param fs pointer to fstream opened for binary reading.
- * @param loaded pointer to vector, to which the read data will be pushed.
+ * @param loaded pointer to vector, which will be overwritten with the data.
+ * @throws const char * if the file is not open or could not be read whole.
  */
 void Codec::load_encoded_data(std::fstream *fs, std::vector<uint8_t> *loaded)
 {
-    uint8_t byte;
+    // The vector is reused, nothing of the previous image may be left in it.
+    loaded->clear();
+    if (!fs->is_open()) {
+        throw "Encoded image could not be read.";
+    }
 
-    while (true) {
-        if (fs->peek() == EOF) {
-            break;
-        }
-        fs->read((char *) &byte, sizeof(uint8_t));
-        loaded->push_back(byte);
+    fs->seekg(0, std::ios_base::end);
+    const std::streamoff end = fs->tellg();
+    fs->seekg(0, std::ios_base::beg);
+    if (end < 0 || !*fs) {
+        throw "Encoded image could not be read.";
+    }
+    if (end == 0) {
+        return;
     }
-}
\ No newline at end of file
+
+    try
+    {
+        loaded->resize(end);
+    }
+    catch(const std::bad_alloc &e)
+    {
+        throw "Encoded image could not be read.";
+    }
+    fs->read((char *) loaded->data(), end);
+    if (fs->gcount() != end) {
+        loaded->clear();
+        throw "Encoded image could not be read.";
+    }
+}
@@ -7,14 +7,64 @@
 #ifndef CODEC_HPP
 #define CODEC_HPP
 
+#include <cstddef>
 #include <cstdint>
 #include <fstream>
 #include <vector>
 #include "Image.hpp"
 #include "Huffman.hpp"
+#include "HuffmanModel.hpp"
+
+class Pipeline;
+class RowSource;
+struct bounded_context;
 
 #define DIRECTION_VERTICAL 1
 #define DIRECTION_HORIZONTAL 0
+#define DIRECTION_HILBERT 2 // Hilbert curve through blocks, see ScanBlocks.
+#define DIRECTION_ZIGZAG 3 // Zig-zag through blocks, see ScanBlocks.
+#define SCAN_ORDERS 4 // Number of the DIRECTION_* scan orders.
+
+#define HILBERT_BLOCK 64 // Side of the blocks of the Hilbert scan order (a power of 2).
+#define ZIGZAG_BLOCK 8 // Side of the blocks of the zig-zag scan order.
+
+#define OPTION_DEPTH16 (1 << 3) // Options byte bit of 16-bit images.
+#define OPTION_DELTA (1 << 6)   // Options byte bit of delta frames.
+
+#define HEADER_SIZE 9 // 4 bytes width + 4 bytes height + 1 byte options.
+#define MAX_IMAGE_BYTES (1ull << 42) // Largest decoded image, whose header is accepted (4 TiB).
+#define MAX_PIXELS_PER_BYTE 516 // Most samples per byte of Huffman code (a run of 258 takes 4 symbols of at least a bit).
+#define MODEL_ID_SIZE 4 // Model id following the header of primed images.
+#define HEADER_VERSION 2 // Version byte following the options of chunked images.
+#define CHUNK_ROWS_SIZE 8 // Rows per chunk, ending the header of chunked images.
+#define CHUNK_ENTRY_SIZE 8 // Encoded size of one chunk in the chunk table.
+#define HEADER_VERSION_PLANES 3 // Version byte of multi-channel images.
+#define PLANE_ENTRY_SIZE 8 // Encoded size of one plane in the plane table.
+#define MAX_CHANNELS 4 // Most interleaved channels of a multi-channel image.
+#define HEADER_VERSION_CRC 4 // Version byte of chunked images with checksums.
+#define HEADER_VERSION_CHAIN 5 // Version byte of images encoded with a transform chain.
+#define CHANNELS_TRANSFORM 0x80 // Channels byte bit of the YCoCg-R transform.
+
+#define TILE_SIZE_SIZE 2 // Tile size following the rest of the header of tiled images.
+#define TILE_PIXELS_PER_THREAD (1 << 18) // Pixels per thread picking tile directions.
+
+#define CHUNK_THRESHOLD (1ull << 32) // Images with more pixels are always chunked.
+#define CHUNK_PIXELS (1ull << 26) // Pixels per chunk of automatically chunked images.
+#define CHECKSUM_PIXELS (1ull << 20) // Pixels per chunk of checksummed images (by default).
+
+#define ROTATE_TRANSPOSE 0 // Mirror along the main diagonal, see Codec::rotate().
+#define ROTATE_90 1 // Rotation by 90 degrees clockwise.
+#define ROTATE_180 2 // Rotation by 180 degrees.
+#define ROTATE_270 3 // Rotation by 270 degrees clockwise (90 counterclockwise).
+
+#define MEMORY_RESERVE (8ull << 20) // Memory of the process itself, not left to the buffers by Codec::decode_bounded().
+#define MIN_MEMORY_MB 9 // Lowest memory limit of Codec::decode_bounded() in megabytes (above MEMORY_RESERVE).
+#define SYMBOL_BLOCK (1 << 16) // Symbols Huffman decoded at a time by Codec::decode_bounded().
+#define DROP_BYTES (1 << 20) // Decoded bytes of the encoded image, whose pages Codec::decode_bounded() drops at once.
+
+#define ESTIMATE_BAND 8 // Rows/columns in one band sampled by Codec::estimate().
+#define ESTIMATE_STRIDE 128 // One band is sampled every ESTIMATE_STRIDE rows/columns (by default).
+#define EFFORT_TILES {32, 64, 128} // Tile sides tried by effort level 9.
 
 /**
  * Options for the encoder.
@@ -24,48 +74,204 @@ struct enc_options
     /* Defined by user. */
     bool model;     //!< True if a model should be used.
     bool adaptive;  //!< True if adaptive encoding should be used.
+    //! True if all model/direction combinations should be tried
+    //! (concurrently) and the smallest output kept. Overrides the above.
+    bool search = false;
+    //! Effort level 0 (fastest) to 9 (best ratio), or -1 to use the options
+    //! above. See Codec::encode_effort(). Overrides the above.
+    int effort = -1;
+    //! Encoding time budget in milliseconds (0 for none). Used with `effort`.
+    uint32_t budget_ms = 0;
+
+    uint8_t depth = 8; //!< Bits per pixel, 8 or 16.
+    //! Interleaved channels per pixel (e.g. 3 for RGB, 4 for RGBA), each
+    //! of `depth` bits. See Codec::encode_planes().
+    uint8_t channels = 1;
+    //! True if the first three channels (RGB) are converted to YCoCg-R.
+    bool color_transform = false;
+    //! Rows per independently encoded chunk, 0 to encode the image
+    //! as a whole (unless it has more than CHUNK_THRESHOLD pixels).
+    uint32_t chunk_rows = 0;
+    //! True if the CRC32C of every chunk is stored (the image is then
+    //! always chunked), see Codec::verify().
+    bool checksum = false;
+    //! True if the image is the difference to the previous frame
+    //! (set by Codec::encode_delta()).
+    bool delta = false;
+    //! Scan order (one of DIRECTION_*) used instead of the one picked
+    //! by `adaptive`, -1 for none.
+    int scan = -1;
+    //! Side of the square tiles, which are each scanned in their own
+    //! direction (0 = the whole image is scanned in one direction).
+    uint16_t tile = 0;
+    //! Direction bits of the tiles (set by the codec), see Codec::tile_directions().
+    const uint8_t *tile_directions = nullptr;
+
+    //! Huffman model used to prime the trees (nullptr for none).
+    const HuffmanModel *huffman_model = nullptr;
+    //! Chain of stages used instead of the model, scanning and Huffman
+    //! coding above (nullptr for none), see Pipeline.
+    const Pipeline *chain = nullptr;
+    //! True if the image was encoded with a chain (set by the decoder,
+    //! which builds the chain from the header).
+    bool chained = false;
 
     /* Set by program based on user's settings. */
-    bool direction; //!< True if vertical scanning is used during encoding.
+    uint8_t direction; //!< Scan order used during encoding, one of DIRECTION_*.
     // More may be added.
 };
 
+/**
+ * Tiles of a tiled scan, which visits the tiles row by row and scans every
+ * tile in the direction given by its bit.
+ */
+struct scan_layout
+{
+    uint32_t tile;               //!< Side of the square tiles (0 = not tiled).
+    const uint8_t *directions;   //!< Direction bits of the tiles, MSb first.
+    uint64_t first_tile;         //!< Index of the bit of the first tile.
+    //! Pixels between the starts of two rows in memory (0 = the width),
+    //! used when decoding into a caller's buffer.
+    size_t stride = 0;
+};
+
+/**
+ * Rotated or mirrored view of an image: the pixel shown at column `x`
+ * and row `y` of the view is the pixel at index
+ * `origin + x * step_x + y * step_y` of the image.
+ */
+struct pixel_view
+{
+    ptrdiff_t origin; //!< Index of the pixel in the top left corner of the view.
+    ptrdiff_t step_x; //!< Index difference between two columns of the view.
+    ptrdiff_t step_y; //!< Index difference between two rows of the view.
+};
+
+/**
+ * Predicted outcome of encoding an image with one set of options.
+ */
+struct size_estimate
+{
+    struct enc_options opts; //!< The options (model and direction) estimated.
+    uint64_t bytes;          //!< Predicted size of the encoded image, header included.
+    double seconds;          //!< Predicted encoding time.
+};
+
+/**
+ * Pixel value statistics of an encoded image, see Codec::pixel_statistics().
+ */
+struct pixel_stats
+{
+    std::vector<uint64_t> histogram; //!< Sample count of every value (256 or 65536 bins).
+    uint64_t pixels;  //!< Number of pixels of the image.
+    uint64_t samples; //!< Number of values in the histogram (pixels times channels).
+    uint32_t min;    //!< The lowest pixel value (0 for an empty image).
+    uint32_t max;    //!< The highest pixel value (0 for an empty image).
+};
+
+/**
+ * Intermediate buffers used by the encoder and decoder. Passing the same
+ * instance to consecutive calls lets the buffers keep their capacity,
+ * so after the first image no further allocations are needed for images
+ * of the same or smaller size. An instance must not be shared between
+ * concurrently running calls.
+ */
+struct codec_buffers
+{
+    std::vector<uint8_t> symbols; //!< RLE encoded data (Huffman input/output).
+    std::vector<uint8_t> file;    //!< Raw contents of an encoded file.
+    std::vector<uint8_t> pixels;  //!< Decoded pixels waiting to be swapped into an Image.
+    std::vector<uint8_t> residuals; //!< Differences to the previous frame of a delta frame.
+    std::vector<uint8_t> tile_directions; //!< Direction bits of the tiles of a tiled image.
+    std::vector<uint8_t> planes;  //!< Pixels of a multi-channel image, plane by plane.
+    std::vector<std::vector<uint8_t>> plane_data; //!< Encoded or decoded planes.
+    std::vector<struct codec_buffers> plane_buffers; //!< Buffers of the planes' threads.
+    std::vector<struct codec_buffers> chunk_buffers; //!< Buffers of the chunks' threads.
+    std::vector<uint8_t> stage_data[2]; //!< Intermediate results of a transform chain.
+    //! Offsets of the chunks, which failed their checksum during the last
+    //! decoding, from the start of the encoded image.
+    std::vector<uint64_t> bad_blocks;
+    Huffman huffman;              //!< Huffman tree, reset for every image.
+};
+
 class Codec
 {
+    friend class Bench; // Times the individual stages.
+    friend class Pipeline; // Its stages are built from the codec's kernels.
 private:
     Image *img = nullptr; //!< Pointer to an image to be encoded/decoded.
     Image img_data;
+    struct codec_buffers buffers; //!< Buffers reused across images.
 
-    uint32_t changes_vertically();
-    uint32_t changes_horizontally();
-    uint8_t best_encoding_direction();
-    void irle(std::vector<uint8_t> *original, std::vector<uint8_t> *decoded,uint32_t width, uint32_t height, bool direction);
-    void irle_horizontal(std::vector<uint8_t> *original, std::vector<uint8_t> *decoded);
-    void irle_vertical(std::vector<uint8_t> *original, std::vector<uint8_t> *decoded,uint32_t width, uint32_t height);
-    size_t increment_vertical_index(uint32_t *x, uint32_t *y, const uint32_t width, const uint32_t height);
-    void rle(std::vector<uint8_t> *result, bool direction);
-    void enc(uint32_t count, uint8_t value, std::vector<uint8_t> *result);
-    void huffman_enc(std::vector<uint8_t> *encoded);
-    void huffman_dec(std::vector<uint8_t> *decoded);
-    uint8_t rotr8(uint8_t x, uint8_t n);
-    void write_dimensions(std::fstream *fs);
-    void read_dimensions(std::fstream *fs, uint32_t *width, uint32_t *height);
-    void write_options(std::fstream *fs, struct enc_options opts);
-    void read_options(std::fstream *fs, struct enc_options *opts);
-    void push_n(const uint8_t val, uint8_t n, std::vector<uint8_t> *vect);
-    void model_sub();
-    void model_sub_inverse(std::vector<uint8_t> *unsubd);
+    template <typename Pixel, typename Scan>
+    static uint64_t changes(const uint8_t *px, uint32_t width, uint32_t height);
+    static uint8_t best_encoding_direction(const uint8_t *px, uint32_t width, uint32_t height, uint8_t depth = 8);
+    static void irle(const std::vector<uint8_t> *original, uint8_t *decoded, uint32_t width, uint32_t height, uint8_t direction, uint8_t depth = 8, const struct scan_layout *layout = nullptr);
+    template <typename Pixel, typename Scan>
+    static void irle_kernel(const std::vector<uint8_t> *original, uint8_t *decoded, uint32_t width, uint32_t height, const struct scan_layout *layout);
+    static void rle(const uint8_t *px, uint32_t width, uint32_t height, bool model, uint8_t direction, std::vector<uint8_t> *result, uint8_t depth = 8, const struct scan_layout *layout = nullptr);
+    template <typename Pixel, typename Predictor, typename Scan>
+    static void rle_kernel(const uint8_t *px, uint32_t width, uint32_t height, std::vector<uint8_t> *result, const struct scan_layout *layout);
+    static uint64_t tile_count(uint32_t width, uint32_t height, uint32_t tile, uint32_t chunk_rows);
+    static void tile_directions(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *bits);
+    static size_t rle_bound(size_t pixels, uint8_t depth = 8);
+    static void rle_view(const uint8_t *px, const struct pixel_view *view, uint32_t width, uint32_t first_row, uint32_t rows, bool model, uint8_t direction, std::vector<uint8_t> *result, uint8_t depth = 8);
+    template <typename Pixel, bool Model, bool Vertical>
+    static void rle_view_kernel(const uint8_t *px, const struct pixel_view *view, uint32_t width, uint32_t first_row, uint32_t rows, std::vector<uint8_t> *result);
+    template <typename Pixel>
+    static void enc(uint32_t count, Pixel value, std::vector<uint8_t> *result);
+    static void huffman_enc(const std::vector<uint8_t> *data, std::vector<uint8_t> *out, const HuffmanModel *model, Huffman *huf);
+    static void huffman_dec(const uint8_t *data, size_t size, std::vector<uint8_t> *decoded, const HuffmanModel *model, Huffman *huf);
+    static void write_header(uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out);
+    static void check_dimensions(uint32_t width, uint32_t height, const struct enc_options *opts, size_t payload, uint64_t expansion = MAX_PIXELS_PER_BYTE);
+    static size_t read_header(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height, struct enc_options *opts, bool find_model = true);
+    static void model_sub_inverse(uint8_t *subd, size_t size, uint8_t depth = 8, uint32_t width = 0, size_t stride = 0);
+    static void model_sub(const uint8_t *px, size_t size, uint8_t depth, uint8_t *out);
+    static void med_sub(const uint8_t *px, uint32_t width, uint32_t height, uint8_t depth, uint8_t *out);
+    static void med_sub_inverse(uint8_t *px, uint32_t width, uint32_t height, uint8_t depth);
+    static void encode_chained(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static void delta_inverse(uint8_t *px, const uint8_t *reference, size_t size, uint8_t depth, size_t row = 0, size_t stride = 0);
+    static void decode_frame(const uint8_t *data, size_t size, const std::vector<uint8_t> *reference, std::vector<uint8_t> *out, uint8_t *dst, size_t stride, size_t capacity, uint32_t *width, uint32_t *height, struct codec_buffers *buf, uint8_t *depth, uint8_t *channels = nullptr);
+    static void decode_pixels(const uint8_t *data, size_t size, size_t header_size, uint8_t *dst, size_t stride, uint32_t width, uint32_t height, struct enc_options opts, struct codec_buffers *buf);
+    static void encode_with(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    template <typename Pixel>
+    static void histogram_tokens(const std::vector<uint8_t> *symbols, size_t pixels, bool model, std::vector<uint64_t> *hist);
+    static void encode_chunked(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static void decode_chunked(const uint8_t *data, size_t size, size_t header_size, uint8_t *dst, size_t stride, uint32_t width, uint32_t height, struct enc_options opts, struct codec_buffers *buf);
+    static void encode_planes(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static void decode_planes(const uint8_t *data, size_t size, size_t header_size, uint8_t *dst, size_t stride, uint32_t width, uint32_t height, struct enc_options opts, struct codec_buffers *buf);
+    static void encode_view(const uint8_t *data, const struct pixel_view *view, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static bool rotate_planes(const uint8_t *data, size_t size, size_t header_size, uint8_t turn, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static void encode_best(const uint8_t *data, uint32_t width, uint32_t height, const std::vector<struct enc_options> &candidates, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static void encode_effort(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf);
+    static double huffman_ns_per_symbol(uint32_t distinct);
+    static RowSource *open_rows(const uint8_t *data, size_t size, uint64_t base, const struct bounded_context *ctx, uint32_t *width, uint32_t *height, size_t *row_size);
     void load_encoded_data(std::fstream *fs, std::vector<uint8_t> *loaded);
 public:
     Codec();
     Codec(Image *);
     ~Codec();
 
-    void open_image(std::string img_path, uint32_t width);
+    void open_image(std::string img_path, uint32_t width, uint8_t depth = 8, uint8_t channels = 1);
     void open_image(std::string img_path);
     void save_raw(std::string out_path);
     void encode(std::string out_path, struct enc_options opts);
     void decode(std::string in_path, std::string out_path);
+    void decode_bounded(std::string in_path, std::string out_path, uint64_t max_memory);
+    const std::vector<uint64_t> &corrupt_blocks();
+
+    static void encode(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf = nullptr);
+    static void decode(const uint8_t *data, size_t size, std::vector<uint8_t> *out, uint32_t *width, uint32_t *height, struct codec_buffers *buf = nullptr, uint8_t *depth = nullptr, uint8_t *channels = nullptr);
+    static void decode_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, size_t capacity, uint32_t *width, uint32_t *height, struct codec_buffers *buf = nullptr);
+    static uint64_t decode_file(const uint8_t *data, size_t size, std::string out_path, struct codec_buffers *buf = nullptr);
+    static void info(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height, uint8_t *depth = nullptr, uint8_t *channels = nullptr);
+    static void encode_delta(const uint8_t *data, const uint8_t *reference, uint32_t width, uint32_t height, struct enc_options opts, std::vector<uint8_t> *out, struct codec_buffers *buf = nullptr);
+    static void decode_delta(const uint8_t *data, size_t size, const std::vector<uint8_t> *reference, std::vector<uint8_t> *out, uint32_t *width, uint32_t *height, struct codec_buffers *buf = nullptr);
+    static bool rotate(const uint8_t *data, size_t size, uint8_t turn, std::vector<uint8_t> *out, struct codec_buffers *buf = nullptr);
+    static uint64_t verify(const uint8_t *data, size_t size, std::vector<uint64_t> *bad);
+    static void estimate(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, std::vector<struct size_estimate> *out, uint32_t every = ESTIMATE_STRIDE);
+    static void pixel_statistics(const uint8_t *data, size_t size, struct pixel_stats *stats, struct codec_buffers *buf = nullptr);
+    static void symbol_histogram(const uint8_t *data, uint32_t width, uint32_t height, struct enc_options opts, uint64_t hist[256]);
 };
 
-#endif /* CODEC_HPP */
\ No newline at end of file
+#endif /* CODEC_HPP */
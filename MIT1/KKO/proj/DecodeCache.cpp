@@ -0,0 +1,538 @@
+/**
+ * Implementation of the DecodeCache class, a daemon, which decodes images
+ * for other processes on the same host and keeps the most recently used
+ * decoded images in memory.
+ *
+ * Clients connect to a Unix domain socket and send the file descriptor of
+ * an encoded image. The daemon reads and hashes the encoded image (or
+ * recognises a file it has already read) and, unless the same encoded
+ * image is in the cache, decodes it into a memfd, which is then sealed
+ * against any changes. As the hash is not cryptographic, a cached image
+ * is only used, if its encoded bytes are the same as those requested.
+ * The reply carries a descriptor of the memfd, which the client maps
+ * read-only, so the pixels are shared and never copied. When the cache
+ * grows over its capacity, the least recently used images are dropped
+ * (the clients keep the memory of those they still hold).
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "DecodeCache.hpp"
+#include "Checksum.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <new>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#define CACHE_DECODE 'd' // Request to decode the image sent along.
+
+static_assert(sizeof(struct cache_reply) == 24, "The cache reply must not have any padding.");
+
+/**
+ * Fill in the address of the socket at `path`.
+ * @throws const char * if the path is too long.
+ */
+static void socket_address(const std::string &path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr->sun_path)) {
+        throw "Cache daemon socket path is too long.";
+    }
+    memcpy(addr->sun_path, path.c_str(), path.length());
+}
+
+/**
+ * Send a message of `size` bytes and, unless `fd` is negative, the file
+ * descriptor `fd` along with it.
+ * @returns False if the message could not be sent.
+ */
+static bool send_message(int sock, const void *data, size_t size, int fd)
+{
+    struct iovec iov = {(void *) data, size};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+/**
+ * Receive a message of exactly `size` bytes and the file descriptor sent
+ * along with it, if any.
+ * @param fd pointer, via which the received descriptor (or -1) is returned.
+ * @returns False if the connection was closed or the message is malformed.
+ */
+static bool receive_message(int sock, void *data, size_t size, int *fd)
+{
+    struct iovec iov = {data, size};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t received;
+    do {
+        received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    for (struct cmsghdr *cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+            cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    if (received != (ssize_t) size || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Create the daemon listening on the socket `socket_path`. An existing
+ * socket at the path (e.g. of a daemon, which was killed) is replaced.
+ * @param socket_path path of the Unix domain socket.
+ * @param capacity decoded bytes kept in the cache at most.
+ */
+DecodeCache::DecodeCache(std::string socket_path, uint64_t capacity)
+{
+    this->socket_path = socket_path;
+    this->capacity = capacity;
+
+    struct sockaddr_un addr;
+    socket_address(socket_path, &addr);
+
+    this->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (this->listen_fd < 0) {
+        throw "Cache daemon socket could not be created.";
+    }
+    unlink(socket_path.c_str());
+    if (bind(this->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(this->listen_fd, SOMAXCONN) != 0) {
+        close(this->listen_fd);
+        throw "Cache daemon socket could not be created.";
+    }
+}
+
+DecodeCache::~DecodeCache()
+{
+    close(this->listen_fd);
+    unlink(this->socket_path.c_str());
+    for (auto &cached : this->lru) {
+        close(cached.fd);
+    }
+}
+
+/**
+ * Serve clients until the process is terminated. Up to CACHE_WORKERS
+ * clients are served at a time, each by one of the worker threads, the
+ * others wait to be accepted.
+ * @throws const char * if the socket stops accepting connections.
+ */
+void DecodeCache::run()
+{
+    std::vector<std::thread> workers;
+    for (int w = 1; w < CACHE_WORKERS; w++) {
+        workers.emplace_back(&DecodeCache::work, this);
+    }
+    work();
+    for (auto &t : workers) {
+        t.join();
+    }
+    throw "Cache daemon could not accept a connection.";
+}
+
+/**
+ * Accept and serve clients one at a time, until the socket stops accepting
+ * connections. The buffers of the worker are reused for all its clients.
+ */
+void DecodeCache::work()
+{
+    struct codec_buffers buf;
+    std::vector<uint8_t> encoded;
+    const struct timeval idle = {CACHE_IDLE_SECONDS, 0};
+
+    for (;;) {
+        const int client = accept4(this->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client >= 0) {
+            // An idle client must not keep the worker from other clients.
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+            serve(client, &buf, &encoded);
+        } else if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) {
+            return;
+        }
+    }
+}
+
+/**
+ * Read the whole file `fd` of `size` bytes into `data`. The file is read,
+ * not mapped, so that a client truncating it cannot fault the daemon.
+ * @returns False if the file could not be read whole.
+ */
+static bool read_file(int fd, size_t size, std::vector<uint8_t> *data)
+{
+    try
+    {
+        data->resize(size);
+    }
+    catch(const std::bad_alloc &e)
+    {
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pread(fd, data->data() + done, size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Serve the requests of one client until it disconnects.
+ * @param client the connected socket.
+ * @param buf the intermediate buffers of the worker.
+ * @param encoded the buffer of the worker, into which images are read.
+ */
+void DecodeCache::serve(int client, struct codec_buffers *buf, std::vector<uint8_t> *encoded)
+{
+    uint8_t command;
+    int enc_fd;
+
+    while (receive_message(client, &command, sizeof(command), &enc_fd)) {
+        struct cache_reply info;
+        int fd = -1;
+
+        struct stat file;
+        uint64_t key, serial = 0;
+        const bool valid = command == CACHE_DECODE && enc_fd >= 0
+            && fstat(enc_fd, &file) == 0 && file.st_size > 0;
+        if (valid && known_file(&file, &key, &serial)) {
+            fd = lookup(key, nullptr, 0, &serial, &info);
+        }
+
+        // Not known or not cached, the file has to be read.
+        const bool read = valid && fd < 0 && read_file(enc_fd, file.st_size, encoded);
+        if (enc_fd >= 0) {
+            close(enc_fd);
+        }
+        if (read) {
+            const uint8_t *data = encoded->data();
+            const size_t size = encoded->size();
+            key = content_hash(data, size);
+            fd = lookup(key, data, size, &serial, &info);
+            if (fd < 0) {
+                try
+                {
+                    fd = insert(key, data, size, decode(data, size, &info, buf), &info, &serial);
+                }
+                catch(const char *e)
+                {
+                    std::cerr << "Cache daemon: " << e << '\n';
+                }
+                catch(const std::bad_alloc &e)
+                {
+                    std::cerr << "Cache daemon: Not enough memory to decode the image.\n";
+                }
+            }
+            if (serial != 0) {
+                remember_file(&file, key, serial);
+            }
+        }
+
+        // Nothing of a failed decode is sent back.
+        if (fd < 0) {
+            info = cache_reply();
+        }
+        info.status = fd >= 0 ? 0 : 1;
+        const bool sent = send_message(client, &info, sizeof(info), fd);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!sent) {
+            break;
+        }
+    }
+
+    close(client);
+}
+
+/**
+ * Returns true and the content hash and serial number of the entry with
+ * the file's content via `key` and `serial`, if the file was read before
+ * and has not changed since (by its size and modification times).
+ * @param file the status of the encoded image file.
+ */
+bool DecodeCache::known_file(const struct stat *file, uint64_t *key, uint64_t *serial)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto found = this->files.find({file->st_dev, file->st_ino});
+    if (found == this->files.end()
+            || found->second.size != (uint64_t) file->st_size
+            || found->second.mtime_ns != file->st_mtim.tv_sec * 1000000000ll + file->st_mtim.tv_nsec
+            || found->second.ctime_ns != file->st_ctim.tv_sec * 1000000000ll + file->st_ctim.tv_nsec) {
+        return false;
+    }
+    *key = found->second.key;
+    *serial = found->second.serial;
+    return true;
+}
+
+/**
+ * Remember the entry with the content of a file. When CACHE_FILES files
+ * are known, they are all forgotten.
+ * @param file the status of the encoded image file.
+ * @param key content hash of the file.
+ * @param serial serial number of the entry with the file's content.
+ */
+void DecodeCache::remember_file(const struct stat *file, uint64_t key, uint64_t serial)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->files.size() >= CACHE_FILES) {
+        this->files.clear();
+    }
+    this->files[{file->st_dev, file->st_ino}] = {
+        (uint64_t) file->st_size,
+        file->st_mtim.tv_sec * 1000000000ll + file->st_mtim.tv_nsec,
+        file->st_ctim.tv_sec * 1000000000ll + file->st_ctim.tv_nsec,
+        key,
+        serial
+    };
+}
+
+/**
+ * Look the encoded image up in the cache and mark it as most recently used.
+ * A cached image with the same hash is only used, if its encoded bytes are
+ * the same as `data`, or (without `data`) if it is the entry `*serial`.
+ * @param key content hash of the encoded image.
+ * @param data the encoded image, nullptr to look the entry `*serial` up.
+ * @param size size of `data` in bytes.
+ * @param serial pointer, via which the serial number of the entry is
+ * returned (or passed, without `data`).
+ * @param info pointer, via which the decoded image is described.
+ * @returns A new descriptor of the decoded image, -1 if it is not cached.
+ */
+int DecodeCache::lookup(uint64_t key, const uint8_t *data, size_t size, uint64_t *serial, struct cache_reply *info)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto found = this->index.find(key);
+    if (found == this->index.end()) {
+        return -1;
+    }
+    const struct entry &cached = *(found->second);
+    if (data == nullptr ? cached.serial != *serial
+            : cached.encoded.size() != size || memcmp(cached.encoded.data(), data, size) != 0) {
+        return -1;
+    }
+
+    this->lru.splice(this->lru.begin(), this->lru, found->second);
+    *serial = cached.serial;
+    *info = cached.info;
+    return fcntl(cached.fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/**
+ * Add a decoded image to the cache, dropping the least recently used images
+ * to make room for it. Both the decoded and the encoded image (kept to be
+ * compared on lookups) count towards the capacity. Images larger than the
+ * whole cache are not cached.
+ * @param data the encoded image, copied into the cache.
+ * @param size size of `data` in bytes.
+ * @param fd the sealed memfd of the decoded image, owned by the cache from
+ * now on.
+ * @param serial pointer, via which the serial number of the new entry is
+ * returned (0 if the image is not cached).
+ * @returns A new descriptor of the decoded image.
+ */
+int DecodeCache::insert(uint64_t key, const uint8_t *data, size_t size, int fd, const struct cache_reply *info, uint64_t *serial)
+{
+    *serial = 0;
+    const uint64_t cost = info->size + size;
+    if (cost > this->capacity) {
+        return fd;
+    }
+    std::vector<uint8_t> encoded(data, data + size);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->index.count(key) > 0) {
+        // Not cached (decoded meanwhile by another client, or another
+        // image of the same hash is cached).
+        return fd;
+    }
+
+    while (this->bytes + cost > this->capacity) {
+        const struct entry &last = this->lru.back();
+        this->bytes -= last.info.size + last.encoded.size();
+        this->index.erase(last.key);
+        close(last.fd);
+        this->lru.pop_back();
+    }
+
+    *serial = this->next_serial++;
+    this->lru.push_front({key, *serial, std::move(encoded), fd, *info});
+    this->index[key] = this->lru.begin();
+    this->bytes += cost;
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+/**
+ * Decode an encoded image into a new memfd and seal it.
+ * @param info pointer, via which the decoded image is described.
+ * @param buf the intermediate buffers of the calling thread.
+ * @returns The memfd.
+ */
+int DecodeCache::decode(const uint8_t *data, size_t size, struct cache_reply *info, struct codec_buffers *buf)
+{
+    uint32_t width, height;
+    uint8_t depth, channels;
+    Codec::info(data, size, &width, &height, &depth, &channels);
+    const uint64_t row_size = (uint64_t) width * channels * (depth / 8);
+    const uint64_t out_size = row_size * height;
+
+    const int fd = memfd_create("huff_cache", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        throw "Cache memory could not be allocated.";
+    }
+    if (ftruncate(fd, out_size) != 0) {
+        close(fd);
+        throw "Cache memory could not be allocated.";
+    }
+
+    void *map = out_size > 0
+        ? mmap(nullptr, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+        : nullptr;
+    if (map == MAP_FAILED) {
+        close(fd);
+        throw "Cache memory could not be allocated.";
+    }
+    try
+    {
+        Codec::decode_into(data, size, (uint8_t *) map, row_size, out_size, &width, &height, buf);
+    }
+    catch(...)
+    {
+        if (map != nullptr) {
+            munmap(map, out_size);
+        }
+        close(fd);
+        throw;
+    }
+    if (map != nullptr) {
+        munmap(map, out_size);
+    }
+
+    // No writable mappings are left, so the memfd can be sealed read-only.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        close(fd);
+        throw "Cache memory could not be sealed.";
+    }
+
+    info->width = width;
+    info->height = height;
+    info->depth = depth;
+    info->channels = channels;
+    info->size = out_size;
+    return fd;
+}
+
+/**
+ * Connect to the cache daemon.
+ * @param socket_path path of the daemon's socket.
+ * @returns The connected socket, to be closed by the caller.
+ */
+int DecodeCache::connect(std::string socket_path)
+{
+    struct sockaddr_un addr;
+    socket_address(socket_path, &addr);
+
+    const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw "Cache daemon could not be reached.";
+    }
+    if (::connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        throw "Cache daemon could not be reached.";
+    }
+    return sock;
+}
+
+/**
+ * Have the cache daemon decode an encoded image and map the decoded image.
+ * Release it with DecodeCache::release().
+ * @param sock socket connected with DecodeCache::connect().
+ * @param enc_fd descriptor of the encoded image file.
+ * @param img pointer, via which the mapped image is returned.
+ */
+void DecodeCache::request(int sock, int enc_fd, struct cached_image *img)
+{
+    const uint8_t command = CACHE_DECODE;
+    if (!send_message(sock, &command, sizeof(command), enc_fd)) {
+        throw "Cache daemon could not be reached.";
+    }
+
+    struct cache_reply info;
+    int fd;
+    if (!receive_message(sock, &info, sizeof(info), &fd)) {
+        throw "Cache daemon could not be reached.";
+    }
+    if (info.status != 0 || fd < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        throw "Cache daemon could not decode the image.";
+    }
+
+    void *map = info.size > 0 ? mmap(nullptr, info.size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+    close(fd);
+    if (map == MAP_FAILED) {
+        throw "Decoded image could not be mapped.";
+    }
+    img->data = (const uint8_t *) map;
+    img->info = info;
+}
+
+/**
+ * Unmap an image returned by DecodeCache::request().
+ */
+void DecodeCache::release(struct cached_image *img)
+{
+    if (img->data != nullptr) {
+        munmap((void *) img->data, img->info.size);
+    }
+    img->data = nullptr;
+}
@@ -0,0 +1,107 @@
+/**
+ * Header for the DecodeCache class.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef DECODECACHE_HPP
+#define DECODECACHE_HPP
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+#include "Codec.hpp"
+
+#define CACHE_SIZE_MB 256 // Decoded megabytes kept by the cache daemon (by default).
+#define CACHE_FILES 65536 // Files, whose content hashes the cache daemon remembers.
+#define CACHE_WORKERS 16 // Clients served by the cache daemon at a time.
+#define CACHE_IDLE_SECONDS 30 // Idle time, after which a client is disconnected.
+
+/**
+ * Reply of the cache daemon to a decode request. On success, it comes with
+ * the file descriptor of the decoded image. The reply is sent as it is in
+ * memory, so it has no padding, all its bytes are initialized.
+ */
+struct cache_reply
+{
+    uint32_t status = 1;   //!< 0 on success.
+    uint32_t width = 0;    //!< Width of the decoded image.
+    uint32_t height = 0;   //!< Height of the decoded image.
+    uint8_t depth = 8;     //!< Bits per channel, 8 or 16.
+    uint8_t channels = 1;  //!< Interleaved channels per pixel.
+    uint8_t reserved[2] = {0, 0}; //!< Zeros, in place of padding.
+    uint64_t size = 0;     //!< Size of the decoded image in bytes.
+};
+
+/**
+ * An image decoded by the cache daemon, mapped read-only by the client.
+ */
+struct cached_image
+{
+    const uint8_t *data = nullptr; //!< The raw pixels (nullptr if empty).
+    struct cache_reply info;       //!< Dimensions and pixel format.
+};
+
+class DecodeCache
+{
+private:
+    /**
+     * A decoded image in the cache.
+     */
+    struct entry
+    {
+        uint64_t key;      //!< Content hash of the encoded image.
+        uint64_t serial;   //!< Number of the entry, unique for the daemon's lifetime.
+        std::vector<uint8_t> encoded; //!< The encoded image, to confirm a matching hash.
+        int fd;            //!< Sealed memfd holding the raw pixels.
+        struct cache_reply info;
+    };
+
+    /**
+     * Identity of a version of an encoded image file, under which the entry
+     * with its content is remembered, so that files are not read to be
+     * hashed and compared again on every request.
+     */
+    struct file_version
+    {
+        uint64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint64_t key;
+        uint64_t serial;
+    };
+
+    std::list<struct entry> lru; //!< Most recently used first.
+    std::unordered_map<uint64_t, std::list<struct entry>::iterator> index;
+    std::map<std::pair<uint64_t, uint64_t>, struct file_version> files; //!< By device and inode.
+    uint64_t bytes = 0;
+    uint64_t capacity;
+    uint64_t next_serial = 1;
+    std::mutex mutex;
+    std::string socket_path;
+    int listen_fd = -1;
+
+    bool known_file(const struct stat *file, uint64_t *key, uint64_t *serial);
+    void remember_file(const struct stat *file, uint64_t key, uint64_t serial);
+    int lookup(uint64_t key, const uint8_t *data, size_t size, uint64_t *serial, struct cache_reply *info);
+    int insert(uint64_t key, const uint8_t *data, size_t size, int fd, const struct cache_reply *info, uint64_t *serial);
+    static int decode(const uint8_t *data, size_t size, struct cache_reply *info, struct codec_buffers *buf);
+    void work();
+    void serve(int client, struct codec_buffers *buf, std::vector<uint8_t> *encoded);
+public:
+    DecodeCache(std::string socket_path, uint64_t capacity);
+    ~DecodeCache();
+
+    void run();
+
+    static int connect(std::string socket_path);
+    static void request(int sock, int enc_fd, struct cached_image *img);
+    static void release(struct cached_image *img);
+};
+
+#endif /* DECODECACHE_HPP */
@@ -7,6 +7,7 @@
  * File created: 03.05.2021
  */
 #include "Huffman.hpp"
+#include "Stats.hpp"
 
 #define LEFT_CHILD 1
 #define RIGHT_CHILD 2
@@ -18,10 +19,51 @@ Huffman::Huffman()
     init_tree();
 }
 
+/**
+ * Copy constructor. Copies the tree of `other`, so a primed
+ * tree can be prepared once and then copied for every image.
+ */
+Huffman::Huffman(const Huffman &other)
+{
+    *this = other;
+}
+
+/**
+ * Replace this tree with a copy of the tree of `other`. Only the used part
+ * of the node arena is copied, after which all pointers are rebased from
+ * `other`'s arena to this one.
+ */
+Huffman &Huffman::operator=(const Huffman &other)
+{
+    if (this == &other) {
+        return *this;
+    }
+
+    auto rebase = [this, &other](HuffmanNode *node) -> HuffmanNode * {
+        return node == nullptr ? nullptr : this->arena + (node - other.arena);
+    };
+
+    this->arena_used = other.arena_used;
+    for (uint16_t i = 0; i < this->arena_used; i++) {
+        HuffmanNode *node = &(this->arena[i]);
+        *node = other.arena[i];
+        node->parent = rebase(node->parent);
+        node->left = rebase(node->left);
+        node->right = rebase(node->right);
+    }
+
+    for (int i = 0; i < SYMBOL_SET_SIZE; i ++) {
+        this->nodes[i] = rebase(other.nodes[i]);
+    }
+    this->tree = rebase(other.tree);
+    this->nyt = rebase(other.nyt);
+    this->fresh = other.fresh;
+
+    return *this;
+}
+
 Huffman::~Huffman()
 {
-    delete_tree(this->tree);
-    this->tree = nullptr;
 }
 
 /**
@@ -35,14 +77,15 @@ Huffman::~Huffman()
  * @throws ERR_LARGE_KEY when a key over 255 is given that is not the EOF_KEY.
  * @param key the key to be inserted (values 0-255 for pixels or EOF_KEY
  * when EOF should be encoded).
- * @param bits pointer to a bool vector, to which the Adaptive Huffman
+ * @param bits pointer to a bit writer, to which the Adaptive Huffman
  * code for `key` will be appended.
  */
-void Huffman::insert(const uint16_t key, std::vector<bool> *bits) {
+void Huffman::insert(const uint16_t key, BitWriter *bits) {
     if (key > 255 && key != EOF_KEY) {
         // Only values 0-255 are valid + the EOF key.
         throw ERR_LARGE_KEY;
     }
+    this->fresh = false;
 
     // Check if `key` is already in tree.
     HuffmanNode *found = find_node(key);
@@ -55,6 +98,7 @@ void Huffman::insert(const uint16_t key, std::vector<bool> *bits) {
     }
 
     // Pointer to NYT should never change.
+    STATS_INC(nyt_escapes);
     HuffmanNode *new_node = split_nyt(this->nyt, key);
 
     if (new_node != this->tree) {
@@ -63,45 +107,91 @@ void Huffman::insert(const uint16_t key, std::vector<bool> *bits) {
 }
 
 /**
- * Decode encoded data represented by a bool vector "bitstream" `bits`.
- * The decoded values are appended to `data`. If an EOF code is reached,
- * then the decoder stops and does not decode the rest of the code stream
- * (all codes before EOF are decoded, but not after).
+ * Decode encoded data `code` of `size` bytes. The bits are read from the MSb
+ * to the LSb of each byte. The decoded values are appended to `data`.
+ * If an EOF code is reached, then the decoder stops and does not decode
+ * the rest of the code stream (all codes before EOF are decoded, but not
+ * after). Decoding also stops if the code stream ends in the middle of a code.
  * Exceptions ERR_NON_EMPTY_TREE or ERR_FIRST_BIT_NOT_0 may be thrown.
- * @param bits pointer to code bitstream represented by a bool vector.
+ * @param code pointer to the code bitstream.
+ * @param size size of the code bitstream in bytes.
  * @param data pointer to vector, to which to append decoded data.
  * @throws ERR_NON_EMPTY_TREE Thrown when a non-empty instance of the Huffman
  * tree class is attempted to be used for decoding.
- * @throws ERR_FIRST_BIT_NOT_0 If the first bit of the input bitstream `bits`
+ * @throws ERR_FIRST_BIT_NOT_0 If the first bit of the input bitstream
  * is not a 0.
  */
-void Huffman::decode(std::vector<bool> *bits, std::vector<uint8_t> *data)
+void Huffman::decode(const uint8_t *code, size_t size, std::vector<uint8_t> *data)
 {
-    // The decoder tree must be an empty tree.
-    if (this->tree->left != nullptr || this->tree->right != nullptr) {
+    size_t pos = decode_begin(code, size);
+    decode_some(code, size, &pos, data, SIZE_MAX);
+}
+
+/**
+ * Start decoding encoded data `code` of `size` bytes piece by piece with
+ * Huffman::decode_some(), so that the decoded data need not be held all
+ * at once. Throws as Huffman::decode() does.
+ * @param code pointer to the code bitstream.
+ * @param size size of the code bitstream in bytes.
+ * @return the position of the first code in the bitstream (in bits).
+ */
+size_t Huffman::decode_begin(const uint8_t *code, size_t size)
+{
+    // The decoder tree must be an empty (or freshly primed) tree.
+    if (!this->fresh) {
         throw ERR_NON_EMPTY_TREE;
     }
+    this->fresh = false;
 
-    if ((*bits)[0] != (bool) 0) {
+    // A primed tree has a real NYT code, which is read as any other code.
+    const bool empty = this->tree->key == NYT_KEY;
+    if (size == 0 || (empty && (code[0] & 128))) {
         throw ERR_FIRST_BIT_NOT_0;
     }
 
     // Start from pos = 1, because position 0 should always have
-    // a "0" initial NYT code.
-    size_t pos = 1; // Position in the `bits` vector.
-    const size_t bits_size = bits->size();
+    // a "0" initial NYT code (when starting from an empty tree).
+    return empty ? 1 : 0;
+}
+
+/**
+ * Decode at most `max` more values of the bitstream started with
+ * Huffman::decode_begin() and append them to `data`.
+ * @param code pointer to the code bitstream.
+ * @param size size of the code bitstream in bytes.
+ * @param pos pointer to the position in the bitstream (in bits), which
+ * is moved past the decoded codes.
+ * @param data pointer to vector, to which to append decoded data.
+ * @param max the most values to decode.
+ * @return false if the bitstream ended (or reached EOF), true if more
+ * values may follow.
+ */
+bool Huffman::decode_some(
+    const uint8_t *code, size_t size, size_t *pos, std::vector<uint8_t> *data, size_t max)
+{
+    auto bit = [code](size_t pos) -> bool {
+        return (code[pos >> 3] >> (7 - (pos & 7))) & 1;
+    };
+
+    const size_t bits_size = size * 8;
+    size_t p = *pos; // Position in the bitstream.
 
     HuffmanNode *current;
     uint8_t pixel = 0;
-    while (true) {
+    for (size_t decoded = 0; decoded < max; decoded++) {
         current = this->tree; // Go to root.
 
         // Navigate to external node based on incoming code.
         while (current->left != nullptr) {//External nodes don't have children.
+            if (p >= bits_size) {
+                // Truncated code stream.
+                *pos = p;
+                return false;
+            }
             // If true (1) go right, false (0) go left.
-            (*bits)[pos] ?
+            bit(p) ?
                 current = current->right : current = current->left;
-            pos++;
+            p++;
         }
 
         if (current->key == NYT_KEY) {
@@ -109,23 +199,30 @@ void Huffman::decode(std::vector<bool> *bits, std::vector<uint8_t> *data)
             pixel = 0;
             uint8_t mask = 128;
 
+            if (p + 9 > bits_size) {
+                // Truncated code stream.
+                *pos = p;
+                return false;
+            }
+
             // If EOF, then the first bit after NYT code is set.
             // This is because after NYT 9 bit codes are sent - lower 8 for
             // pixel values and the MSB as an EOF flag.
-            if ((*bits)[pos]) {
+            if (bit(p)) {
                 // EOF
-                return;
+                *pos = p;
+                return false;
             }
-            pos++;
+            p++;
 
-            for (size_t i = 0; i < 8; i++, pos++) {
-                // There is probably a better way...
-                if ((*bits)[pos]) {
-                    pixel += mask;
+            for (size_t i = 0; i < 8; i++, p++) {
+                if (bit(p)) {
+                    pixel |= mask;
                 }
                 mask = mask >> 1;
             }
             data->push_back(pixel);
+            STATS_INC(nyt_escapes);
 
             // Make a new node with new pixel value as key.
             HuffmanNode *new_node = split_nyt(this->nyt, pixel);
@@ -138,45 +235,67 @@ void Huffman::decode(std::vector<bool> *bits, std::vector<uint8_t> *data)
             rebalance_tree(current);
         }
 
-        if (pos >= bits_size) {
+        if (p >= bits_size) {
             // All bits read, exit.
-            break;
+            *pos = p;
+            return false;
         }
     }
+    *pos = p;
+    return true;
 }
 
 /**
  * Reset the Huffman tree to its initial state (a single NYT node
- * in the tree). This deletes the original tree!
+ * in the tree). This only rewinds the node arena, no memory is freed
+ * or allocated, so the instance may be reused for any number of images.
  */
 void Huffman::reset_tree()
 {
-    delete_tree(this->tree);
-    this->tree = nullptr;
-
     init_tree();
 }
 
+/**
+ * Prime an empty tree with symbol frequencies, so that symbols expected
+ * to appear do not have to be sent as NYT + raw value first. The symbols are
+ * inserted in ascending order, each `freq[symbol]` times, which keeps
+ * the tree a valid FGK tree. The encoder and the decoder must be primed with
+ * identical frequencies.
+ * @param freq frequencies of the 256 symbols (0 if not to be inserted).
+ */
+void Huffman::prime(const uint16_t freq[256])
+{
+    // The generated codes are not needed.
+    std::vector<uint8_t> discarded;
+    BitWriter bits(&discarded);
+
+    for (uint16_t key = 0; key < 256; key++) {
+        for (uint16_t i = 0; i < freq[key]; i++) {
+            insert(key, &bits);
+            discarded.clear();
+        }
+    }
+    this->fresh = true;
+}
+
 /**
  * Appends an Adaptive Huffman code of key `key` to `bits`. The `node` contains
  * the `key`, for which to calculate the Adaptive Huffman code. If `node`
  * is a nullptr, then it is assumed, that `key` is not in the Huffman tree
  * and therefore, the NYT code + the raw (non-huffman) 8-bit pixel value
  * for `key` is appended to `bits`.
- * @note NOTE: The vector<bool> may or may not be space efficient. Depends on vector
- * implementation.
  * @param node pointer to a node, which contains `key`.
  * @param key the value of the key.
- * @param bits pointer to bool vector that hold the coded bits.
+ * @param bits pointer to bit writer that holds the coded bits.
  */
-void Huffman::get_code(HuffmanNode *node, const uint16_t key, std::vector<bool> *bits)
+void Huffman::get_code(HuffmanNode *node, const uint16_t key, BitWriter *bits)
 {
     if (node == nullptr) {
         // First appearance of `key`
 
         if (this->tree->key == NYT_KEY) {
             // Only NYT is in the tree, start with a 0.
-            bits->push_back(0);
+            bits->put(0);
         } else {
             // NYT has a path with a code - find NYT and get its code.
             code_for_node(this->nyt, bits);
@@ -189,7 +308,7 @@ void Huffman::get_code(HuffmanNode *node, const uint16_t key, std::vector<bool>
         // and the remaining 8 bits for pixel value).
         for (int i = 8; i >= 0; i--) {
             bool bit = key & (mask << i);
-            bits->push_back(bit);
+            bits->put(bit);
         }
         return;
     }
@@ -197,24 +316,25 @@ void Huffman::get_code(HuffmanNode *node, const uint16_t key, std::vector<bool>
     code_for_node(node, bits);
 }
 
-/** Appends a Huffman code for `node` to vector `bits`.
+/** Appends a Huffman code for `node` to `bits`.
  * @param node pointer to node, for which to append the Huffman code.
- * @param bits pointer to vector, to which to append the code.
+ * @param bits pointer to bit writer, to which to append the code.
  */
-void Huffman::code_for_node(HuffmanNode *node, std::vector<bool> *bits)
+void Huffman::code_for_node(HuffmanNode *node, BitWriter *bits)
 {
     // Crawl upward from the node containing `key` and build
-    // the Huffman code backwards.
-    std::vector<bool> bits_reversed;
+    // the Huffman code backwards. No path is longer than the node count.
+    bool bits_reversed[2 * SYMBOL_SET_SIZE];
+    size_t len = 0;
     while (node != nullptr) {
         const int8_t child_side = which_child(node->parent, node);
         switch (child_side)
         {
         case LEFT_CHILD:
-            bits_reversed.push_back(0);
+            bits_reversed[len++] = 0;
             break;
         case RIGHT_CHILD:
-            bits_reversed.push_back(1);
+            bits_reversed[len++] = 1;
             break;
         case NULL_PARENT:
             // TODO check if some behavior should be set for these...
@@ -226,9 +346,10 @@ void Huffman::code_for_node(HuffmanNode *node, std::vector<bool> *bits)
         node = node->parent;
     }
 
-    // Reverse to correct order and append to `bits`.
-    std::reverse(bits_reversed.begin(), bits_reversed.end());
-    bits->insert(bits->end(), bits_reversed.begin(), bits_reversed.end());
+    // Append to `bits` in the correct order.
+    while (len > 0) {
+        bits->put(bits_reversed[--len]);
+    }
 }
 
 /**
@@ -241,8 +362,8 @@ void Huffman::code_for_node(HuffmanNode *node, std::vector<bool> *bits)
  */
 HuffmanNode *Huffman::split_nyt(HuffmanNode *nyt, const uint16_t key)
 {
-    HuffmanNode *right = new HuffmanNode(key, 1, nyt->node_num - 1);
-    HuffmanNode *new_node = new HuffmanNode(NOT_LEAF, 0, nyt->node_num, nyt->parent, nyt, right);
+    HuffmanNode *right = this->new_node(HuffmanNode(key, 1, nyt->node_num - 1));
+    HuffmanNode *new_node = this->new_node(HuffmanNode(NOT_LEAF, 0, nyt->node_num, nyt->parent, nyt, right));
 
     const int8_t child = which_child(nyt->parent, nyt);
     if (child == LEFT_CHILD) {
@@ -324,42 +445,40 @@ void Huffman::rebalance_tree(HuffmanNode *current)
 }
 
 /**
- * Searches for nodes, that have frequency `freq` and adds them to
- * the vector `nodes`. Searches recursively downward from node `current`.
+ * Searches for the node with the highest node number among nodes, that have
+ * frequency `freq`. Searches recursively downward from node `current`.
  * The `current` node should therefore be the root node upon first call.
  * @param current pointer to  node which is currently being checked (first call
  * to this function should have this param set as the tree root).
- * @param freq the frequency, based on which the nodes should be added
- * to `nodes`.
- * @param nodes is the vector, to which pointers to nodes with frequency `freq`
- * will be pushed.
- * @param node_num number (index) of the node, for which we are trying to find
- * a pair, with which to swap places.
+ * @param freq the frequency, based on which the nodes are considered.
+ * @param exclude a node that must never be picked (the parent of the node,
+ * for which we are trying to find a pair, with which to swap places).
+ * @param best pointer to the best node found so far. It must point to
+ * the node, for which we are trying to find a pair, upon first call.
  */
 void Huffman::get_nodes_by_freq(
     HuffmanNode *current, const uint32_t freq,
-    std::vector<HuffmanNode *> *nodes, const uint16_t node_num)
+    HuffmanNode *exclude, HuffmanNode **best)
 {
     // TODO this method significantly slows down the encoding/decoding
     if (current == nullptr) {
         return;
     }
 
-    // If the node number is below the one we are attempting to find a pair for
-    // in Huffman::highest_number_node_in_block(), then there is no need to
-    // search further.
-    if (current->node_num < node_num) {
+    // If the node number is below the best one found so far, then neither
+    // this node, nor its subtree (numbered lower) can be better.
+    if (current->node_num < (*best)->node_num) {
         return;
     }
 
-    // Suitable node, push it to vector.
-    if (current->freq == freq) {
-        nodes->push_back(current);
+    // Suitable node, remember it.
+    if (current->freq == freq && current != exclude) {
+        *best = current;
     }
 
     // Recurse to subtrees
-    get_nodes_by_freq(current->left, freq, nodes, node_num);
-    get_nodes_by_freq(current->right, freq, nodes, node_num);
+    get_nodes_by_freq(current->left, freq, exclude, best);
+    get_nodes_by_freq(current->right, freq, exclude, best);
 }
 
 /**
@@ -375,27 +494,11 @@ void Huffman::get_nodes_by_freq(
 HuffmanNode *Huffman::highest_number_node_in_block(
     HuffmanNode *current, const uint32_t block_freq)
 {
-    std::vector<HuffmanNode *> nodes;
-    get_nodes_by_freq(this->tree, block_freq, &nodes, current->node_num);
-
-    std::sort(nodes.begin(), nodes.end(),
-        [](const HuffmanNode * a, const HuffmanNode * b)
-        {
-            return a->node_num > b->node_num;
-        });
-
-    if (nodes.size() == 1) {
-        // Only one in block, therefore this is the
-        // highest numbered node in block.
-        return nodes[0];
-    }
-
-    if (nodes[0] == current->parent) {
-        // Must never return parent.
-        return nodes[1];
-    }
+    // Must never return parent.
+    HuffmanNode *best = current;
+    get_nodes_by_freq(this->tree, block_freq, current->parent, &best);
 
-    return nodes[0];
+    return best;
 }
 
 /**
@@ -405,6 +508,7 @@ HuffmanNode *Huffman::highest_number_node_in_block(
  */
 void Huffman::swap(HuffmanNode *a, HuffmanNode *b)
 {
+    STATS_INC(swaps);
     int8_t a_child_side = which_child(a->parent, a);
     int8_t b_child_side = which_child(b->parent, b);
 
@@ -507,8 +611,10 @@ void Huffman::swap_with_root(HuffmanNode *node)
  */
 void Huffman::init_tree()
 {
-    this->tree = new HuffmanNode(NYT_KEY, 0);
+    this->arena_used = 0;
+    this->tree = new_node(HuffmanNode(NYT_KEY, 0));
     this->nyt = this->tree;
+    this->fresh = true;
 
     // By default no keys are in the tree, therefore no node
     // for the corresponding keys.
@@ -517,16 +623,23 @@ void Huffman::init_tree()
     }
 }
 
-void Huffman::delete_tree(HuffmanNode *node)
+/**
+ * Take the next free node from the node arena.
+ * @param init the initial value of the node.
+ * @returns Pointer to the new node.
+ * @throws ERR_ARENA_FULL if all nodes are taken (which can not happen
+ * with at most SYMBOL_SET_SIZE - 1 distinct symbols and a NYT node).
+ */
+HuffmanNode *Huffman::new_node(const HuffmanNode &init)
 {
-    if (node == nullptr) {
-        return;
+    if (this->arena_used >= ARENA_SIZE) {
+        throw ERR_ARENA_FULL;
     }
 
-    delete_tree(node->left);
-    delete_tree(node->right);
-
-    delete node;
+    HuffmanNode *node = &(this->arena[this->arena_used]);
+    this->arena_used++;
+    *node = init;
+    return node;
 }
 
 // TODO THESE ARE ONLY FOR DEBUGGING PURPOSES
@@ -20,14 +20,18 @@
 #define NOT_LEAF 400
 #define SYMBOL_SET_SIZE 258 // The maximum number of symbols the tree will
                             // hold. 256 pixel values + 1 NYT node + EOF node.
+#define ARENA_SIZE (2 * SYMBOL_SET_SIZE) // Max. number of nodes in a tree.
 
 
 // These ERR codes are used in Huffman::decode() as exceptions.
 #define ERR_NON_EMPTY_TREE 1 // Tree not empty. Use only empty tree for decode.
 #define ERR_FIRST_BIT_NOT_0 2 // First bit of code bitstream is not 0.
 #define ERR_LARGE_KEY 3
+#define ERR_ARENA_FULL 4 // No free node left in the node arena.
 
 struct HuffmanNode {
+    HuffmanNode() {}
+
     HuffmanNode(uint16_t k, uint32_t f, uint16_t n) :
         key(k),
         freq(f),
@@ -59,34 +63,77 @@ struct HuffmanNode {
     struct HuffmanNode *right = nullptr;
 };
 
+/**
+ * Appends single bits to a byte vector, from the MSb to the LSb of each byte.
+ */
+struct BitWriter {
+    BitWriter(std::vector<uint8_t> *o) : out(o) {}
+
+    /** Append a single bit. */
+    void put(bool bit)
+    {
+        if (bit) {
+            byte |= mask;
+        }
+        mask >>= 1;
+        if (mask == 0) {
+            out->push_back(byte);
+            byte = 0;
+            mask = 128;
+        }
+    }
+
+    /** Pad the last byte with zeros and append it, if it was started. */
+    void flush()
+    {
+        if (mask != 128) {
+            out->push_back(byte);
+            byte = 0;
+            mask = 128;
+        }
+    }
+
+    std::vector<uint8_t> *out; //!< The vector, to which bytes are appended.
+    uint8_t byte = 0; //!< The byte currently being filled.
+    uint8_t mask = 128; //!< Mask of the next bit to be set in `byte`.
+};
+
 class Huffman
 {
 private:
     HuffmanNode *nodes[SYMBOL_SET_SIZE];
     HuffmanNode *tree, *nyt;
+    HuffmanNode arena[ARENA_SIZE]; //!< Storage of all nodes of the tree.
+    uint16_t arena_used; //!< Number of nodes taken from `arena`.
     std::vector<uint8_t> keys;
+    bool fresh; //!< True until the first symbol is inserted or decoded.
 
-    void get_code(HuffmanNode *node, const uint16_t key, std::vector<bool> *bits);
-    void code_for_node(HuffmanNode *node, std::vector<bool> *bits);
+    void get_code(HuffmanNode *node, const uint16_t key, BitWriter *bits);
+    void code_for_node(HuffmanNode *node, BitWriter *bits);
     HuffmanNode *split_nyt(HuffmanNode *nyt, const uint16_t key);
     HuffmanNode *find_node(const uint16_t key);
-    void get_nodes_by_freq(HuffmanNode *current, const uint32_t freq, std::vector<HuffmanNode *> *nodes, const uint16_t node_num);
+    void get_nodes_by_freq(HuffmanNode *current, const uint32_t freq, HuffmanNode *exclude, HuffmanNode **best);
     int8_t which_child(HuffmanNode *parent, HuffmanNode *child);
     void rebalance_tree(HuffmanNode *current);
     HuffmanNode *highest_number_node_in_block(HuffmanNode *current, const uint32_t block_freq);
     void swap(HuffmanNode *a, HuffmanNode *b);
     void swap_with_root(HuffmanNode *node);
     void init_tree();
-    void delete_tree(HuffmanNode *node);
+    HuffmanNode *new_node(const HuffmanNode &init);
 
     // TODO DEBUGGING FUNCTIONS - DELETE
     void getVerticalOrder(HuffmanNode* root, int hd, std::map<int, std::vector<HuffmanNode *>> &m);
 public:
     Huffman();
+    Huffman(const Huffman &other);
+    Huffman &operator=(const Huffman &other);
     ~Huffman();
-    void insert(uint16_t key, std::vector<bool> *bits);
-    void decode(std::vector<bool> *bits, std::vector<uint8_t> *data);
+    void insert(uint16_t key, BitWriter *bits);
+    void decode(const uint8_t *code, size_t size, std::vector<uint8_t> *data);
+    size_t decode_begin(const uint8_t *code, size_t size);
+    bool decode_some(const uint8_t *code, size_t size, size_t *pos, std::vector<uint8_t> *data, size_t max);
     void reset_tree();
+    void prime(const uint16_t freq[256]);
 
     // TODO DEBUGGING FUNCTIONS - DELETE
     void printVerticalOrder();
@@ -0,0 +1,157 @@
+/**
+ * Implementation of the HuffmanModel class. Trains, saves and loads
+ * frequency profiles used to prime adaptive Huffman trees, and keeps
+ * a registry of loaded models, through which the decoder looks up the model
+ * referenced by an encoded image.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "HuffmanModel.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+static std::mutex registry_mutex;
+static std::vector<const HuffmanModel *> registry;
+
+/**
+ * Train a model from a histogram of RLE symbols. The frequencies are scaled
+ * so that they sum up to about MODEL_PRIME_TOTAL. Symbols too rare to get
+ * a frequency of at least 1 are left out and are sent via NYT as usual,
+ * which keeps the codes of the common symbols short.
+ * @param hist number of occurrences of each symbol in the training corpus.
+ */
+HuffmanModel::HuffmanModel(const uint64_t hist[256])
+{
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++) {
+        total += hist[i];
+    }
+
+    for (int i = 0; i < 256; i++) {
+        if (hist[i] == 0) {
+            this->freq[i] = 0;
+            continue;
+        }
+        const uint64_t scaled = (hist[i] * MODEL_PRIME_TOTAL + total / 2) / total;
+        this->freq[i] = scaled < UINT16_MAX ? scaled : UINT16_MAX;
+    }
+
+    build();
+}
+
+/**
+ * Load a model from the file `path`.
+ * @param path path to a model file created by HuffmanModel::save().
+ */
+HuffmanModel::HuffmanModel(std::string path)
+{
+    uint8_t data[MODEL_FILE_SIZE];
+    std::ifstream fs(path, std::ios_base::binary);
+    fs.read((char *) data, MODEL_FILE_SIZE);
+
+    if (fs.gcount() != MODEL_FILE_SIZE || memcmp(data, MODEL_MAGIC, 4) != 0
+        || data[4] != MODEL_VERSION) {
+        throw "Not a Huffman model file.";
+    }
+
+    uint32_t stored_id = 0;
+    for (int i = 0; i < 4; i++) {
+        stored_id = (stored_id << 8) | data[5 + i];
+    }
+    for (int i = 0; i < 256; i++) {
+        this->freq[i] = (data[9 + 2 * i] << 8) | data[10 + 2 * i];
+    }
+
+    build();
+
+    if (this->model_id != stored_id) {
+        throw "Corrupted Huffman model file.";
+    }
+}
+
+/**
+ * Compute the model id and prime the tree. The id is a 32 bit FNV-1a hash
+ * of the frequencies, so identical profiles always have identical ids.
+ */
+void HuffmanModel::build()
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 256; i++) {
+        hash = (hash ^ (this->freq[i] >> 8)) * 16777619u;
+        hash = (hash ^ (this->freq[i] & 0xff)) * 16777619u;
+    }
+    this->model_id = hash;
+
+    this->primed.prime(this->freq);
+}
+
+/**
+ * Save the model to the file `path`.
+ * @param path path to the model file.
+ */
+void HuffmanModel::save(std::string path)
+{
+    uint8_t data[MODEL_FILE_SIZE];
+    memcpy(data, MODEL_MAGIC, 4);
+    data[4] = MODEL_VERSION;
+    for (int i = 0; i < 4; i++) {
+        data[5 + i] = this->model_id >> (24 - 8 * i);
+    }
+    for (int i = 0; i < 256; i++) {
+        data[9 + 2 * i] = this->freq[i] >> 8;
+        data[10 + 2 * i] = this->freq[i] & 0xff;
+    }
+
+    std::ofstream fs(path, std::ios_base::binary);
+    fs.write((char *) data, MODEL_FILE_SIZE);
+    if (!fs) {
+        throw "Huffman model could not be saved.";
+    }
+}
+
+/**
+ * @returns The id of the model, which is stored in encoded images.
+ */
+uint32_t HuffmanModel::id() const
+{
+    return this->model_id;
+}
+
+/**
+ * @returns The primed tree, to be copied before use.
+ */
+const Huffman *HuffmanModel::tree() const
+{
+    return &(this->primed);
+}
+
+/**
+ * Register a model, so that the decoder can find it by its id.
+ * The model must outlive all decoding.
+ * @param model pointer to the model.
+ */
+void HuffmanModel::add(const HuffmanModel *model)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(model);
+}
+
+/**
+ * Find a registered model by its id.
+ * @param id the id of the model.
+ * @returns The model or nullptr if no such model was registered.
+ */
+const HuffmanModel *HuffmanModel::find(uint32_t id)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto model : registry) {
+        if (model->id() == id) {
+            return model;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,45 @@
+/**
+ * Header for the HuffmanModel class.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef HUFFMAN_MODEL_HPP
+#define HUFFMAN_MODEL_HPP
+
+#include <cstdint>
+#include <string>
+#include "Huffman.hpp"
+
+#define MODEL_MAGIC "HCHM"
+#define MODEL_VERSION 1
+#define MODEL_FILE_SIZE (4 + 1 + 4 + 256 * 2) // magic + version + id + freqs.
+#define MODEL_PRIME_TOTAL 1024 // Sum of all frequencies a tree is primed with.
+
+/**
+ * A frequency profile of RLE symbols, trained from a corpus of images.
+ * Both the encoder and the decoder start from a Huffman tree primed with
+ * the profile instead of a lone NYT node. Encoded images refer to the model
+ * by its id, so the decoder can find the matching model.
+ */
+class HuffmanModel
+{
+private:
+    uint32_t model_id;
+    uint16_t freq[256];
+    Huffman primed; //!< Tree primed with `freq`, copied for every image.
+
+    void build();
+public:
+    HuffmanModel(const uint64_t hist[256]);
+    HuffmanModel(std::string path);
+
+    void save(std::string path);
+    uint32_t id() const;
+    const Huffman *tree() const;
+
+    static void add(const HuffmanModel *model);
+    static const HuffmanModel *find(uint32_t id);
+};
+
+#endif /* HUFFMAN_MODEL_HPP */
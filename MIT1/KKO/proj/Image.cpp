@@ -8,52 +8,36 @@
  */
 #include "Image.hpp"
 #include <sys/stat.h>
+#include <utility>
 
 /**
  * Load an image specified by `path` with width `width`.
  * @param path a valid absolute or relative path.
  * @param width a valid width for an image (i.e. >= 1).
+ * @param depth bits per channel, 8 or 16 (little endian).
+ * @param channels interleaved channels per pixel.
  * @returns An `Image` object containing the loaded image.
  */
-Image::Image(std::string path, uint32_t width)
+Image::Image(std::string path, uint32_t width, uint8_t depth, uint8_t channels)
 {
-    std::fstream fs;
-    fs.open(path, std::ios_base::in | std::ios_base::binary);
-    uint8_t px;
-    while (true) {
-        if (fs.peek() == EOF) {
-            break;
-        }
-        fs.read((char *) &px, sizeof(px) * 1);
-        this->img.push_back(px);
-    }
-    fs.close();
-
-    struct stat results;
-    stat(path.c_str(), &results);
-
-    this->width = width;
-    this->height = results.st_size / width;
-
-    if (this->img.size() != this->width * this->height) {
-        throw "Image load encountered an error.";
-    }
-
-    this->img_size = this->img.size();
+    load(path, width, depth, channels);
 }
 
 /**
- * Construct an Image object from raw pixel data.
- * @param data pointer to the raw pixel data.
+ * Construct an Image object from raw pixel data. The data is moved
+ * into the image, not copied.
+ * @param data the raw pixel data.
  * @param width the width of the image.
  * @param height the height of the image.
+ * @param depth bits per pixel, 8 or 16.
  */
-Image::Image(std::vector<uint8_t> *data, uint32_t width, uint32_t height)
+Image::Image(std::vector<uint8_t> &&data, uint32_t width, uint32_t height, uint8_t depth) :
+    img(std::move(data))
 {
-    this->img = std::vector<uint8_t>(*data);
     this->width = width;
     this->height = height;
-    this->img_size = width * height; //TODO maybe check if this == data->size()
+    this->img_depth = depth;
+    this->img_size = this->img.size();
 }
 
 Image::Image()
@@ -64,6 +48,65 @@ Image::~Image()
 {
 }
 
+/**
+ * Load an image specified by `path` with width `width`, replacing
+ * the current image. The already allocated storage is reused if it is
+ * large enough.
+ * @param path a valid absolute or relative path.
+ * @param width a valid width for an image (i.e. >= 1).
+ * @param depth bits per channel, 8 or 16 (little endian).
+ * @param channels interleaved channels per pixel (e.g. 3 for RGB).
+ */
+void Image::load(std::string path, uint32_t width, uint8_t depth, uint8_t channels)
+{
+    struct stat results;
+    if (stat(path.c_str(), &results) != 0) {
+        throw "Image load encountered an error.";
+    }
+
+    const uint64_t row_size = (uint64_t) width * channels * (depth / 8);
+    if (results.st_size / row_size > UINT32_MAX) {
+        throw "Image is too tall.";
+    }
+    this->width = width;
+    this->height = results.st_size / row_size;
+    this->img_depth = depth;
+    this->img_channels = channels;
+
+    std::fstream fs;
+    fs.open(path, std::ios_base::in | std::ios_base::binary);
+    this->img.resize(results.st_size);
+    fs.read((char *) this->img.data(), results.st_size);
+    const bool complete = fs.gcount() == results.st_size;
+    fs.close();
+
+    if (!complete || this->img.size() != row_size * this->height) {
+        throw "Image load encountered an error.";
+    }
+
+    this->img_size = this->img.size();
+}
+
+/**
+ * Replace the image data with `data` by swapping the two vectors.
+ * The previous image data is therefore returned via `data`, which allows
+ * the caller to reuse its storage for the next image.
+ * @param data pointer to the new raw pixel data.
+ * @param width the width of the new image.
+ * @param height the height of the new image.
+ * @param depth bits per channel of the new image, 8 or 16.
+ * @param channels interleaved channels per pixel of the new image.
+ */
+void Image::assign(std::vector<uint8_t> *data, uint32_t width, uint32_t height, uint8_t depth, uint8_t channels)
+{
+    this->img.swap(*data);
+    this->width = width;
+    this->height = height;
+    this->img_depth = depth;
+    this->img_channels = channels;
+    this->img_size = this->img.size();
+}
+
 /**
  * Write the image to a file specified by `path`.
  * @param path a valid absolute or relative path to a file.
@@ -73,9 +116,7 @@ void Image::write_out(std::string path)
     std::fstream fs;
     fs.open(path, std::ios_base::out | std::ios_base::binary);
 
-    for (uint64_t i = 0; i < (this->width * this->height); i++) {
-        fs.write((char *) &(this->img[i]), sizeof(uint8_t) * 1);
-    }
+    fs.write((char *) this->img.data(), this->img.size());
 
     fs.close();
 }
@@ -84,7 +125,7 @@ void Image::write_out(std::string path)
  * Returns the image size.
  * @returns The image size.
  */
-uint32_t Image::size()
+uint64_t Image::size()
 {
     return this->img.size();
 }
@@ -98,6 +139,31 @@ void Image::dimensions(uint32_t *width, uint32_t *height)
     (*height) = this->height;
 }
 
+/**
+ * Returns the number of bits per pixel (8 or 16).
+ */
+uint8_t Image::depth()
+{
+    return this->img_depth;
+}
+
+/**
+ * Returns the number of interleaved channels per pixel.
+ */
+uint8_t Image::channels()
+{
+    return this->img_channels;
+}
+
+/**
+ * Returns a pointer to the underlying pixel data (row by row).
+ * @returns Pointer to the first pixel of the image.
+ */
+uint8_t *Image::data()
+{
+    return this->img.data();
+}
+
 /**
  * Indexing of the image. Image is in a single row of pixels.
  * Basically a getter for the underlying image data in the image vector.
@@ -16,16 +16,23 @@ class Image
 {
 private:
     uint32_t width, height;
-    uint32_t img_size;
+    uint64_t img_size;
+    uint8_t img_depth = 8; //!< Bits per channel, 8 or 16.
+    uint8_t img_channels = 1; //!< Interleaved channels per pixel.
     std::vector<uint8_t> img;
 public:
     Image();
-    Image(std::string, uint32_t);
-    Image(std::vector<uint8_t> *data, uint32_t width, uint32_t height);
+    Image(std::string, uint32_t, uint8_t depth = 8, uint8_t channels = 1);
+    Image(std::vector<uint8_t> &&data, uint32_t width, uint32_t height, uint8_t depth = 8);
     ~Image();
+    void load(std::string, uint32_t, uint8_t depth = 8, uint8_t channels = 1);
+    void assign(std::vector<uint8_t> *data, uint32_t width, uint32_t height, uint8_t depth = 8, uint8_t channels = 1);
     void write_out(std::string);
-    uint32_t size();
+    uint64_t size();
     void dimensions(uint32_t *width, uint32_t *height);
+    uint8_t depth();
+    uint8_t channels();
+    uint8_t *data();
     uint8_t& operator[](size_t idx);
 };
 
@@ -0,0 +1,479 @@
+/**
+ * Implementation of the Pipeline class. Builds chains of transform stages
+ * from their text descriptions (e.g. "med,rle:vertical,huffman") or from
+ * the header of an encoded image, and runs them forward when encoding and
+ * backward when decoding. The built-in stages wrap the kernels of Codec,
+ * further ones may be registered with Pipeline::add().
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "Pipeline.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include "Codec.hpp"
+
+static std::mutex registry_mutex;
+static std::vector<const struct stage_type *> registry;
+
+//! Names of the scan orders of the RLE stage, indexed by DIRECTION_*.
+static const char *scan_names[SCAN_ORDERS] = {"horizontal", "vertical", "hilbert", "zigzag"};
+
+/**
+ * Returns the size of the pixels of the image in bytes.
+ */
+static inline size_t image_bytes(const struct stage_image *img)
+{
+    return (size_t) img->width * img->height * (img->depth / 8);
+}
+
+/**
+ * The pixel subtraction model: every pixel is replaced by its difference
+ * to the previous pixel in row by row order.
+ */
+class Pipeline::ModelStage : public Stage
+{
+public:
+    uint8_t id() const override { return PIPE_MODEL; }
+    bool takes_pixels() const override { return true; }
+    bool gives_pixels() const override { return true; }
+
+    void forward(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *) const override
+    {
+        const size_t start = out->size();
+        out->resize(start + size);
+        Codec::model_sub(in, size / (img->depth / 8), img->depth, out->data() + start);
+    }
+
+    void inverse(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *) const override
+    {
+        if (size != image_bytes(img)) {
+            throw "Encoded image is corrupt.";
+        }
+        out->assign(in, in + size);
+        Codec::model_sub_inverse(out->data(), size / (img->depth / 8), img->depth);
+    }
+
+    static Stage *parse(const std::string &arg)
+    {
+        return arg.empty() ? new ModelStage() : nullptr;
+    }
+
+    static Stage *read(const uint8_t *, size_t size)
+    {
+        return size == 0 ? new ModelStage() : nullptr;
+    }
+};
+
+/**
+ * The median edge detector: every pixel is replaced by its difference
+ * to a prediction from its left, upper and upper left neighbours.
+ */
+class Pipeline::MedStage : public Stage
+{
+public:
+    uint8_t id() const override { return PIPE_MED; }
+    bool takes_pixels() const override { return true; }
+    bool gives_pixels() const override { return true; }
+
+    void forward(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *) const override
+    {
+        const size_t start = out->size();
+        out->resize(start + size);
+        Codec::med_sub(in, img->width, img->height, img->depth, out->data() + start);
+    }
+
+    void inverse(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *) const override
+    {
+        if (size != image_bytes(img)) {
+            throw "Encoded image is corrupt.";
+        }
+        out->assign(in, in + size);
+        Codec::med_sub_inverse(out->data(), img->width, img->height, img->depth);
+    }
+
+    static Stage *parse(const std::string &arg)
+    {
+        return arg.empty() ? new MedStage() : nullptr;
+    }
+
+    static Stage *read(const uint8_t *, size_t size)
+    {
+        return size == 0 ? new MedStage() : nullptr;
+    }
+};
+
+/**
+ * Run-length encoding of the pixels in one of the scan orders, its only
+ * parameter (one byte, DIRECTION_*).
+ */
+class Pipeline::RleStage : public Stage
+{
+private:
+    uint8_t direction;
+public:
+    RleStage(uint8_t direction) : direction(direction) {}
+
+    uint8_t id() const override { return PIPE_RLE; }
+    bool takes_pixels() const override { return true; }
+    bool gives_pixels() const override { return false; }
+
+    void params(std::vector<uint8_t> *out) const override
+    {
+        out->push_back(direction);
+    }
+
+    void forward(const uint8_t *in, size_t, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *) const override
+    {
+        Codec::rle(in, img->width, img->height, false, direction, out, img->depth);
+    }
+
+    void inverse(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *buf) const override
+    {
+        // irle() reads a vector, `in` is one of the chain's buffers.
+        buf->symbols.assign(in, in + size);
+        out->assign(image_bytes(img), 0);
+        Codec::irle(&(buf->symbols), out->data(), img->width, img->height, direction, img->depth);
+    }
+
+    static Stage *parse(const std::string &arg)
+    {
+        if (arg.empty()) {
+            return new RleStage(DIRECTION_HORIZONTAL);
+        }
+        for (uint8_t d = 0; d < SCAN_ORDERS; d++) {
+            if (arg == scan_names[d]) {
+                return new RleStage(d);
+            }
+        }
+        return nullptr;
+    }
+
+    static Stage *read(const uint8_t *params, size_t size)
+    {
+        return size == 1 && params[0] < SCAN_ORDERS ? new RleStage(params[0]) : nullptr;
+    }
+};
+
+/**
+ * Adaptive Huffman coding of a stream of bytes.
+ */
+class Pipeline::HuffmanStage : public Stage
+{
+public:
+    uint8_t id() const override { return PIPE_HUFFMAN; }
+    bool takes_pixels() const override { return false; }
+    bool gives_pixels() const override { return false; }
+
+    void forward(const uint8_t *in, size_t size, const struct stage_image *,
+        std::vector<uint8_t> *out, struct codec_buffers *buf) const override
+    {
+        // huffman_enc() reads a vector, `in` may be the image itself.
+        buf->symbols.assign(in, in + size);
+        Codec::huffman_enc(&(buf->symbols), out, nullptr, &(buf->huffman));
+    }
+
+    void inverse(const uint8_t *in, size_t size, const struct stage_image *,
+        std::vector<uint8_t> *out, struct codec_buffers *buf) const override
+    {
+        out->clear();
+        Codec::huffman_dec(in, size, out, nullptr, &(buf->huffman));
+    }
+
+    static Stage *parse(const std::string &arg)
+    {
+        return arg.empty() ? new HuffmanStage() : nullptr;
+    }
+
+    static Stage *read(const uint8_t *, size_t size)
+    {
+        return size == 0 ? new HuffmanStage() : nullptr;
+    }
+};
+
+const struct stage_type Pipeline::builtin[] = {
+    {PIPE_MODEL, "model", ModelStage::parse, ModelStage::read, 1},
+    {PIPE_MED, "med", MedStage::parse, MedStage::read, 1},
+    // A run of 258 pixels takes 4 symbols (of 8-bit pixels).
+    {PIPE_RLE, "rle", RleStage::parse, RleStage::read, 65},
+    // Every code is at least a bit long.
+    {PIPE_HUFFMAN, "huffman", HuffmanStage::parse, HuffmanStage::read, 8},
+};
+
+/**
+ * Register a new kind of stage, so that chains may use it. The type must
+ * stay alive as long as it may be used, its id and name must not be taken.
+ * @param type the kind of stage.
+ */
+void Pipeline::add(const struct stage_type *type)
+{
+    if (find(type->id) != nullptr || find(type->name) != nullptr) {
+        throw "A stage with the same id or name is already registered.";
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(type);
+}
+
+/**
+ * Look up a kind of stage by its id.
+ * @param id the id of the stage stored in encoded images.
+ * @return the kind of stage, nullptr if not known.
+ */
+const struct stage_type *Pipeline::find(uint8_t id)
+{
+    for (const auto &type : builtin) {
+        if (type.id == id) {
+            return &type;
+        }
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto type : registry) {
+        if (type->id == id) {
+            return type;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Look up a kind of stage by its name.
+ * @param name the name of the stage in chain descriptions.
+ * @return the kind of stage, nullptr if not known.
+ */
+const struct stage_type *Pipeline::find(const std::string &name)
+{
+    for (const auto &type : builtin) {
+        if (name == type.name) {
+            return &type;
+        }
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto type : registry) {
+        if (name == type->name) {
+            return type;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Check that the chain has 1 to MAX_STAGES stages, and that every stage,
+ * which takes pixels, gets them from the previous stage.
+ */
+void Pipeline::check()
+{
+    if (stages.empty() || stages.size() > MAX_STAGES) {
+        throw "A transform chain must have 1 to 16 stages.";
+    }
+    for (size_t i = 1; i < stages.size(); i++) {
+        if (stages[i]->takes_pixels() && !stages[i - 1]->gives_pixels()) {
+            throw "A stage of the transform chain requires pixels, which the previous stage does not give.";
+        }
+    }
+}
+
+/**
+ * Build the chain from its description, a comma separated list of stages
+ * `name[:argument]`, e.g. "med,rle:vertical,huffman".
+ * @param chain the description.
+ */
+void Pipeline::parse(const std::string &chain)
+{
+    stages.clear();
+    size_t start = 0;
+    while (start <= chain.size()) {
+        size_t end = chain.find(',', start);
+        if (end == std::string::npos) {
+            end = chain.size();
+        }
+        const std::string item = chain.substr(start, end - start);
+        const size_t colon = item.find(':');
+        const std::string name = item.substr(0, colon);
+        const std::string arg = colon == std::string::npos ? "" : item.substr(colon + 1);
+
+        const struct stage_type *type = find(name);
+        if (type == nullptr) {
+            throw "Unknown stage of the transform chain.";
+        }
+        Stage *stage = type->parse(arg);
+        if (stage == nullptr) {
+            throw "Invalid argument of a stage of the transform chain.";
+        }
+        stages.emplace_back(stage);
+        start = end + 1;
+    }
+    check();
+}
+
+/**
+ * Returns the number of stages of the chain.
+ */
+size_t Pipeline::size() const
+{
+    return stages.size();
+}
+
+/**
+ * Returns the `i`-th stage of the chain (0 is applied first when encoding).
+ */
+const Stage *Pipeline::stage(size_t i) const
+{
+    return stages[i].get();
+}
+
+/**
+ * Append the description of the chain stored in the header to `out`:
+ * the number of stages, then the id, the size of the parameters and
+ * the parameters of every stage.
+ */
+void Pipeline::write(std::vector<uint8_t> *out) const
+{
+    std::vector<uint8_t> params;
+    out->push_back(stages.size());
+    for (const auto &stage : stages) {
+        params.clear();
+        stage->params(&params);
+        out->push_back(stage->id());
+        out->push_back(params.size());
+        out->insert(out->end(), params.begin(), params.end());
+    }
+}
+
+/**
+ * Build the chain from its description in the header (see Pipeline::write()).
+ * @param data pointer to the description.
+ * @param size size of `data` in bytes.
+ * @return the size of the description in bytes.
+ */
+size_t Pipeline::read(const uint8_t *data, size_t size)
+{
+    stages.clear();
+    if (size < 1) {
+        throw "Encoded image is missing its header.";
+    }
+    const uint8_t count = data[0];
+    size_t pos = 1;
+    for (uint8_t i = 0; i < count; i++) {
+        if (size < pos + 2 || size < pos + 2 + data[pos + 1]) {
+            throw "Encoded image is missing its header.";
+        }
+        const struct stage_type *type = find(data[pos]);
+        if (type == nullptr) {
+            throw "Encoded image requires a stage, which is not known.";
+        }
+        Stage *stage = type->read(data + pos + 2, data[pos + 1]);
+        if (stage == nullptr) {
+            throw "Encoded image has an invalid header.";
+        }
+        stages.emplace_back(stage);
+        pos += 2 + data[pos + 1];
+    }
+    try {
+        check();
+    } catch (const char *) {
+        throw "Encoded image has an invalid header.";
+    }
+    return pos;
+}
+
+/**
+ * Returns the most samples, which one byte of the output of the chain
+ * described in the header (see Pipeline::write()) decodes to, i.e.
+ * the product of the expansions of its stages, without building the chain.
+ * @param data pointer to the description.
+ * @param size size of `data` in bytes.
+ * @throws const char * if the description is truncated or has an unknown stage.
+ */
+uint64_t Pipeline::expansion(const uint8_t *data, size_t size)
+{
+    if (size < 1) {
+        throw "Encoded image is missing its header.";
+    }
+    uint64_t product = 1;
+    size_t pos = 1;
+    for (uint8_t i = 0; i < data[0]; i++) {
+        if (size < pos + 2) {
+            throw "Encoded image is missing its header.";
+        }
+        const struct stage_type *type = find(data[pos]);
+        if (type == nullptr) {
+            throw "Encoded image requires a stage, which is not known.";
+        }
+        // Saturates, the product is compared to the size of the image only.
+        product = product > UINT32_MAX ? product : product * std::max<uint32_t>(type->expansion, 1);
+        pos += 2 + data[pos + 1];
+    }
+    return product;
+}
+
+/**
+ * Run the stages forward on the pixels of an image and append the output
+ * of the last stage to `out`.
+ * @param px pointer to the raw pixel data.
+ * @param img the geometry of the image.
+ * @param out pointer to the vector, to which the output is appended.
+ * @param buf intermediate buffers to be reused.
+ */
+void Pipeline::encode(
+    const uint8_t *px, const struct stage_image *img, std::vector<uint8_t> *out,
+    struct codec_buffers *buf) const
+{
+    const uint8_t *in = px;
+    size_t size = image_bytes(img);
+    for (size_t i = 0; i < stages.size(); i++) {
+        if (i + 1 == stages.size()) {
+            stages[i]->forward(in, size, img, out, buf);
+            break;
+        }
+        // The stages take turns in the two buffers.
+        std::vector<uint8_t> *next = &(buf->stage_data[i % 2]);
+        next->clear();
+        stages[i]->forward(in, size, img, next, buf);
+        in = next->data();
+        size = next->size();
+    }
+}
+
+/**
+ * Run the stages backward on the output of Pipeline::encode() and write
+ * the restored pixels to `dst`.
+ * @param data pointer to the output of the last stage.
+ * @param size size of `data` in bytes.
+ * @param img the geometry of the image.
+ * @param dst pointer to the first row of the decoded image.
+ * @param stride bytes between the starts of two rows in `dst`.
+ * @param buf intermediate buffers to be reused.
+ */
+void Pipeline::decode(
+    const uint8_t *data, size_t size, const struct stage_image *img,
+    uint8_t *dst, size_t stride, struct codec_buffers *buf) const
+{
+    const uint8_t *in = data;
+    std::vector<uint8_t> *out = nullptr;
+    for (size_t i = stages.size(); i-- > 0;) {
+        out = &(buf->stage_data[i % 2]);
+        stages[i]->inverse(in, size, img, out, buf);
+        in = out->data();
+        size = out->size();
+    }
+
+    const size_t row_size = (size_t) img->width * (img->depth / 8);
+    if (size != row_size * img->height) {
+        throw "Encoded image is corrupt.";
+    }
+    if (stride == row_size) {
+        memcpy(dst, in, size);
+        return;
+    }
+    for (uint32_t y = 0; y < img->height; y++) {
+        memcpy(dst + y * stride, in + y * row_size, row_size);
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * Header for the Pipeline class and the Stage interface.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define PIPE_MODEL 1 // Differences to the left pixel (the subtraction model).
+#define PIPE_MED 2 // Differences to the median edge detector prediction.
+#define PIPE_RLE 3 // Run-length encoding in a scan order (one parameter byte).
+#define PIPE_HUFFMAN 4 // Adaptive Huffman coding.
+#define MAX_STAGES 16 // Most stages of a chain.
+
+struct codec_buffers;
+
+/**
+ * Geometry of the image, which a chain of stages encodes.
+ */
+struct stage_image
+{
+    uint32_t width;
+    uint32_t height;
+    uint8_t depth; //!< Bits per pixel, 8 or 16.
+};
+
+/**
+ * A step of a transform chain: a transform of pixels into pixels (e.g.
+ * a predictor), a scanner turning pixels into a stream of symbols or an
+ * entropy coder of a stream. Stages are stateless, all their intermediate
+ * data are kept in the codec_buffers passed in, so one chain may be used
+ * by many threads at once.
+ */
+class Stage
+{
+public:
+    virtual ~Stage() {}
+
+    virtual uint8_t id() const = 0;
+    //! True if the input must be the pixels of the image, false if any
+    //! stream of bytes (including pixels) will do.
+    virtual bool takes_pixels() const = 0;
+    //! True if the output are pixels of the image.
+    virtual bool gives_pixels() const = 0;
+    //! Appends the parameters of the stage, which are stored in the header.
+    virtual void params(std::vector<uint8_t> *out) const {}
+
+    //! Appends the output of the stage for `size` bytes of input to `out`.
+    virtual void forward(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *buf) const = 0;
+    //! Replaces `out` with the input, from which the stage produced `in`.
+    virtual void inverse(const uint8_t *in, size_t size, const struct stage_image *img,
+        std::vector<uint8_t> *out, struct codec_buffers *buf) const = 0;
+};
+
+/**
+ * A kind of stage, as registered with Pipeline::add().
+ */
+struct stage_type
+{
+    uint8_t id;       //!< Id of the stage in encoded images, one of PIPE_* or new.
+    const char *name; //!< Name of the stage in chain descriptions.
+    //! Creates the stage from the text after the name (e.g. "vertical" in
+    //! "rle:vertical", empty if none), nullptr if the text is invalid.
+    Stage *(*parse)(const std::string &arg);
+    //! Creates the stage from its parameters stored in the header, nullptr
+    //! if they are invalid.
+    Stage *(*read)(const uint8_t *params, size_t size);
+    //! Most values (bytes, or samples if it gives pixels), which the inverse
+    //! of the stage makes of one byte of its input. Bounds the size of images
+    //! with corrupt headers, see Pipeline::expansion().
+    uint32_t expansion;
+};
+
+/**
+ * A chain of stages, which replaces the fixed model, scanning and Huffman
+ * coding of the codec. The chain is described in the header of the encoded
+ * image (see encoded_format), so the decoder rebuilds it on its own.
+ */
+class Pipeline
+{
+private:
+    class ModelStage;
+    class MedStage;
+    class RleStage;
+    class HuffmanStage;
+
+    static const struct stage_type builtin[]; //!< The PIPE_* stages.
+    std::vector<std::unique_ptr<Stage>> stages;
+
+    void check();
+public:
+    static void add(const struct stage_type *type);
+    static const struct stage_type *find(uint8_t id);
+    static const struct stage_type *find(const std::string &name);
+    static uint64_t expansion(const uint8_t *data, size_t size);
+
+    void parse(const std::string &chain);
+    size_t size() const;
+    const Stage *stage(size_t i) const;
+
+    void write(std::vector<uint8_t> *out) const;
+    size_t read(const uint8_t *data, size_t size);
+    void encode(const uint8_t *px, const struct stage_image *img, std::vector<uint8_t> *out,
+        struct codec_buffers *buf) const;
+    void decode(const uint8_t *data, size_t size, const struct stage_image *img,
+        uint8_t *dst, size_t stride, struct codec_buffers *buf) const;
+};
+
+#endif /* PIPELINE_HPP */
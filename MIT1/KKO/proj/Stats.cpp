@@ -0,0 +1,93 @@
+/**
+ * Merging and reporting of the profiling counters.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include "Stats.hpp"
+
+#include <cstdio>
+
+thread_local struct codec_stats thread_stats;
+
+static const char *stage_names[STAGE_COUNT] = {
+    "io", "direction", "rle", "huffman_enc", "huffman_dec", "irle", "model_inverse",
+    "planes"
+};
+
+/**
+ * Add the counters of `from` to `into`.
+ */
+void stats_merge(struct codec_stats *into, const struct codec_stats *from)
+{
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        into->stage_ns[i] += from->stage_ns[i];
+    }
+    into->images += from->images;
+    into->bytes_in += from->bytes_in;
+    into->bytes_out += from->bytes_out;
+    into->symbols += from->symbols;
+    into->code_bits += from->code_bits;
+    into->nyt_escapes += from->nyt_escapes;
+    into->swaps += from->swaps;
+}
+
+/**
+ * @returns The average Huffman code length in bits per symbol.
+ */
+static double average_code_length(const struct codec_stats *stats)
+{
+    return stats->symbols > 0 ? (double) stats->code_bits / stats->symbols : 0;
+}
+
+/**
+ * Print the counters in a human readable form to stderr.
+ */
+void stats_print(const struct codec_stats *stats)
+{
+#ifndef HUFF_STATS
+    fprintf(stderr, "Statistics were not compiled in, build with `make STATS=1`.\n");
+#endif
+    fprintf(stderr, "Stage             Time [ms]\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        fprintf(stderr, "%-16s  %10.3f\n", stage_names[i], stats->stage_ns[i] / 1e6);
+    }
+    fprintf(stderr, "Images:          %lu\n", (unsigned long) stats->images);
+    fprintf(stderr, "Bytes in:        %lu\n", (unsigned long) stats->bytes_in);
+    fprintf(stderr, "Bytes out:       %lu\n", (unsigned long) stats->bytes_out);
+    fprintf(stderr, "Symbols:         %lu\n", (unsigned long) stats->symbols);
+    fprintf(stderr, "NYT escapes:     %lu\n", (unsigned long) stats->nyt_escapes);
+    fprintf(stderr, "Node swaps:      %lu\n", (unsigned long) stats->swaps);
+    fprintf(stderr, "Avg code length: %.3f bits\n", average_code_length(stats));
+}
+
+/**
+ * Write the counters as a JSON object to file `path`.
+ */
+void stats_write_json(const struct codec_stats *stats, std::string path)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == nullptr) {
+        throw "Statistics could not be written.";
+    }
+
+#ifdef HUFF_STATS
+    fprintf(f, "{\n  \"enabled\": true,\n  \"stage_ms\": {");
+#else
+    fprintf(f, "{\n  \"enabled\": false,\n  \"stage_ms\": {");
+#endif
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        fprintf(f, "%s\"%s\": %.3f", i > 0 ? ", " : "", stage_names[i],
+            stats->stage_ns[i] / 1e6);
+    }
+    fprintf(f, "},\n");
+    fprintf(f, "  \"images\": %lu,\n", (unsigned long) stats->images);
+    fprintf(f, "  \"bytes_in\": %lu,\n", (unsigned long) stats->bytes_in);
+    fprintf(f, "  \"bytes_out\": %lu,\n", (unsigned long) stats->bytes_out);
+    fprintf(f, "  \"symbols\": %lu,\n", (unsigned long) stats->symbols);
+    fprintf(f, "  \"nyt_escapes\": %lu,\n", (unsigned long) stats->nyt_escapes);
+    fprintf(f, "  \"swaps\": %lu,\n", (unsigned long) stats->swaps);
+    fprintf(f, "  \"avg_code_length\": %.4f\n}\n", average_code_length(stats));
+
+    fclose(f);
+}
@@ -0,0 +1,83 @@
+/**
+ * Per-stage profiling counters. The counters are only collected when
+ * compiled with HUFF_STATS defined (`make STATS=1`), otherwise all
+ * the STATS_* macros expand to nothing and cost nothing.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#define STAGE_IO 0
+#define STAGE_DIRECTION 1
+#define STAGE_RLE 2
+#define STAGE_HUFFMAN_ENC 3
+#define STAGE_HUFFMAN_DEC 4
+#define STAGE_IRLE 5
+#define STAGE_MODEL_INVERSE 6
+#define STAGE_PLANES 7
+#define STAGE_COUNT 8
+
+/**
+ * Counters collected while encoding/decoding.
+ */
+struct codec_stats
+{
+    double stage_ns[STAGE_COUNT] = {}; //!< Wall time spent in each stage.
+    uint64_t images = 0;      //!< Number of encoded/decoded images.
+    uint64_t bytes_in = 0;    //!< Input bytes of encode/decode.
+    uint64_t bytes_out = 0;   //!< Output bytes of encode/decode.
+    uint64_t symbols = 0;     //!< Huffman coded symbols (EOF included).
+    uint64_t code_bits = 0;   //!< Bits of Huffman code (padding included).
+    uint64_t nyt_escapes = 0; //!< Symbols sent as NYT + raw value.
+    uint64_t swaps = 0;       //!< Node swaps during tree updates.
+};
+
+//! Counters of the calling thread.
+extern thread_local struct codec_stats thread_stats;
+
+void stats_merge(struct codec_stats *into, const struct codec_stats *from);
+void stats_print(const struct codec_stats *stats);
+void stats_write_json(const struct codec_stats *stats, std::string path);
+
+#ifdef HUFF_STATS
+
+/**
+ * Adds the time from its construction to its destruction to a stage.
+ */
+class StatsTimer
+{
+private:
+    int stage;
+    std::chrono::steady_clock::time_point start;
+public:
+    StatsTimer(int stage) : stage(stage), start(std::chrono::steady_clock::now()) {}
+    ~StatsTimer()
+    {
+        const auto end = std::chrono::steady_clock::now();
+        thread_stats.stage_ns[this->stage] +=
+            std::chrono::duration<double, std::nano>(end - this->start).count();
+    }
+};
+
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define STATS_TIMER(stage) StatsTimer STATS_CONCAT(stats_timer_, __LINE__)(stage)
+#define STATS_ADD(field, n) (thread_stats.field += (n))
+#define STATS_INC(field) (thread_stats.field++)
+
+#else
+
+// sizeof() does not evaluate `n`, but keeps the variables in it "used".
+#define STATS_TIMER(stage)
+#define STATS_ADD(field, n) ((void) sizeof(n))
+#define STATS_INC(field) ((void) 0)
+
+#endif /* HUFF_STATS */
+
+#endif /* STATS_HPP */
@@ -0,0 +1,140 @@
+/**
+ * Allocation check of huff_codec. Counts the calls of operator new over
+ * repeated encoding and decoding of the same image with the same
+ * codec_buffers and fails, if the count grows from one round to the next,
+ * i.e. if some buffer is not reused across images.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "Codec.hpp"
+
+#define CHECK_ROUNDS 6 // Rounds of encoding and decoding of every image.
+#define CHECK_WARMUP 2 // Rounds, after which all buffers should have their capacity.
+#define CHECK_SIZE 256 // Side of the checked images in pixels.
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+// Not inlined, so that the compiler does not pair the free() with
+// the operator new of the standard library (-Wmismatched-new-delete).
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+/**
+ * Option combination, under which the allocations are counted.
+ */
+struct check_case
+{
+    const char *name;
+    struct enc_options opts;
+};
+
+/**
+ * Generate smooth shapes with slight noise, `channels` interleaved samples
+ * of `depth` bits per pixel.
+ */
+static void check_image(uint8_t depth, uint8_t channels, std::vector<uint8_t> *px)
+{
+    const size_t bytes = depth / 8;
+    uint32_t seed = 2463534242u;
+    px->resize((size_t) CHECK_SIZE * CHECK_SIZE * channels * bytes);
+
+    size_t i = 0;
+    for (uint32_t y = 0; y < CHECK_SIZE; y++) {
+        for (uint32_t x = 0; x < CHECK_SIZE * channels; x++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            const uint16_t value = 128 + 60 * sin(x / 23.0) * cos(y / 31.0) + (seed % 5);
+            for (size_t b = 0; b < bytes; b++) {
+                (*px)[i++] = b ? value >> 8 : value;
+            }
+        }
+    }
+}
+
+/**
+ * Encode and decode the image CHECK_ROUNDS times with one codec_buffers.
+ * @returns False if the allocations per round grew after CHECK_WARMUP
+ *     rounds or the decoded image differs.
+ */
+static bool check(const struct check_case *c)
+{
+    std::vector<uint8_t> px, encoded, decoded;
+    check_image(c->opts.depth, c->opts.channels, &px);
+    struct codec_buffers buf;
+    uint64_t settled = 0;
+    bool ok = true;
+
+    printf("%-12s", c->name);
+    for (int round = 0; round < CHECK_ROUNDS; round++) {
+        const uint64_t before = allocations.load();
+        uint32_t width, height;
+        Codec::encode(px.data(), CHECK_SIZE, CHECK_SIZE, c->opts, &encoded, &buf);
+        Codec::decode(encoded.data(), encoded.size(), &decoded, &width, &height, &buf);
+        const uint64_t count = allocations.load() - before;
+        printf(" %6lu", (unsigned long) count);
+
+        if (decoded != px) {
+            printf("  decoded image differs");
+            ok = false;
+            break;
+        }
+        if (round + 1 == CHECK_WARMUP) {
+            settled = count;
+        } else if (round + 1 > CHECK_WARMUP && count > settled) {
+            printf("  allocations grew");
+            ok = false;
+        }
+    }
+    printf("\n");
+    return ok;
+}
+
+int main()
+{
+    std::vector<struct check_case> cases(5);
+    cases[0].name = "plain";
+    cases[1].name = "model";
+    cases[1].opts.model = true;
+    cases[2].name = "adaptive";
+    cases[2].opts.model = true;
+    cases[2].opts.adaptive = true;
+    cases[3].name = "16-bit";
+    cases[3].opts.model = true;
+    cases[3].opts.depth = 16;
+    cases[4].name = "vertical";
+    cases[4].opts.scan = DIRECTION_VERTICAL;
+
+    printf("Allocations per round (encode + decode):\n");
+    bool ok = true;
+    for (const struct check_case &c : cases) {
+        ok = check(&c) && ok;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
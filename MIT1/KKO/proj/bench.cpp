@@ -0,0 +1,414 @@
+/**
+ * Benchmark of the individual stages of huff_codec. Generates deterministic
+ * synthetic images (and optionally loads real ones), times every stage for
+ * every option combination and prints the results as JSON to stdout.
+ * @author Patrik Nemeth (xnemet04)
+ *
+ * File created: 18.10.2026
+ */
+#include <chrono>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "Batch.hpp"
+#include "Codec.hpp"
+#include "Image.hpp"
+#include "Pipeline.hpp"
+
+/**
+ * An image to be benchmarked.
+ */
+struct bench_image
+{
+    std::string name;
+    uint32_t width, height;
+    std::vector<uint8_t> px;
+};
+
+/**
+ * Timing of a single stage.
+ */
+struct bench_stage
+{
+    std::string name;
+    double ns;        //!< Best time of all repetitions in nanoseconds.
+    uint64_t bytes;   //!< Size of the stage's output in bytes.
+};
+
+/**
+ * Has access to the private stages of the Codec class.
+ */
+class Bench
+{
+private:
+    static double time_ns(unsigned reps, const std::function<void()> &fn);
+public:
+    static void run(const struct bench_image *img, struct enc_options opts,
+        unsigned reps, std::vector<struct bench_stage> *stages, uint64_t *encoded_size);
+    static void run_chain(const struct bench_image *img, const Pipeline *chain,
+        unsigned reps, std::vector<struct bench_stage> *stages, uint64_t *encoded_size);
+};
+
+/**
+ * Run `fn` `reps` times and return the best time in nanoseconds.
+ */
+double Bench::time_ns(unsigned reps, const std::function<void()> &fn)
+{
+    double best = 0;
+    for (unsigned i = 0; i < reps; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        fn();
+        const auto end = std::chrono::steady_clock::now();
+        const double ns = std::chrono::duration<double, std::nano>(end - start).count();
+        if (i == 0 || ns < best) {
+            best = ns;
+        }
+    }
+    return best;
+}
+
+/**
+ * Time all stages of encoding and decoding `img` with options `opts`.
+ * The model is applied inside rle(), so the rle stage includes it.
+ * @param img the image.
+ * @param opts encoding options.
+ * @param reps number of repetitions of every stage.
+ * @param stages pointer to vector, to which the stage timings are appended.
+ * @param encoded_size pointer, via which the encoded size is returned.
+ */
+void Bench::run(
+    const struct bench_image *img, struct enc_options opts, unsigned reps,
+    std::vector<struct bench_stage> *stages, uint64_t *encoded_size)
+{
+    const uint8_t *px = img->px.data();
+    const uint32_t w = img->width, h = img->height;
+    struct codec_buffers buf;
+    std::vector<uint8_t> symbols, encoded, decoded, pixels(img->px.size());
+    double ns;
+
+    opts.direction = DIRECTION_HORIZONTAL;
+    if (opts.adaptive) {
+        ns = time_ns(reps, [&]() {
+            opts.direction = Codec::best_encoding_direction(px, w, h);
+        });
+        stages->push_back({"direction", ns, 1});
+    }
+
+    ns = time_ns(reps, [&]() {
+        symbols.clear();
+        Codec::rle(px, w, h, opts.model, opts.direction, &symbols);
+    });
+    stages->push_back({"rle", ns, symbols.size()});
+
+    ns = time_ns(reps, [&]() {
+        encoded.clear();
+        Codec::huffman_enc(&symbols, &encoded, nullptr, &(buf.huffman));
+    });
+    stages->push_back({"huffman_enc", ns, encoded.size()});
+
+    ns = time_ns(reps, [&]() {
+        decoded.clear();
+        Codec::huffman_dec(encoded.data(), encoded.size(), &decoded, nullptr, &(buf.huffman));
+    });
+    stages->push_back({"huffman_dec", ns, decoded.size()});
+
+    ns = time_ns(reps, [&]() {
+        Codec::irle(&decoded, pixels.data(), w, h, opts.direction);
+    });
+    stages->push_back({"irle", ns, pixels.size()});
+
+    if (opts.model) {
+        // Every repetition undoes the model on already restored pixels,
+        // which costs the same as undoing it on the model's output.
+        ns = time_ns(reps, [&]() {
+            Codec::model_sub_inverse(pixels.data(), pixels.size());
+        });
+        stages->push_back({"model_sub_inverse", ns, pixels.size()});
+    }
+
+    ns = time_ns(reps, [&]() {
+        Codec::encode(px, w, h, opts, &encoded, &buf);
+    });
+    stages->push_back({"encode", ns, encoded.size()});
+    *encoded_size = encoded.size();
+
+    uint32_t dw, dh;
+    ns = time_ns(reps, [&]() {
+        Codec::decode(encoded.data(), encoded.size(), &pixels, &dw, &dh, &buf);
+    });
+    stages->push_back({"decode", ns, pixels.size()});
+
+    if (pixels != img->px) {
+        fprintf(stderr, "%s: decoded image differs from the original\n", img->name.c_str());
+    }
+}
+
+/**
+ * Time every stage of the transform chain `chain` forward (named after
+ * the stage) and backward (`<name>_inverse`) on `img`, then the whole
+ * encoding and decoding with the chain.
+ * See Bench::run() for the other parameters.
+ */
+void Bench::run_chain(
+    const struct bench_image *img, const Pipeline *chain, unsigned reps,
+    std::vector<struct bench_stage> *stages, uint64_t *encoded_size)
+{
+    const struct stage_image geometry = {img->width, img->height, 8};
+    struct codec_buffers buf;
+    // outputs[i] is the input of stage i, outputs[i + 1] its output.
+    std::vector<std::vector<uint8_t>> outputs(chain->size() + 1);
+    std::vector<uint8_t> restored, encoded, pixels;
+    double ns;
+
+    outputs[0] = img->px;
+    for (size_t i = 0; i < chain->size(); i++) {
+        const Stage *stage = chain->stage(i);
+        const std::vector<uint8_t> &in = outputs[i];
+        std::vector<uint8_t> &out = outputs[i + 1];
+        ns = time_ns(reps, [&]() {
+            out.clear();
+            stage->forward(in.data(), in.size(), &geometry, &out, &buf);
+        });
+        stages->push_back({Pipeline::find(stage->id())->name, ns, out.size()});
+    }
+    for (size_t i = chain->size(); i-- > 0;) {
+        const Stage *stage = chain->stage(i);
+        const std::vector<uint8_t> &in = outputs[i + 1];
+        ns = time_ns(reps, [&]() {
+            stage->inverse(in.data(), in.size(), &geometry, &restored, &buf);
+        });
+        stages->push_back({std::string(Pipeline::find(stage->id())->name) + "_inverse",
+            ns, restored.size()});
+        if (restored != outputs[i]) {
+            fprintf(stderr, "%s: inverse of stage %zu differs from its input\n",
+                img->name.c_str(), i);
+        }
+    }
+
+    struct enc_options opts;
+    opts.model = false;
+    opts.adaptive = false;
+    opts.chain = chain;
+    ns = time_ns(reps, [&]() {
+        Codec::encode(img->px.data(), img->width, img->height, opts, &encoded, &buf);
+    });
+    stages->push_back({"encode", ns, encoded.size()});
+    *encoded_size = encoded.size();
+
+    uint32_t dw, dh;
+    ns = time_ns(reps, [&]() {
+        Codec::decode(encoded.data(), encoded.size(), &pixels, &dw, &dh, &buf);
+    });
+    stages->push_back({"decode", ns, pixels.size()});
+
+    if (pixels != img->px) {
+        fprintf(stderr, "%s: decoded image differs from the original\n", img->name.c_str());
+    }
+}
+
+/**
+ * Xorshift PRNG, so that the synthetic images are the same on every run.
+ */
+static uint32_t xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/**
+ * Generate the synthetic images of `width` x `height` pixels.
+ */
+static void synthetic_images(uint32_t width, uint32_t height, std::vector<struct bench_image> *images)
+{
+    const char *names[] = {"flat", "gradient", "noise", "text", "photo"};
+    uint32_t seed = 2463534242u;
+
+    for (int kind = 0; kind < 5; kind++) {
+        struct bench_image img;
+        img.name = names[kind];
+        img.width = width;
+        img.height = height;
+        img.px.resize((size_t) width * height);
+
+        for (uint32_t y = 0; y < height; y++) {
+            for (uint32_t x = 0; x < width; x++) {
+                uint8_t value = 0;
+                switch (kind)
+                {
+                case 0: // Flat
+                    value = 128;
+                    break;
+                case 1: // Horizontal gradient
+                    value = (x * 256) / width;
+                    break;
+                case 2: // Uniform noise
+                    value = xorshift(&seed);
+                    break;
+                case 3: // Black glyph-like blocks on white lines of text
+                    value = ((y % 12) < 9 && (x % 7) < 5
+                        && (xorshift(&seed) & 3) == 0) ? 0 : 255;
+                    break;
+                default: // Smooth shapes with slight sensor noise
+                    value = 128 + 60 * sin(x / 23.0) * cos(y / 31.0)
+                        + 40 * sin((x + y) / 57.0) + (xorshift(&seed) % 5);
+                    break;
+                }
+                img.px[(size_t) y * width + x] = value;
+            }
+        }
+
+        images->push_back(img);
+    }
+}
+
+/**
+ * Print the results of one image and option combination as a JSON object.
+ */
+static void print_result(
+    const struct bench_image *img, const std::string &options, uint64_t encoded_size,
+    const std::vector<struct bench_stage> *stages, bool last)
+{
+    const double pixels = (double) img->px.size();
+
+    printf("    {\"image\": \"%s\", \"width\": %u, \"height\": %u, \"options\": \"%s\",\n",
+        img->name.c_str(), img->width, img->height, options.c_str());
+    printf("     \"encoded_bytes\": %lu, \"bits_per_pixel\": %.4f, \"stages\": {\n",
+        (unsigned long) encoded_size, encoded_size * 8 / pixels);
+
+    for (size_t i = 0; i < stages->size(); i++) {
+        const struct bench_stage &s = (*stages)[i];
+        printf("       \"%s\": {\"ns\": %.0f, \"ns_per_pixel\": %.3f, \"mb_per_s\": %.3f, "
+            "\"out_bits_per_pixel\": %.4f}%s\n",
+            s.name.c_str(), s.ns, s.ns / pixels, pixels / 1e6 / (s.ns / 1e9),
+            s.bytes * 8 / pixels, i + 1 < stages->size() ? "," : "");
+    }
+
+    printf("     }}%s\n", last ? "" : ",");
+}
+
+static void print_help()
+{
+    printf("./huff_bench [-s size] [-n reps] [-i in_path -w width] [-c chain]\n");
+    printf("DESCTRIPTION\n");
+    printf("\tTime the stages of huff_codec on synthetic images of `size` x\n");
+    printf("\t`size` pixels (default 512) and print the results as JSON.\n");
+    printf("OPTIONS\n");
+    printf("\t-n  Repetitions of every stage, the best time is reported\n");
+    printf("\t    (default 5).\n");
+    printf("\t-i  Also benchmark the RAW images of width `width` in\n");
+    printf("\t    `in_path` (a file, a directory or a file list).\n");
+    printf("\t-c  Benchmark the transform chain `chain` (see `--chain` of\n");
+    printf("\t    huff_codec) instead of the default chains. May be given\n");
+    printf("\t    repeatedly.\n");
+    printf("\t-h  Print this help and exit.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint32_t size = 512, width = 0;
+    unsigned reps = 5;
+    std::string f_in = "";
+    std::vector<std::string> chain_specs;
+
+    while ((opt = getopt(argc, argv, "s:n:i:w:c:h")) != -1) {
+        switch (opt)
+        {
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'n':
+            reps = atoi(optarg);
+            break;
+        case 'i':
+            f_in = optarg;
+            break;
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'c':
+            chain_specs.push_back(optarg);
+            break;
+        case 'h':
+            print_help();
+            return EXIT_SUCCESS;
+        default:
+            print_help();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (size < 1 || reps < 1 || (f_in.length() > 0 && width < 1)) {
+        print_help();
+        return EXIT_FAILURE;
+    }
+
+    if (chain_specs.empty()) {
+        chain_specs = {"model,rle,huffman", "med,rle,huffman", "med,huffman",
+            "model,rle:vertical,huffman"};
+    }
+
+    std::vector<struct bench_image> images;
+    synthetic_images(size, size, &images);
+    std::vector<Pipeline> chains(chain_specs.size());
+
+    try
+    {
+        for (size_t c = 0; c < chain_specs.size(); c++) {
+            chains[c].parse(chain_specs[c]);
+        }
+
+        if (f_in.length() > 0) {
+            std::vector<std::string> inputs = std::filesystem::is_regular_file(f_in)
+                && f_in.size() > 4 && f_in.substr(f_in.size() - 4) == ".raw" ?
+                std::vector<std::string>{f_in} : Batch::collect_inputs(f_in);
+            for (auto &path : inputs) {
+                Image raw(path, width);
+                struct bench_image img;
+                img.name = std::filesystem::path(path).filename().string();
+                raw.dimensions(&img.width, &img.height);
+                img.px.assign(raw.data(), raw.data() + raw.size());
+                images.push_back(img);
+            }
+        }
+    }
+    catch(const char *e)
+    {
+        fprintf(stderr, "%s\n", e);
+        return EXIT_FAILURE;
+    }
+
+    const char *option_names[] = {"", "-m", "-a", "-m -a"};
+
+    printf("{\n  \"reps\": %u,\n  \"compiler\": \"%s\",\n  \"results\": [\n", reps, __VERSION__);
+    for (size_t i = 0; i < images.size(); i++) {
+        for (int o = 0; o < 4; o++) {
+            struct enc_options opts;
+            opts.model = o & 1;
+            opts.adaptive = o & 2;
+
+            std::vector<struct bench_stage> stages;
+            uint64_t encoded_size = 0;
+            Bench::run(&images[i], opts, reps, &stages, &encoded_size);
+            print_result(&images[i], option_names[o], encoded_size, &stages, false);
+        }
+        for (size_t c = 0; c < chains.size(); c++) {
+            std::vector<struct bench_stage> stages;
+            uint64_t encoded_size = 0;
+            Bench::run_chain(&images[i], &chains[c], reps, &stages, &encoded_size);
+            print_result(&images[i], "--chain " + chain_specs[c], encoded_size, &stages,
+                i + 1 == images.size() && c + 1 == chains.size());
+        }
+    }
+    printf("  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
@@ -4,12 +4,55 @@
  *
  * File created: 27.04.2021
  */
+#include <filesystem>
+#include <fstream>
+#include <getopt.h>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include "Archive.hpp"
+#include "Batch.hpp"
 #include "Codec.hpp"
+#include "DecodeCache.hpp"
 #include "Image.hpp"
+#include "Pipeline.hpp"
+#include "Stats.hpp"
+
+//! Names of the scan orders, indexed by DIRECTION_*.
+const char *scan_names[SCAN_ORDERS] = {"horizontal", "vertical", "hilbert", "zigzag"};
+
+/**
+ * Returns the scan order (DIRECTION_*) named `name`, or -1 if there is none.
+ */
+int parse_scan(const char *name)
+{
+    for (int i = 0; i < SCAN_ORDERS; i++) {
+        if (std::string(name) == scan_names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//! Names of the rotations, indexed by ROTATE_*.
+const char *rotate_names[] = {"transpose", "90", "180", "270"};
+
+/**
+ * Returns the rotation (ROTATE_*) named `name`, or -1 if there is none.
+ */
+int parse_rotate(const char *name)
+{
+    for (int i = 0; i <= ROTATE_270; i++) {
+        if (std::string(name) == rotate_names[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 void print_help(const char *prepend = "")
 {
@@ -23,18 +66,457 @@ void print_help(const char *prepend = "")
     printf("OPTIONS\n");
     printf("\t-m  Activate model for input data preprocessing.\n");
     printf("\t-a  Activate adaptive image scanning.\n");
+    printf("\t-E  Exhaustive search: encode with every combination of\n");
+    printf("\t    model and scan order (in parallel) and keep the\n");
+    printf("\t    smallest result. Overrides `-m`, `-a` and `--scan`.\n");
+    printf("\t-e  Effort level 0 (fastest) to 9 (best compression):\n");
+    printf("\t    0 uses neither the model nor adaptive scanning, 1\n");
+    printf("\t    adaptive scanning, 2-4 the options with the best size\n");
+    printf("\t    estimated from fewer to more samples, 5 encodes the best\n");
+    printf("\t    two estimates, 6 adds the hilbert and zigzag scans, 7\n");
+    printf("\t    encodes all estimates and those scans, 8 all models and\n");
+    printf("\t    scans and 9 tiled scans on top. Overrides `-m` (except\n");
+    printf("\t    for level 1), `-a` and `-E`.\n");
+    printf("\t--budget-ms\n");
+    printf("\t    Encoding time budget per image in milliseconds. The\n");
+    printf("\t    strategy of the effort level (9 if `-e` is not set) is\n");
+    printf("\t    downgraded when the budget would be overrun.\n");
+    printf("\t--depth\n");
+    printf("\t    Bits per pixel of the input image, 8 (default) or 16.\n");
+    printf("\t    16-bit pixels are little endian.\n");
+    printf("\t--chunk-rows\n");
+    printf("\t    Encode the image in independent chunks of this many\n");
+    printf("\t    rows, which bounds the memory used for intermediate\n");
+    printf("\t    data. Images of more than 2^32 pixels are always chunked.\n");
+    printf("\t--crc\n");
+    printf("\t    Store a CRC32C checksum of every chunk (the image is\n");
+    printf("\t    then always chunked, by default into chunks of about\n");
+    printf("\t    2^20 pixels). Decoding skips corrupt chunks, decodes\n");
+    printf("\t    the rest and reports the offsets of the corrupt ones.\n");
+    printf("\t--channels\n");
+    printf("\t    Interleaved channels per pixel of the input image: 1\n");
+    printf("\t    (default), 3 (RGB) or 4 (RGBA), each of `--depth` bits.\n");
+    printf("\t    The channels are encoded as separate planes in parallel.\n");
+    printf("\t--ycocg\n");
+    printf("\t    Convert RGB to YCoCg-R (losslessly) before encoding.\n");
+    printf("\t--scan\n");
+    printf("\t    Scan order: horizontal, vertical, hilbert (Hilbert curve\n");
+    printf("\t    through 64x64 blocks) or zigzag (through 8x8 blocks).\n");
+    printf("\t    Overrides `-a`.\n");
+    printf("\t--tile\n");
+    printf("\t    Scan the image in square tiles of this side (1-65535),\n");
+    printf("\t    each in the direction chosen for it. Overrides `-a`\n");
+    printf("\t    and cannot be combined with `-E` or `-e`.\n");
+    printf("\t--chain\n");
+    printf("\t    Encode with a chain of transform stages instead of the\n");
+    printf("\t    options above, e.g. `med,rle:vertical,huffman`. Stages:\n");
+    printf("\t    model (differences to the left pixel), med (median edge\n");
+    printf("\t    detector), rle[:scan] (run-length encoding, scan as for\n");
+    printf("\t    `--scan`) and huffman. The chain is stored in the header.\n");
+    printf("\t--rotate\n");
+    printf("\t    Transpose or rotate the encoded image `in_file` into\n");
+    printf("\t    the encoded image `out_file` (or all inputs with `-b`)\n");
+    printf("\t    instead of `-c` or `-d`: transpose, 90, 180 or 270\n");
+    printf("\t    (degrees clockwise). Images scanned horizontally or\n");
+    printf("\t    vertically without the model, tiles or chunks are\n");
+    printf("\t    transposed without decoding, others are re-encoded.\n");
+    printf("\t-n  Dry run: print the estimated encoded size and encoding\n");
+    printf("\t    time of the input image for every combination of model\n");
+    printf("\t    and scanning direction. `out_file` is not needed.\n");
+    printf("\t-b  Batch mode. `in_file` is a directory or a file listing\n");
+    printf("\t    one input path per line and `out_file` is the output\n");
+    printf("\t    directory. All inputs share the same width and options.\n");
+    printf("\t    The outputs are named after the inputs, with the `.enc`\n");
+    printf("\t    or `.raw` extension, so no two inputs may have the same\n");
+    printf("\t    name without their extensions.\n");
+    printf("\t-j  Number of worker threads in batch mode (default: number\n");
+    printf("\t    of hardware threads).\n");
+    printf("\t-r  Use archive file `archive`. With `-c`, the input image\n");
+    printf("\t    (or all inputs with `-b`) is compressed and appended to\n");
+    printf("\t    the archive. With `-d`, the entry selected by `-x` is\n");
+    printf("\t    decompressed to `out_file`.\n");
+    printf("\t-q  Sequence mode for `-c` with `-r`: the inputs (given with\n");
+    printf("\t    `-b`, in order) are frames of the same size. Frames are\n");
+    printf("\t    encoded as differences to their previous frame, except\n");
+    printf("\t    for keyframes.\n");
+    printf("\t--keyframe\n");
+    printf("\t    Every how many frames a keyframe is stored in sequence\n");
+    printf("\t    mode (default 30).\n");
+    printf("\t-x  Index of the archive entry to decompress (from 0).\n");
+    printf("\t-l  List the entries of the archive given by `-r` and exit.\n");
+    printf("\t-H  Print the minimum, maximum and histogram of the pixel\n");
+    printf("\t    values (the samples of all channels together) of the\n");
+    printf("\t    encoded image `in_file` and exit. The pixels are not\n");
+    printf("\t    decoded, unless the image was encoded with both `-m`\n");
+    printf("\t    and vertical scanning.\n");
+    printf("\t--verify\n");
+    printf("\t    Verify the checksums of the encoded image `in_file`\n");
+    printf("\t    (compressed with `--crc`) without decoding it, print\n");
+    printf("\t    the offsets of corrupt chunks and exit.\n");
+    printf("\t--serve\n");
+    printf("\t    Run a daemon, which decodes images for other processes\n");
+    printf("\t    on this host, listening on the Unix socket at the given\n");
+    printf("\t    path. The most recently used decoded images are kept in\n");
+    printf("\t    memory and shared with the clients without copying.\n");
+    printf("\t    Up to %d clients are served at a time.\n", CACHE_WORKERS);
+    printf("\t--cache-size\n");
+    printf("\t    Megabytes of decoded images (and of their encoded\n");
+    printf("\t    images) kept by `--serve` (default %d).\n", CACHE_SIZE_MB);
+    printf("\t--max-memory\n");
+    printf("\t    With `-d`, decode within about this many megabytes (at\n");
+    printf("\t    least %d): the stages are fused and run a band of rows at\n", MIN_MEMORY_MB);
+    printf("\t    a time on one thread. Large vertically scanned images are\n");
+    printf("\t    staged in a temporary file next to `out_file`. The peak\n");
+    printf("\t    memory of the process is printed to stderr.\n");
+    printf("\t--cache\n");
+    printf("\t    With `-d`, have the daemon listening on the given socket\n");
+    printf("\t    decode `in_file` (see `--serve`).\n");
+    printf("\t-t  Train a Huffman model from the input image (or all\n");
+    printf("\t    inputs with `-b`) and save it to `out_file`. Use the same\n");
+    printf("\t    `-m` and `-a` options as will be used for compression.\n");
+    printf("\t-p  Prime the Huffman coder with the model `model_file`. When\n");
+    printf("\t    decompressing, the model must be the one used during\n");
+    printf("\t    compression. May be given repeatedly for decompression.\n");
+    printf("\t-s  Print profiling statistics to stderr when done.\n");
+    printf("\t-S  Write profiling statistics as JSON to `stats_file`.\n");
+    printf("\t    Statistics are collected only if built with `make STATS=1`.\n");
     printf("\t-h  Print this help and exit.\n");
 }
 
+/**
+ * Report the profiling statistics of this thread (batch workers included),
+ * as requested by the `-s` and `-S` options.
+ */
+void report_stats(bool print, std::string json_path)
+{
+    if (print) {
+        stats_print(&thread_stats);
+    }
+    if (json_path.length() > 0) {
+        try
+        {
+            stats_write_json(&thread_stats, json_path);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+        }
+    }
+}
+
+/**
+ * Print the peak resident memory of the process to stderr. Unlike
+ * getrusage(), VmHWM does not include the peak of the parent process
+ * (before exec).
+ */
+void report_peak_memory()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            fprintf(stderr, "Peak memory: %.1f MiB\n", atol(line.c_str() + 6) / 1024.0);
+            return;
+        }
+    }
+}
+
+/**
+ * Train a Huffman model from the images in `inputs` and save it to `out_path`.
+ */
+int train_model(
+    std::vector<std::string> inputs, std::string out_path,
+    uint32_t width, struct enc_options opts)
+{
+    uint64_t hist[256] = {};
+    Image img;
+
+    for (auto &in_path : inputs) {
+        img.load(in_path, width, opts.depth);
+        uint32_t w, h;
+        img.dimensions(&w, &h);
+        Codec::symbol_histogram(img.data(), w, h, opts, hist);
+    }
+
+    HuffmanModel model(hist);
+    model.save(out_path);
+    printf("Model id: 0x%08x\n", model.id());
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Print the estimated encoding results of image `in_path` for all option sets.
+ */
+int print_estimates(std::string in_path, uint32_t width, struct enc_options opts)
+{
+    Image img;
+    img.load(in_path, width, opts.depth);
+    uint32_t w, h;
+    img.dimensions(&w, &h);
+
+    std::vector<struct size_estimate> estimates;
+    Codec::estimate(img.data(), w, h, opts, &estimates);
+
+    printf("model\tdirection\tbytes\tseconds\n");
+    for (auto &e : estimates) {
+        printf("%d\t%s\t%lu\t%.6f\n", e.opts.model,
+            scan_names[e.opts.direction],
+            (unsigned long) e.bytes, e.seconds);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Print the pixel value statistics of encoded image `in_path` to stdout.
+ */
+int print_pixel_stats(std::string in_path)
+{
+    std::ifstream fs(in_path, std::ios_base::in | std::ios_base::binary);
+    if (!fs.is_open()) {
+        throw "Could not open the encoded image.";
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(fs)),
+        std::istreambuf_iterator<char>());
+
+    struct pixel_stats stats;
+    Codec::pixel_statistics(data.data(), data.size(), &stats);
+
+    printf("pixels\t%lu\n", (unsigned long) stats.pixels);
+    printf("samples\t%lu\n", (unsigned long) stats.samples);
+    printf("min\t%u\n", stats.min);
+    printf("max\t%u\n", stats.max);
+    for (size_t value = 0; value < stats.histogram.size(); value++) {
+        if (stats.histogram[value] > 0) {
+            printf("%lu\t%lu\n", (unsigned long) value,
+                (unsigned long) stats.histogram[value]);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Verify the checksums of encoded image `in_path` and print the offsets
+ * of its corrupt chunks to stdout.
+ */
+int verify_file(std::string in_path)
+{
+    std::ifstream fs(in_path, std::ios_base::in | std::ios_base::binary);
+    if (!fs.is_open()) {
+        throw "Could not open the encoded image.";
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(fs)),
+        std::istreambuf_iterator<char>());
+
+    std::vector<uint64_t> bad;
+    const uint64_t chunks = Codec::verify(data.data(), data.size(), &bad);
+
+    printf("chunks\t%lu\n", (unsigned long) chunks);
+    printf("corrupt\t%lu\n", (unsigned long) bad.size());
+    for (uint64_t offset : bad) {
+        printf("offset\t%lu\n", (unsigned long) offset);
+    }
+
+    return bad.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Print the offsets of the corrupt chunks `bad` of the encoded image
+ * `in_path` to stderr.
+ */
+void print_corrupt_blocks(const std::string &in_path, const std::vector<uint64_t> &bad)
+{
+    for (uint64_t offset : bad) {
+        std::cerr << in_path << ": corrupt chunk at offset " << offset << '\n';
+    }
+}
+
+/**
+ * Rotate the encoded image `in_path` by `turn` (one of ROTATE_*) into
+ * the encoded image `out_path`.
+ */
+int rotate_file(std::string in_path, std::string out_path, uint8_t turn)
+{
+    std::ifstream fs(in_path, std::ios_base::in | std::ios_base::binary);
+    if (!fs.is_open()) {
+        throw "Could not open the encoded image.";
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(fs)),
+        std::istreambuf_iterator<char>());
+
+    std::vector<uint8_t> out;
+    Codec::rotate(data.data(), data.size(), turn, &out);
+
+    std::ofstream ofs(out_path, std::ios_base::out | std::ios_base::binary);
+    ofs.write((const char *) out.data(), out.size());
+    if (!ofs) {
+        throw "Output file could not be written.";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Decode the encoded image `in_path` into `out_path` through the cache
+ * daemon listening on `socket_path` (see DecodeCache).
+ */
+int cached_decode(std::string socket_path, std::string in_path, std::string out_path)
+{
+    const int sock = DecodeCache::connect(socket_path);
+    const int enc_fd = open(in_path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct cached_image img;
+    try
+    {
+        if (enc_fd < 0) {
+            throw "Could not open the encoded image.";
+        }
+        DecodeCache::request(sock, enc_fd, &img);
+    }
+    catch(const char *e)
+    {
+        if (enc_fd >= 0) {
+            close(enc_fd);
+        }
+        close(sock);
+        throw;
+    }
+    close(enc_fd);
+    close(sock);
+
+    std::ofstream ofs(out_path, std::ios_base::out | std::ios_base::binary);
+    ofs.write((const char *) img.data, img.info.size);
+    DecodeCache::release(&img);
+    if (!ofs) {
+        throw "Output file could not be written.";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Compress the images in `inputs` and append them to archive `ar_path`.
+ * If `keyframe` is not 0, the inputs are frames of a sequence: every
+ * `keyframe`-th frame (starting with the first one) is encoded on its own,
+ * the others as delta frames to their previous frame.
+ */
+int archive_append(
+    std::string ar_path, std::vector<std::string> inputs,
+    uint32_t width, struct enc_options opts, uint32_t keyframe)
+{
+    Archive ar(ar_path, true);
+    Image frames[2]; // The current and the previous frame, alternating.
+    struct codec_buffers buf;
+    std::vector<uint8_t> out;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        Image *img = &frames[i % 2], *previous = &frames[(i + 1) % 2];
+        img->load(inputs[i], width, opts.depth, opts.channels);
+        uint32_t w, h;
+        img->dimensions(&w, &h);
+        if (keyframe > 0 && i % keyframe != 0) {
+            uint32_t pw, ph;
+            previous->dimensions(&pw, &ph);
+            if (w != pw || h != ph) {
+                throw "All frames of a sequence must have the same size.";
+            }
+            Codec::encode_delta(img->data(), previous->data(), w, h, opts, &out, &buf);
+        } else {
+            Codec::encode(img->data(), w, h, opts, &out, &buf);
+        }
+        ar.append(std::filesystem::path(inputs[i]).filename().string(),
+            out.data(), out.size());
+    }
+    ar.flush();
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Print the entries of archive `ar_path` to stdout.
+ */
+int archive_list(std::string ar_path)
+{
+    Archive ar(ar_path);
+
+    for (uint64_t i = 0; i < ar.count(); i++) {
+        const struct archive_entry e = ar.entry(i);
+        printf("%lu\t%s\t%ux%u\topts=0x%02x\t%lu bytes\n",
+            (unsigned long) i, e.name.c_str(), e.width, e.height,
+            e.options, (unsigned long) e.size);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Decompress entry `index` of archive `ar_path` to raw image `out_path`.
+ */
+int archive_extract(std::string ar_path, uint64_t index, std::string out_path)
+{
+    Archive ar(ar_path);
+    std::vector<uint8_t> pixels;
+    uint32_t width, height;
+
+    ar.extract(index, &pixels, &width, &height);
+
+    Image img(std::move(pixels), width, height);
+    img.write_out(out_path);
+
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
     int opt;
-    bool compress, model = false, adaptive = false;
-    int width = 0;
-    std::string f_in = "", f_out = "";
+    bool compress = false, model = false, adaptive = false, batch = false;
+    bool search = false, dry_run = false, effort_set = false;
+    bool list = false, train = false, print_stats = false, histogram = false;
+    bool checksum = false, verify = false;
+    std::string f_serve = "", f_cache = "";
+    long long cache_size = CACHE_SIZE_MB;
+    long long max_memory = 0;
+    std::string f_stats = "";
+    std::vector<std::string> f_models;
+    int width = 0, threads = 0, effort = -1, depth = 8;
+    long budget_ms = 0;
+    long long chunk_rows = 0;
+    long tile = 0;
+    int scan = -1;
+    int channels = 1;
+    bool ycocg = false;
+    std::string chain_spec = "";
+    bool chain_set = false;
+    int turn = -1;
+    long keyframe = 30;
+    bool sequence = false;
+    long long index = -1;
+    std::string f_in = "", f_out = "", f_archive = "";
     bool compress_set = false;
 
-    while ((opt = getopt(argc, argv, "cdmai:o:w:h")) != -1) {
+    const struct option long_opts[] = {
+        {"budget-ms", required_argument, nullptr, 'B'},
+        {"depth", required_argument, nullptr, 'D'},
+        {"chunk-rows", required_argument, nullptr, 'C'},
+        {"keyframe", required_argument, nullptr, 'K'},
+        {"tile", required_argument, nullptr, 'T'},
+        {"scan", required_argument, nullptr, 'O'},
+        {"channels", required_argument, nullptr, 'L'},
+        {"ycocg", no_argument, nullptr, 'Y'},
+        {"rotate", required_argument, nullptr, 'R'},
+        {"crc", no_argument, nullptr, 'U'},
+        {"verify", no_argument, nullptr, 'V'},
+        {"serve", required_argument, nullptr, 'W'},
+        {"cache", required_argument, nullptr, 'A'},
+        {"cache-size", required_argument, nullptr, 'Z'},
+        {"chain", required_argument, nullptr, 'G'},
+        {"max-memory", required_argument, nullptr, 'X'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "cdmaEe:nbj:r:qx:lHtp:sS:i:o:w:h",
+        long_opts, nullptr)) != -1) {
         switch (opt)
         {
         case 'c':
@@ -51,6 +533,112 @@ int main(int argc, char *argv[])
         case 'a':
             adaptive = true;
             break;
+        case 'E':
+            search = true;
+            break;
+        case 'e':
+            effort = atoi(optarg);
+            effort_set = true;
+            break;
+        case 'B':
+            budget_ms = atol(optarg);
+            break;
+        case 'D':
+            depth = atoi(optarg);
+            break;
+        case 'C':
+            chunk_rows = atoll(optarg);
+            break;
+        case 'O':
+            scan = parse_scan(optarg);
+            if (scan < 0) {
+                print_help("The --scan parameter must be horizontal, vertical, hilbert or zigzag.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'L':
+            channels = atoi(optarg);
+            break;
+        case 'Y':
+            ycocg = true;
+            break;
+        case 'U':
+            checksum = true;
+            break;
+        case 'V':
+            verify = true;
+            break;
+        case 'W':
+            f_serve = optarg;
+            break;
+        case 'A':
+            f_cache = optarg;
+            break;
+        case 'Z':
+            cache_size = atoll(optarg);
+            break;
+        case 'X':
+            max_memory = atoll(optarg);
+            if (max_memory < MIN_MEMORY_MB || max_memory > (long long) (UINT64_MAX >> 20)) {
+                const std::string message = "The --max-memory parameter must be at least "
+                    + std::to_string(MIN_MEMORY_MB) + ".\n";
+                print_help(message.c_str());
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'G':
+            chain_spec = optarg;
+            chain_set = true;
+            break;
+        case 'R':
+            turn = parse_rotate(optarg);
+            if (turn < 0) {
+                print_help("The --rotate parameter must be transpose, 90, 180 or 270.\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T':
+            tile = atol(optarg);
+            break;
+        case 'q':
+            sequence = true;
+            break;
+        case 'K':
+            keyframe = atol(optarg);
+            break;
+        case 'n':
+            dry_run = true;
+            break;
+        case 'b':
+            batch = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            f_archive = optarg;
+            break;
+        case 'x':
+            index = atoll(optarg);
+            break;
+        case 'l':
+            list = true;
+            break;
+        case 'H':
+            histogram = true;
+            break;
+        case 't':
+            train = true;
+            break;
+        case 's':
+            print_stats = true;
+            break;
+        case 'S':
+            f_stats = optarg;
+            break;
+        case 'p':
+            f_models.push_back(optarg);
+            break;
         case 'i':
             f_in = optarg;
             break;
@@ -70,37 +658,374 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!compress_set) {
+    // Loaded models must live until the end of the program. They are
+    // registered before anything decodes, so that primed images are found
+    // by -H, --verify and --serve too.
+    std::vector<std::unique_ptr<HuffmanModel>> models;
+    try
+    {
+        for (auto &f_model : f_models) {
+            models.emplace_back(new HuffmanModel(f_model));
+            HuffmanModel::add(models.back().get());
+        }
+    }
+    catch(const char *e)
+    {
+        std::cerr << e << '\n';
+        return EXIT_FAILURE;
+    }
+
+    if (list) {
+        if (f_archive.length() == 0) {
+            print_help("Listing requires the -r parameter.\n");
+            return EXIT_FAILURE;
+        }
+        try
+        {
+            return archive_list(f_archive);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (histogram) {
+        if (f_in.length() == 0) {
+            print_help("The histogram requires the -i parameter.\n");
+            return EXIT_FAILURE;
+        }
+        try
+        {
+            return print_pixel_stats(f_in);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (verify) {
+        if (f_in.length() == 0) {
+            print_help("Verification requires the -i parameter.\n");
+            return EXIT_FAILURE;
+        }
+        try
+        {
+            return verify_file(f_in);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (f_serve.length() > 0) {
+        if (cache_size < 1 || cache_size > (long long) (UINT64_MAX >> 20)) {
+            print_help("The --cache-size parameter must be at least 1.\n");
+            return EXIT_FAILURE;
+        }
+        try
+        {
+            DecodeCache cache(f_serve, (uint64_t) cache_size << 20);
+            cache.run();
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+        }
+        return EXIT_FAILURE;
+    }
+
+    if (train || dry_run) {
+        // Training and dry runs behave as compression for the purposes of checks below.
+        compress = true;
+        compress_set = true;
+    }
+
+    if (turn >= 0 && (compress_set || f_archive.length() > 0)) {
+        print_help("The --rotate parameter cannot be combined with -c, -d, -t, -n or -r.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!compress_set && turn < 0) {
         print_help("Choose -c or -d for compression/decompression.\n");
         return EXIT_FAILURE;
     }
 
-    if (f_in.length() == 0 || f_out.length() == 0) {
+    // An archive replaces the output file when compressing
+    // and the input file when decompressing.
+    const bool in_set = f_in.length() > 0 || (!compress && f_archive.length() > 0);
+    const bool out_set = f_out.length() > 0 || dry_run
+        || (compress && f_archive.length() > 0);
+    if (!in_set || !out_set) {
         print_help("Input and output files must always be set.\n");
         return EXIT_FAILURE;
     }
 
+    if (f_cache.length() > 0 && (compress || batch || f_archive.length() > 0)) {
+        print_help("The --cache parameter requires -d and cannot be combined with -b or -r.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (max_memory > 0 && (compress || batch || f_archive.length() > 0 || f_cache.length() > 0)) {
+        print_help("The --max-memory parameter requires -d and cannot be combined with -b, -r or --cache.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!compress && f_archive.length() > 0 && index < 0) {
+        print_help("When decompressing from an archive, -x must be set.\n");
+        return EXIT_FAILURE;
+    }
+
 
     if (compress && width < 1) {
         print_help("When compressing, the -w parameter must be set.\n");
         return EXIT_FAILURE;
     }
 
+    if (effort_set && (effort < 0 || effort > 9)) {
+        print_help("The -e parameter must be between 0 and 9.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (depth != 8 && depth != 16) {
+        print_help("The --depth parameter must be 8 or 16.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (chunk_rows < 0 || chunk_rows > UINT32_MAX) {
+        print_help("The --chunk-rows parameter must be between 0 and 2^32-1.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (tile < 0 || tile > UINT16_MAX) {
+        print_help("The --tile parameter must be between 1 and 65535.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (tile > 0 && (search || effort_set || budget_ms > 0)) {
+        print_help("The --tile parameter cannot be combined with -E, -e or --budget-ms.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (channels != 1 && channels != 3 && channels != 4) {
+        print_help("The --channels parameter must be 1, 3 or 4.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (ycocg && channels < 3) {
+        print_help("The --ycocg parameter requires 3 or 4 channels.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (channels > 1 && (train || dry_run)) {
+        print_help("Training and dry runs support single-channel images only.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (scan >= 0 && tile > 0) {
+        print_help("The --scan and --tile parameters cannot be combined.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (chain_set && (!compress || train || dry_run || model || adaptive
+        || search || effort_set || budget_ms > 0 || scan >= 0 || tile > 0
+        || chunk_rows > 0 || checksum || f_models.size() > 0)) {
+        print_help("The --chain parameter requires -c and cannot be combined with -t, -n, -m, -a,\n"
+            "-E, -e, -p, --budget-ms, --scan, --tile, --chunk-rows or --crc.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (sequence && (f_archive.length() == 0 || !compress)) {
+        print_help("Sequence mode requires -c and the -r parameter.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (keyframe < 1 || keyframe > UINT32_MAX) {
+        print_help("The --keyframe parameter must be at least 1.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (budget_ms < 0) {
+        print_help("The --budget-ms parameter must not be negative.\n");
+        return EXIT_FAILURE;
+    }
+
     struct enc_options opts;
     opts.model = false; // Default is without model.
     opts.adaptive = false; // Default is non-adaptive.
 
     model ? opts.model = true : opts.model = false;
     adaptive ? opts.adaptive = true : opts.adaptive = false;
+    opts.search = search;
+    opts.tile = (uint16_t) tile;
+    opts.scan = scan;
+    opts.channels = (uint8_t) channels;
+    opts.color_transform = ycocg;
+    if (effort_set) {
+        opts.effort = effort;
+    } else if (budget_ms > 0) {
+        opts.effort = 9;
+    }
+    opts.budget_ms = (uint32_t) budget_ms;
+    opts.depth = (uint8_t) depth;
+    opts.chunk_rows = (uint32_t) chunk_rows;
+    opts.checksum = checksum;
+
+    Pipeline chain;
+    if (chain_set) {
+        try
+        {
+            chain.parse(chain_spec);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+        opts.chain = &chain;
+    }
+
+    if (train) {
+        try
+        {
+            std::vector<std::string> inputs = batch ?
+                Batch::collect_inputs(f_in) : std::vector<std::string>{f_in};
+            return train_model(inputs, f_out, width, opts);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+    if (compress && models.size() > 0) {
+        opts.huffman_model = models.back().get();
+    }
+
+    if (turn >= 0) {
+        if (batch) {
+            struct batch_stats stats;
+            try
+            {
+                Batch runner(Batch::collect_inputs(f_in), f_out,
+                    threads > 0 ? threads : 0); // 0 = hardware threads
+                stats = runner.rotate((uint8_t) turn);
+            }
+            catch(const char *e)
+            {
+                std::cerr << e << '\n';
+                return EXIT_FAILURE;
+            }
+            Batch::print_stats(&stats);
+            report_stats(print_stats, f_stats);
+            return stats.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        try
+        {
+            const int ret = rotate_file(f_in, f_out, (uint8_t) turn);
+            report_stats(print_stats, f_stats);
+            return ret;
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (dry_run) {
+        try
+        {
+            return print_estimates(f_in, width, opts);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (f_archive.length() > 0) {
+        try
+        {
+            int ret;
+            if (compress) {
+                std::vector<std::string> inputs = batch ?
+                    Batch::collect_inputs(f_in) : std::vector<std::string>{f_in};
+                ret = archive_append(f_archive, inputs, width, opts,
+                    sequence ? (uint32_t) keyframe : 0);
+            } else {
+                ret = archive_extract(f_archive, index, f_out);
+            }
+            report_stats(print_stats, f_stats);
+            return ret;
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (batch) {
+        struct batch_stats stats;
+        try
+        {
+            Batch runner(Batch::collect_inputs(f_in), f_out,
+                threads > 0 ? threads : 0); // 0 = hardware threads
+            stats = compress ? runner.compress(width, opts) : runner.decompress();
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+        Batch::print_stats(&stats);
+        report_stats(print_stats, f_stats);
+        return stats.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (f_cache.length() > 0) {
+        try
+        {
+            return cached_decode(f_cache, f_in, f_out);
+        }
+        catch(const char *e)
+        {
+            std::cerr << e << '\n';
+            return EXIT_FAILURE;
+        }
+    }
 
     Codec img;
-    if (compress) {
-        img.open_image(f_in, width);
-        img.encode(f_out, opts);
-    } else {
-        img.open_image(f_in);
-        img.save_raw(f_out);
+    try
+    {
+        if (compress) {
+            img.open_image(f_in, width, opts.depth, opts.channels);
+            img.encode(f_out, opts);
+        } else if (max_memory > 0) {
+            img.decode_bounded(f_in, f_out, (uint64_t) max_memory << 20);
+            report_peak_memory();
+        } else {
+            img.decode(f_in, f_out);
+        }
     }
+    catch(const char *e)
+    {
+        std::cerr << e << '\n';
+        print_corrupt_blocks(f_in, img.corrupt_blocks());
+        if (max_memory > 0) {
+            report_peak_memory();
+        }
+        return EXIT_FAILURE;
+    }
+
+    report_stats(print_stats, f_stats);
 
     return 0;
 }
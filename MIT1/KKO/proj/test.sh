@@ -62,4 +62,122 @@ do
 
         printf '\n//////////////////////////////////////////////////////////////////////\n' >> "$stats"
     done
-done
\ No newline at end of file
+done
+
+##
+## Round trips of the other features. Every check prints PASS or FAIL
+## to stdout and to the logfile, the script fails if any check failed.
+##
+failed=0
+
+check(){
+    ## compare the original $2 with the decoded $3 of the check named $1
+    if cmp -s "$2" "$3"; then
+        printf "PASS %s\n" "$1" | tee -a "$stats"
+    else
+        printf "FAIL %s\n" "$1" | tee -a "$stats"
+        failed=1
+        return 1
+    fi
+}
+
+roundtrip(){
+    ## encode $2 of width $3 with the options $4, decode it with the
+    ## options $5 and compare the result, under the check name $1
+    local enc_file="$test_dir$1.enc" dec_file="$test_dir$1.dec"
+    runthis "./huff_codec -c -i \"$2\" -o \"$enc_file\" -w $3 $4" &&
+        runthis "./huff_codec -d -i \"$enc_file\" -o \"$dec_file\" $5"
+    check "$1" "$2" "$dec_file"
+}
+
+printf "========================================\n" >> "$stats"
+printf "\tFeature round trips\n" >> "$stats"
+printf "========================================\n" >> "$stats"
+
+for raw_file in "$raw_dir"*.raw
+do
+    name=$(basename "$raw_file" .raw)
+
+    # The 512 pixel wide 8-bit images are read as 256 pixels of 16 bits
+    # or as 128 RGBA pixels.
+    roundtrip "$name-depth16" "$raw_file" 256 "--depth 16"
+    roundtrip "$name-depth16-m" "$raw_file" 256 "--depth 16 -m -a"
+    roundtrip "$name-rgba" "$raw_file" 128 "--channels 4"
+    roundtrip "$name-rgba-ycocg" "$raw_file" 128 "--channels 4 --ycocg -m"
+
+    roundtrip "$name-chunked" "$raw_file" 512 "-m --chunk-rows 37"
+    roundtrip "$name-crc" "$raw_file" 512 "-m --crc --scan hilbert"
+    roundtrip "$name-tiled" "$raw_file" 512 "-m --tile 48"
+
+    roundtrip "$name-bounded" "$raw_file" 512 "-m --scan vertical" "--max-memory 9"
+    roundtrip "$name-bounded-crc" "$raw_file" 512 "-m --crc" "--max-memory 9"
+
+    # Rotating by 90 and then by 270 degrees gives back the original
+    # (the second image is re-encoded, as it is scanned with the model).
+    enc_file="$test_dir$name-rotate.enc"
+    runthis "./huff_codec -c -i \"$raw_file\" -o \"$enc_file\" -w 512 -a" &&
+        runthis "./huff_codec --rotate 90 -i \"$enc_file\" -o \"$enc_file.90\"" &&
+        runthis "./huff_codec --rotate 270 -i \"$enc_file.90\" -o \"$enc_file.360\"" &&
+        runthis "./huff_codec -d -i \"$enc_file.360\" -o \"$test_dir$name-rotate.dec\""
+    check "$name-rotate" "$raw_file" "$test_dir$name-rotate.dec"
+done
+
+# Batch mode: compress and decompress all images of a directory.
+rm -rf "${test_dir}batch_enc" "${test_dir}batch_dec"
+runthis "./huff_codec -c -b -i \"$raw_dir\" -o \"${test_dir}batch_enc\" -w 512 -m -a" &&
+    runthis "./huff_codec -d -b -i \"${test_dir}batch_enc\" -o \"${test_dir}batch_dec\""
+for raw_file in "$raw_dir"*.raw
+do
+    check "batch-$(basename "$raw_file" .raw)" "$raw_file" "${test_dir}batch_dec/$(basename "$raw_file")"
+done
+
+# Archive: append all images and extract every entry by its index.
+archive="${test_dir}archive.kko"
+rm -f "$archive"
+runthis "./huff_codec -c -b -i \"$raw_dir\" -r \"$archive\" -w 512 -m"
+./huff_codec -l -r "$archive" 2>> "$stats" | while read -r index entry rest
+do
+    runthis "./huff_codec -d -r \"$archive\" -x $index -o \"${test_dir}archive-$entry\""
+    check "archive-$entry" "$raw_dir$entry" "${test_dir}archive-$entry" || exit 1
+done || failed=1
+
+# Archive appended to by separate processes: it must hold only the data,
+# one directory (40 bytes and the name per entry) and the 72 byte header.
+small="${test_dir}small.raw"
+appended="${test_dir}appended.kko"
+head -c 64 /dev/zero > "$small"
+rm -f "$appended"
+for i in $(seq 100)
+do
+    runthis "./huff_codec -c -i \"$small\" -r \"$appended\" -w 8" || break
+done
+payload=$(./huff_codec -l -r "$appended" 2>> "$stats" | awk '{ sum += $5 } END { print sum }')
+entry=$(basename "$small")
+expected=$((payload + 100 * (40 + ${#entry}) + 72))
+if [ "$(stat -c %s "$appended")" -eq "$expected" ]; then
+    printf "PASS archive-size\n" | tee -a "$stats"
+else
+    printf "FAIL archive-size\n" | tee -a "$stats"
+    failed=1
+fi
+
+# Delta frames: a sequence of the first image and two altered copies of it.
+first=$(ls "$raw_dir"*.raw | head -n 1)
+frames="${test_dir}frames"
+sequence="${test_dir}sequence.kko"
+cp "$first" "${test_dir}frame1.raw"
+cp "$first" "${test_dir}frame2.raw"
+printf '\x00\xff\x10\x20' | dd of="${test_dir}frame1.raw" bs=1 seek=1000 conv=notrunc 2> /dev/null
+printf '\x7f\x7f\x7f\x7f' | dd of="${test_dir}frame2.raw" bs=1 seek=5000 conv=notrunc 2> /dev/null
+printf "%s\n" "$first" "${test_dir}frame1.raw" "${test_dir}frame2.raw" > "$frames"
+rm -f "$sequence"
+runthis "./huff_codec -c -q -b -i \"$frames\" -r \"$sequence\" -w 512 -m --keyframe 2"
+index=0
+while read -r frame
+do
+    runthis "./huff_codec -d -r \"$sequence\" -x $index -o \"${test_dir}frame-$index.dec\""
+    check "delta-frame-$index" "$frame" "${test_dir}frame-$index.dec"
+    index=$((index + 1))
+done < "$frames"
+
+exit $failed